@@ -0,0 +1,235 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Airtime accounting for the transmit bands.
+ *
+ * Every band is in the one 433.05-434.79MHz sub-band, which has a budget
+ * of dutyCycle * AIRTIME_WINDOW_SECONDS, counted in AIRTIME_SLOTS slots so
+ * that old airtime drops out of the window.  A token bucket refilled at
+ * the duty cycle rate stops the budget being used up in one burst.
+ * Transmissions that can wait are told to when they would leave less than
+ * AIRTIME_RESERVE_PERCENT of either, which is kept for those that can't
+ * (eTRV replies).  Those are always allowed, and counted.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "airtime.h"
+
+struct window {
+    int64_t slotUs[AIRTIME_SLOTS];      // Airtime used in each slot
+    time_t slotTime[AIRTIME_SLOTS];     // Start of the slot the airtime belongs to
+};
+
+struct band {
+    struct window window;
+    unsigned long transmissions;
+    unsigned long refusals;
+    unsigned long overBudget;
+};
+
+struct subBand {
+    struct window window;
+    int64_t tokensUs;
+    struct timespec lastRefill;
+};
+
+static struct band bands[BAND_COUNT];
+static struct subBand subBand;
+static double dutyCycle = 0.1;          // ETSI EN 300 220 433.05-434.79MHz limit
+static bool initialised = false;
+static pthread_mutex_t airtimeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t bucketSizeUs(void) {
+    return (int64_t)(dutyCycle * AIRTIME_BUCKET_SECONDS * 1000000);
+}
+
+static int64_t windowBudgetUs(void) {
+    return (int64_t)(dutyCycle * AIRTIME_WINDOW_SECONDS * 1000000);
+}
+
+/* Must be called with airtimeMutex held */
+static void initialise(void) {
+
+    memset(bands, 0, sizeof(bands));
+    memset(&subBand, 0, sizeof(subBand));
+    subBand.tokensUs = bucketSizeUs();
+    clock_gettime(CLOCK_MONOTONIC, &subBand.lastRefill);
+    initialised = true;
+}
+
+/* Adds the tokens earned since the last refill.
+ * Must be called with airtimeMutex held.
+ */
+static void refill(void) {
+
+    struct timespec now;
+    int64_t elapsedUs;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsedUs = (now.tv_sec - subBand.lastRefill.tv_sec) * 1000000LL 
+        + (now.tv_nsec - subBand.lastRefill.tv_nsec) / 1000;
+    subBand.lastRefill = now;
+
+    subBand.tokensUs += (int64_t)(elapsedUs * dutyCycle);
+    if (subBand.tokensUs > bucketSizeUs()) {
+        subBand.tokensUs = bucketSizeUs();
+    }
+}
+
+/* Returns the airtime counted in window in the last AIRTIME_WINDOW_SECONDS.
+ * Must be called with airtimeMutex held.
+ */
+static int64_t windowUsed(const struct window *window) {
+
+    time_t now = time(NULL);
+    int64_t used = 0;
+    int i;
+
+    for (i = 0; i < AIRTIME_SLOTS; ++i) {
+        if (now - window->slotTime[i] < AIRTIME_WINDOW_SECONDS) {
+            used += window->slotUs[i];
+        }
+    }
+    return used;
+}
+
+/* Must be called with airtimeMutex held */
+static void count(struct window *window, int64_t airtimeUs) {
+
+    time_t now = time(NULL);
+    time_t slotStart = now - (now % AIRTIME_SLOT_SECONDS);
+    int slot = (now / AIRTIME_SLOT_SECONDS) % AIRTIME_SLOTS;
+
+    if (window->slotTime[slot] != slotStart) {
+        window->slotTime[slot] = slotStart;
+        window->slotUs[slot] = 0;
+    }
+    window->slotUs[slot] += airtimeUs;
+}
+
+/* Must be called with airtimeMutex held */
+static void charge(struct band *band, int64_t airtimeUs) {
+
+    count(&band->window, airtimeUs);
+    count(&subBand.window, airtimeUs);
+    subBand.tokensUs -= airtimeUs;
+    band->transmissions++;
+}
+
+/* Sets the proportion of time the sub-band may be transmitted on.  When
+ * changed while running, the tokens are kept, up to the new bucket size,
+ * as are the statistics.
+ */
+void airtimeSetDutyCycle(double percent) {
+
+    pthread_mutex_lock(&airtimeMutex);
+    if (!initialised) {
+        dutyCycle = percent / 100.0;
+        initialise();
+        pthread_mutex_unlock(&airtimeMutex);
+        return;
+    }
+
+    // Tokens earned so far are at the old rate
+    refill();
+    dutyCycle = percent / 100.0;
+    if (subBand.tokensUs > bucketSizeUs()) {
+        subBand.tokensUs = bucketSizeUs();
+    }
+    pthread_mutex_unlock(&airtimeMutex);
+}
+
+/* Asks to transmit for airtimeUs on band.  Returns true, having counted
+ * the airtime, if the transmission should go ahead now.  Returns false
+ * if it is deferrable and would eat into the reserve, in which case it
+ * should be asked for again later.
+ */
+bool airtimeRequest(enum airtimeBand band, int64_t airtimeUs, bool deferrable) {
+
+    struct band *b = &bands[band];
+    int64_t reserveTokensUs = 0;
+    int64_t reserveWindowUs = 0;
+    bool withinBudget;
+
+    pthread_mutex_lock(&airtimeMutex);
+    if (!initialised) {
+        initialise();
+    }
+
+    refill();
+    if (deferrable) {
+        reserveTokensUs = bucketSizeUs() * AIRTIME_RESERVE_PERCENT / 100;
+        reserveWindowUs = windowBudgetUs() * AIRTIME_RESERVE_PERCENT / 100;
+    }
+    withinBudget = subBand.tokensUs - airtimeUs >= reserveTokensUs
+        && windowUsed(&subBand.window) + airtimeUs <= windowBudgetUs() - reserveWindowUs;
+
+    if (!withinBudget) {
+        if (deferrable) {
+            b->refusals++;
+            pthread_mutex_unlock(&airtimeMutex);
+            return false;
+        }
+        b->overBudget++;
+    }
+
+    charge(b, airtimeUs);
+    pthread_mutex_unlock(&airtimeMutex);
+    return true;
+}
+
+void airtimeGetStatistics(enum airtimeBand band, struct airtimeStatistics *stats) {
+
+    struct band *b = &bands[band];
+
+    pthread_mutex_lock(&airtimeMutex);
+    if (!initialised) {
+        initialise();
+    }
+    refill();
+    stats->windowUsedUs = windowUsed(&b->window);
+    stats->subBandUsedUs = windowUsed(&subBand.window);
+    stats->windowBudgetUs = windowBudgetUs();
+    stats->tokensUs = subBand.tokensUs;
+    stats->transmissions = b->transmissions;
+    stats->refusals = b->refusals;
+    stats->overBudget = b->overBudget;
+    pthread_mutex_unlock(&airtimeMutex);
+}
+
+const char *airtimeBandName(enum airtimeBand band) {
+
+    switch (band) {
+        case BAND_OOK_433:
+            return "433.92MHz OOK";
+        case BAND_FSK_434:
+            return "434.3MHz FSK";
+        default:
+            return "Unknown";
+    }
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
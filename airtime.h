@@ -0,0 +1,44 @@
+#ifndef AIRTIME_H
+#define AIRTIME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Radio bands transmitted on.  Both are in the ETSI EN 300 220 
+ * 433.05-434.79MHz sub-band, so share one duty cycle, with airtime 
+ * counted over a sliding hour and smoothed by a token bucket.
+ */
+enum airtimeBand {
+    BAND_OOK_433,               // 433.92MHz ENER002 sockets
+    BAND_FSK_434,               // 434.3MHz OpenThings devices
+    BAND_COUNT
+};
+
+#define AIRTIME_WINDOW_SECONDS  3600
+#define AIRTIME_SLOT_SECONDS    60
+#define AIRTIME_SLOTS           (AIRTIME_WINDOW_SECONDS / AIRTIME_SLOT_SECONDS)
+
+/* Burst allowed by the token bucket, as seconds worth of the duty cycle */
+#define AIRTIME_BUCKET_SECONDS  60
+
+/* Share of the budget and bucket that deferrable transmissions leave for
+ * those that can't wait
+ */
+#define AIRTIME_RESERVE_PERCENT 10
+
+struct airtimeStatistics {
+    int64_t windowUsedUs;       // Airtime used by the band in the last hour
+    int64_t subBandUsedUs;      // By every band, against the budget
+    int64_t windowBudgetUs;     // Airtime allowed in an hour
+    int64_t tokensUs;           // Currently available for a burst
+    unsigned long transmissions;
+    unsigned long refusals;     // Deferrable requests told to wait
+    unsigned long overBudget;   // Transmissions that could not wait, sent over budget
+};
+
+void    airtimeSetDutyCycle(double percent);
+bool    airtimeRequest(enum airtimeBand band, int64_t airtimeUs, bool deferrable);
+void    airtimeGetStatistics(enum airtimeBand band, struct airtimeStatistics *stats);
+const char *airtimeBandName(enum airtimeBand band);
+
+#endif /* AIRTIME_H */
@@ -0,0 +1,309 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Capture of OpenThings frames to a pcap file.
+ *
+ * captureFrame only copies the frame into a queue under a mutex, so the
+ * radio is never held up by the disk.  The capture thread decrypts each
+ * frame, checks its CRC and writes it out, flushing when the queue is
+ * empty and rotating the file when it is full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <bcm2835.h>
+#include <log4c.h>
+#include "dev_HRF.h"
+#include "decoder.h"
+#include "capture.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_SNAPLEN (CAPTURE_HEADER_LEN + 2 * MAX_FIFO_SIZE)
+
+struct pcapFileHeader {
+    uint32_t magic;
+    uint16_t versionMajor;
+    uint16_t versionMinor;
+    int32_t thisZone;
+    uint32_t sigFigs;
+    uint32_t snapLen;
+    uint32_t linkType;
+};
+
+struct pcapRecordHeader {
+    uint32_t seconds;
+    uint32_t microseconds;
+    uint32_t capturedLen;
+    uint32_t length;
+};
+
+struct capturedFrame {
+    struct timespec time;               // Wall clock
+    uint8_t direction;
+    int8_t rssi;
+    uint8_t encryptionId;
+    uint8_t frame[MAX_FIFO_SIZE];       // From the length byte
+};
+
+extern log4c_category_t* capturelog;
+
+static char *capturePath = NULL;
+static FILE *captureFile = NULL;
+static long fileSize = 0;
+static struct timespec clockOffset;    // Wall clock less monotonic
+static bool running = false;
+static pthread_t captureThread;
+static pthread_mutex_t captureMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t captureReady = PTHREAD_COND_INITIALIZER;
+static struct capturedFrame queue[CAPTURE_QUEUE_SIZE];
+static int queueHead = 0;
+static int queueCount = 0;
+static struct captureStatistics stats;
+
+static bool openFile(void) {
+
+    struct pcapFileHeader header = {
+        PCAP_MAGIC, 2, 4, 0, 0, PCAP_SNAPLEN, CAPTURE_LINKTYPE
+    };
+
+    captureFile = fopen(capturePath, "wb");
+    if (captureFile == NULL) {
+        log4c_category_error(capturelog, "Unable to open capture %s: %s", 
+                             capturePath, strerror(errno));
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, captureFile);
+    fileSize = sizeof(header);
+    return true;
+}
+
+/* Moves <path> to <path>.1, and so on, dropping the oldest */
+static void rotate(void) {
+
+    char from[FILENAME_MAX];
+    char to[FILENAME_MAX];
+    int i;
+
+    fclose(captureFile);
+    captureFile = NULL;
+
+    for (i = CAPTURE_FILES; i > 0; --i) {
+        if (i == 1) {
+            snprintf(from, sizeof(from), "%s", capturePath);
+        } else {
+            snprintf(from, sizeof(from), "%s.%d", capturePath, i - 1);
+        }
+        snprintf(to, sizeof(to), "%s.%d", capturePath, i);
+        rename(from, to);
+    }
+    stats.rotations++;
+    log4c_category_info(capturelog, "Rotated capture %s", capturePath);
+    openFile();
+}
+
+/* Writes one frame, with a decrypted copy, to the capture file */
+static void writeFrame(const struct capturedFrame *captured) {
+
+    uint8_t packet[PCAP_SNAPLEN];
+    struct pcapRecordHeader header;
+    int len = captured->frame[MSG_REMAINING_LEN] + 1;
+    uint8_t *plain;
+    uint8_t flags = 0;
+    struct cipher cipher;
+    int i;
+
+    if (len > MAX_FIFO_SIZE) {
+        len = MAX_FIFO_SIZE;
+    }
+    plain = packet + CAPTURE_HEADER_LEN + len;
+
+    memcpy(packet + CAPTURE_HEADER_LEN, captured->frame, len);
+    memcpy(plain, captured->frame, len);
+    if (len > MSG_DATA_START + 2) {
+        seed(&cipher, captured->encryptionId, 
+             (uint16_t)(plain[MSG_RESERVED_HI] << 8) | plain[MSG_RESERVED_LO]);
+        for (i = MSG_ENCR_START; i < len; ++i) {
+            plain[i] = decrypt(&cipher, plain[i]);
+        }
+        if ((int16_t)((plain[len - 2] << 8) | plain[len - 1]) 
+            == crc(plain + MSG_ENCR_START, len - (MSG_ENCR_START + 2))) {
+            flags |= CAPTURE_FLAG_CRC_OK;
+        }
+    }
+
+    packet[0] = CAPTURE_VERSION;
+    packet[1] = captured->direction;
+    packet[2] = flags;
+    packet[3] = (uint8_t)captured->rssi;
+    packet[4] = captured->encryptionId;
+    packet[5] = len;
+
+    header.seconds = captured->time.tv_sec;
+    header.microseconds = captured->time.tv_nsec / 1000;
+    header.capturedLen = CAPTURE_HEADER_LEN + 2 * len;
+    header.length = header.capturedLen;
+
+    if (fileSize + sizeof(header) + header.capturedLen > CAPTURE_FILE_SIZE) {
+        rotate();
+    }
+    if (captureFile == NULL) {
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, captureFile);
+    fwrite(packet, header.capturedLen, 1, captureFile);
+    fileSize += sizeof(header) + header.capturedLen;
+}
+
+static void *captureLoop(void *arg) {
+
+    struct capturedFrame captured;
+
+    pthread_mutex_lock(&captureMutex);
+    while (running || queueCount > 0) {
+        if (queueCount == 0) {
+            if (captureFile != NULL) {
+                pthread_mutex_unlock(&captureMutex);
+                fflush(captureFile);
+                pthread_mutex_lock(&captureMutex);
+            }
+            if (queueCount == 0 && running) {
+                pthread_cond_wait(&captureReady, &captureMutex);
+            }
+            continue;
+        }
+
+        captured = queue[queueHead];
+        queueHead = (queueHead + 1) % CAPTURE_QUEUE_SIZE;
+        queueCount--;
+        pthread_mutex_unlock(&captureMutex);
+
+        writeFrame(&captured);
+
+        pthread_mutex_lock(&captureMutex);
+        stats.frames++;
+    }
+    pthread_mutex_unlock(&captureMutex);
+    return NULL;
+}
+
+/* Starts capturing to path, replacing anything already there */
+bool captureOpen(const char *path) {
+
+    struct timespec realtime;
+    struct timespec monotonic;
+    int err;
+
+    capturePath = strdup(path);
+    if (!openFile()) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    clockOffset.tv_sec = realtime.tv_sec - monotonic.tv_sec;
+    clockOffset.tv_nsec = realtime.tv_nsec - monotonic.tv_nsec;
+
+    running = true;
+    if ((err = pthread_create(&captureThread, NULL, captureLoop, NULL)) != 0) {
+        log4c_category_error(capturelog, "Capture thread start failed: %d", err);
+        running = false;
+        fclose(captureFile);
+        captureFile = NULL;
+        return false;
+    }
+    log4c_category_notice(capturelog, "Capturing frames to %s", capturePath);
+    return true;
+}
+
+/* Queues frame, starting from its length byte, to be captured.  time is
+ * from CLOCK_MONOTONIC.  Does nothing unless captureOpen has been called.
+ */
+void captureFrame(enum captureDirection direction, const struct timespec *time,
+                  float rssi, const uint8_t *frame, uint8_t encryptionId) {
+
+    struct capturedFrame *captured;
+    int len = frame[MSG_REMAINING_LEN] + 1;
+
+    if (!running) {
+        return;
+    }
+    if (len > MAX_FIFO_SIZE) {
+        len = MAX_FIFO_SIZE;
+    }
+
+    pthread_mutex_lock(&captureMutex);
+    if (queueCount == CAPTURE_QUEUE_SIZE) {
+        stats.dropped++;
+        pthread_mutex_unlock(&captureMutex);
+        return;
+    }
+
+    captured = &queue[(queueHead + queueCount) % CAPTURE_QUEUE_SIZE];
+    captured->time.tv_sec = time->tv_sec + clockOffset.tv_sec;
+    captured->time.tv_nsec = time->tv_nsec + clockOffset.tv_nsec;
+    if (captured->time.tv_nsec < 0) {
+        captured->time.tv_sec--;
+        captured->time.tv_nsec += 1000000000L;
+    } else if (captured->time.tv_nsec >= 1000000000L) {
+        captured->time.tv_sec++;
+        captured->time.tv_nsec -= 1000000000L;
+    }
+    captured->direction = direction;
+    captured->rssi = (int8_t)rssi;
+    captured->encryptionId = encryptionId;
+    memcpy(captured->frame, frame, len);
+    queueCount++;
+
+    pthread_cond_signal(&captureReady);
+    pthread_mutex_unlock(&captureMutex);
+}
+
+/* Writes out anything still queued and closes the capture file */
+void captureClose(void) {
+
+    pthread_mutex_lock(&captureMutex);
+    if (!running) {
+        pthread_mutex_unlock(&captureMutex);
+        return;
+    }
+    running = false;
+    pthread_cond_signal(&captureReady);
+    pthread_mutex_unlock(&captureMutex);
+
+    pthread_join(captureThread, NULL);
+    fclose(captureFile);
+    captureFile = NULL;
+}
+
+void captureGetStatistics(struct captureStatistics *captureStats) {
+
+    pthread_mutex_lock(&captureMutex);
+    *captureStats = stats;
+    pthread_mutex_unlock(&captureMutex);
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
@@ -0,0 +1,49 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Capture of OpenThings frames to a pcap file, for Wireshark with the
+ * openthings.lua dissector.  Each packet is a CAPTURE_HEADER_LEN byte
+ * header, the frame as sent over the air, from its length byte, and the
+ * frame again with the encrypted part decrypted.
+ *
+ * Header: version, direction, flags, RSSI (signed dBm), encryptId,
+ *         frame length
+ */
+#define CAPTURE_LINKTYPE        147     // LINKTYPE_USER0
+#define CAPTURE_VERSION         1
+#define CAPTURE_HEADER_LEN      6
+
+#define CAPTURE_FLAG_CRC_OK     0x01
+
+enum captureDirection {
+    CAPTURE_RECEIVED,
+    CAPTURE_SENT
+};
+
+/* A capture file is rotated when it reaches CAPTURE_FILE_SIZE, keeping
+ * CAPTURE_FILES older ones as <path>.1 to <path>.<CAPTURE_FILES>
+ */
+#define CAPTURE_FILE_SIZE       (10 * 1024 * 1024)
+#define CAPTURE_FILES           4
+
+/* Frames waiting to be written */
+#define CAPTURE_QUEUE_SIZE      256
+
+bool    captureOpen(const char *path);
+void    captureFrame(enum captureDirection direction, const struct timespec *time,
+                     float rssi, const uint8_t *frame, uint8_t encryptionId);
+void    captureClose(void);
+
+struct captureStatistics {
+    unsigned long frames;           // Written
+    unsigned long dropped;          // Lost because the queue was full
+    unsigned long rotations;
+};
+
+void    captureGetStatistics(struct captureStatistics *stats);
+
+#endif /* CAPTURE_H */
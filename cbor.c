@@ -0,0 +1,266 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* CBOR encoder.
+ *
+ * Every item starts with a head: the major type in the top 3 bits and 
+ * either the value itself, if under 24, or the number of bytes of value 
+ * that follow, big endian.  Floats are written in the shortest of half,
+ * single and double precision that holds them exactly.
+ */
+
+#include <string.h>
+#include <math.h>
+#include "cbor.h"
+
+#define CBOR_UNSIGNED   0x00
+#define CBOR_NEGATIVE   0x20
+#define CBOR_BYTES      0x40
+#define CBOR_TEXT       0x60
+#define CBOR_ARRAY      0x80
+#define CBOR_MAP        0xa0
+#define CBOR_TAG        0xc0
+#define CBOR_SIMPLE     0xe0
+
+#define CBOR_FALSE      0xf4
+#define CBOR_TRUE       0xf5
+#define CBOR_NULL       0xf6
+#define CBOR_HALF       0xf9
+#define CBOR_SINGLE     0xfa
+#define CBOR_DOUBLE     0xfb
+
+/* Reserves len bytes, returning NULL if they don't fit */
+static uint8_t *reserve(struct cborWriter *writer, size_t len) {
+
+    uint8_t *p;
+
+    if (writer->overflow || writer->size - writer->len < len) {
+        writer->overflow = true;
+        return NULL;
+    }
+    p = writer->buf + writer->len;
+    writer->len += len;
+    return p;
+}
+
+/* Writes value big endian into len bytes at p */
+static void putBigEndian(uint8_t *p, uint64_t value, int len) {
+
+    int i;
+
+    for (i = len - 1; i >= 0; --i) {
+        p[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static void writeHead(struct cborWriter *writer, uint8_t major, uint64_t value) {
+
+    uint8_t *p;
+    int len;
+    uint8_t info;
+
+    if (value < 24) {
+        if ((p = reserve(writer, 1)) != NULL) {
+            *p = major | value;
+        }
+        return;
+    }
+
+    if (value <= 0xff) {
+        len = 1;
+        info = 24;
+    } else if (value <= 0xffff) {
+        len = 2;
+        info = 25;
+    } else if (value <= 0xffffffffULL) {
+        len = 4;
+        info = 26;
+    } else {
+        len = 8;
+        info = 27;
+    }
+
+    if ((p = reserve(writer, 1 + len)) != NULL) {
+        *p = major | info;
+        putBigEndian(p + 1, value, len);
+    }
+}
+
+/* Returns the half precision float holding f exactly, or -1 if there 
+ * isn't one.
+ */
+static int32_t toHalf(float f) {
+
+    uint32_t bits;
+    uint32_t sign;
+    uint32_t mantissa;
+    int exponent;
+
+    memcpy(&bits, &f, sizeof(bits));
+    sign = (bits >> 16) & 0x8000;
+    exponent = (int)((bits >> 23) & 0xff) - 127;
+    mantissa = bits & 0x7fffff;
+
+    if (exponent == -127 && mantissa == 0) {
+        return sign;                                    // Zero
+    }
+    if (exponent == 128) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);  // Infinity or NaN
+    }
+    if (exponent >= -14 && exponent <= 15) {
+        if (mantissa & 0x1fff) {
+            return -1;
+        }
+        return sign | ((exponent + 15) << 10) | (mantissa >> 13);
+    }
+    if (exponent >= -24 && exponent < -14) {
+        // Subnormal half
+        int shift = 13 + (-14 - exponent);
+        uint32_t significand = mantissa | 0x800000;
+
+        if (significand & ((1u << shift) - 1)) {
+            return -1;
+        }
+        return sign | (significand >> shift);
+    }
+    return -1;
+}
+
+void cborInit(struct cborWriter *writer, uint8_t *buf, size_t size) {
+
+    writer->buf = buf;
+    writer->size = size;
+    writer->len = 0;
+    writer->overflow = false;
+}
+
+/* Returns the length encoded, or 0 if the buffer was too small */
+size_t cborLength(const struct cborWriter *writer) {
+    return writer->overflow ? 0 : writer->len;
+}
+
+void cborUint(struct cborWriter *writer, uint64_t value) {
+    writeHead(writer, CBOR_UNSIGNED, value);
+}
+
+void cborInt(struct cborWriter *writer, int64_t value) {
+
+    if (value < 0) {
+        writeHead(writer, CBOR_NEGATIVE, (uint64_t)(-1 - value));
+    } else {
+        writeHead(writer, CBOR_UNSIGNED, value);
+    }
+}
+
+void cborFloat(struct cborWriter *writer, double value) {
+
+    float single = (float)value;
+    int32_t half;
+    uint8_t *p;
+
+    if (isnan(value)) {
+        single = NAN;
+    } else if ((double)single != value) {
+        uint64_t bits;
+
+        if ((p = reserve(writer, 9)) != NULL) {
+            memcpy(&bits, &value, sizeof(bits));
+            *p = CBOR_DOUBLE;
+            putBigEndian(p + 1, bits, 8);
+        }
+        return;
+    }
+
+    if ((half = toHalf(single)) >= 0) {
+        if ((p = reserve(writer, 3)) != NULL) {
+            *p = CBOR_HALF;
+            putBigEndian(p + 1, half, 2);
+        }
+    } else {
+        uint32_t bits;
+
+        if ((p = reserve(writer, 5)) != NULL) {
+            memcpy(&bits, &single, sizeof(bits));
+            *p = CBOR_SINGLE;
+            putBigEndian(p + 1, bits, 4);
+        }
+    }
+}
+
+void cborBool(struct cborWriter *writer, bool value) {
+
+    uint8_t *p;
+
+    if ((p = reserve(writer, 1)) != NULL) {
+        *p = value ? CBOR_TRUE : CBOR_FALSE;
+    }
+}
+
+void cborNull(struct cborWriter *writer) {
+
+    uint8_t *p;
+
+    if ((p = reserve(writer, 1)) != NULL) {
+        *p = CBOR_NULL;
+    }
+}
+
+void cborText(struct cborWriter *writer, const char *text, size_t len) {
+
+    uint8_t *p;
+
+    writeHead(writer, CBOR_TEXT, len);
+    if ((p = reserve(writer, len)) != NULL) {
+        memcpy(p, text, len);
+    }
+}
+
+void cborString(struct cborWriter *writer, const char *text) {
+    cborText(writer, text, strlen(text));
+}
+
+void cborBytes(struct cborWriter *writer, const uint8_t *bytes, size_t len) {
+
+    uint8_t *p;
+
+    writeHead(writer, CBOR_BYTES, len);
+    if ((p = reserve(writer, len)) != NULL) {
+        memcpy(p, bytes, len);
+    }
+}
+
+void cborArray(struct cborWriter *writer, size_t count) {
+    writeHead(writer, CBOR_ARRAY, count);
+}
+
+void cborMap(struct cborWriter *writer, size_t count) {
+    writeHead(writer, CBOR_MAP, count);
+}
+
+void cborTag(struct cborWriter *writer, uint64_t tag) {
+    writeHead(writer, CBOR_TAG, tag);
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
@@ -0,0 +1,36 @@
+#ifndef CBOR_H
+#define CBOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* CBOR (RFC 8949) encoder, writing into a buffer supplied by the caller
+ * without allocating.  Once an item doesn't fit, it and everything after
+ * it are dropped and cborLength returns 0, so the caller only needs to 
+ * check once, at the end.  Maps and arrays are given their number of 
+ * items up front, and that many items (pairs for a map) must follow.
+ */
+struct cborWriter {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+};
+
+void    cborInit(struct cborWriter *writer, uint8_t *buf, size_t size);
+size_t  cborLength(const struct cborWriter *writer);
+
+void    cborUint(struct cborWriter *writer, uint64_t value);
+void    cborInt(struct cborWriter *writer, int64_t value);
+void    cborFloat(struct cborWriter *writer, double value);
+void    cborBool(struct cborWriter *writer, bool value);
+void    cborNull(struct cborWriter *writer);
+void    cborText(struct cborWriter *writer, const char *text, size_t len);
+void    cborString(struct cborWriter *writer, const char *text);
+void    cborBytes(struct cborWriter *writer, const uint8_t *bytes, size_t len);
+void    cborArray(struct cborWriter *writer, size_t count);
+void    cborMap(struct cborWriter *writer, size_t count);
+void    cborTag(struct cborWriter *writer, uint64_t tag);
+
+#endif /* CBOR_H */
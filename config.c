@@ -0,0 +1,660 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Configuration file, in JSON.
+ *
+ * The configuration in use is published through a single pointer, so
+ * a thread that reads it once gets a consistent set of settings even
+ * if it is reloaded meanwhile.  A thread only keeps the configuration it
+ * read for one frame, message or timer tick, so one replaced by a reload
+ * is freed by a later reload once it has been out of use for 
+ * CONFIG_GRACE_SECONDS.  At most the configurations replaced within that
+ * time are kept.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <log4c.h>
+#include "cJSON.h"
+#include "config.h"
+
+extern log4c_category_t* configlog;
+
+static const char *publishTopicNames[] = {
+    "Temperature", "TargetTemperature", "Diagnostics", "Voltage", "Result", "LinkQuality", 
+    "Heard", "Frame", "Aggregate", "Batch"
+};
+
+static const char *cborReportNames[] = { "off", "sensor", "gateway" };
+static const char *batchFormatNames[] = { "json", "cbor" };
+
+#define CONFIG_GRACE_SECONDS 60
+
+struct retiredConfig {
+    struct config *config;
+    time_t retired;                     // CLOCK_MONOTONIC seconds
+    TAILQ_ENTRY(retiredConfig) entries;
+};
+
+static struct config *currentConfig = NULL;
+static TAILQ_HEAD(, retiredConfig) retiredConfigs = TAILQ_HEAD_INITIALIZER(retiredConfigs);
+
+const char *publishTopicName(enum publishTopic topic) {
+    return publishTopicNames[topic];
+}
+
+void configDefaults(struct config *config) {
+
+    enum publishTopic topic;
+
+    memset(config, 0, sizeof(*config));
+    strcpy(config->brokerHost, "localhost");
+    config->brokerPort = 1883;
+    config->keepalive = 60;
+    strcpy(config->topicBase, "energenie");
+    config->ookChipSelect = 0;
+    config->ookResetPin = 24;
+    strcpy(config->gpioChip, "/dev/gpiochip0");
+
+    for (topic = 0; topic < PUBLISH_COUNT; ++topic) {
+        config->publish[topic].qos = 1;
+        config->publish[topic].retain = false;
+    }
+    config->publish[PUBLISH_TARGET_TEMPERATURE].qos = 0;
+    config->publish[PUBLISH_LINK_QUALITY].qos = 0;
+    config->publish[PUBLISH_HEARD].qos = 0;
+    config->publish[PUBLISH_TEMPERATURE].expiry = 900;
+    config->publish[PUBLISH_TARGET_TEMPERATURE].expiry = 900;
+    config->publish[PUBLISH_LINK_QUALITY].expiry = 900;
+    config->publish[PUBLISH_FRAME].expiry = 900;
+
+    config->repeatSend = 8;
+    config->ookMaxDelayMs = 2000;
+    config->retryLimit = 2;
+    config->maxCommands = 0;
+    config->dutyCycle = 10.0;
+    config->manufacturerId = 0x04;      // Energenie
+    config->eTRVProductId = 0x03;
+    config->eTRVEncryptId = 0xf2;
+    config->productCount = 1;
+    config->products[0].manufacturerId = config->manufacturerId;
+    config->products[0].productId = config->eTRVProductId;
+    config->products[0].encryptId = config->eTRVEncryptId;
+    config->handoverSeconds = 660;      // Two eTRV report intervals missed
+    config->rawReports = true;
+    config->batchMaxDelayMs = 1000;
+}
+
+/* Reads a number from object into value if present.
+ * Returns false if it isn't a number between min and max.
+ */
+static bool getNumber(cJSON *object, const char *name, double min, double max, double *value) {
+
+    cJSON *item = cJSON_GetObjectItem(object, name);
+
+    if (item == NULL) {
+        return true;
+    }
+    if (item->type != cJSON_Number || item->valuedouble < min || item->valuedouble > max) {
+        log4c_category_error(configlog, "Config %s must be a number from %g to %g", 
+                             name, min, max);
+        return false;
+    }
+    *value = item->valuedouble;
+    return true;
+}
+
+static bool getInt(cJSON *object, const char *name, int min, int max, int *value) {
+
+    double number = *value;
+
+    if (!getNumber(object, name, min, max, &number)) {
+        return false;
+    }
+    *value = (int)number;
+    return true;
+}
+
+static bool getByte(cJSON *object, const char *name, uint8_t *value) {
+
+    int number = *value;
+
+    if (!getInt(object, name, 0, 255, &number)) {
+        return false;
+    }
+    *value = number;
+    return true;
+}
+
+static bool getBool(cJSON *object, const char *name, bool *value) {
+
+    cJSON *item = cJSON_GetObjectItem(object, name);
+
+    if (item == NULL) {
+        return true;
+    }
+    if (item->type != cJSON_True && item->type != cJSON_False) {
+        log4c_category_error(configlog, "Config %s must be true or false", name);
+        return false;
+    }
+    *value = (item->type == cJSON_True);
+    return true;
+}
+
+static bool getString(cJSON *object, const char *name, char *value) {
+
+    cJSON *item = cJSON_GetObjectItem(object, name);
+
+    if (item == NULL) {
+        return true;
+    }
+    if (item->type != cJSON_String || strlen(item->valuestring) >= CONFIG_STRING_LENGTH) {
+        log4c_category_error(configlog, "Config %s must be a string of less than %d characters",
+                             name, CONFIG_STRING_LENGTH);
+        return false;
+    }
+    strcpy(value, item->valuestring);
+    return true;
+}
+
+/* Adds socketNum at address to the bursts of group, merging it with
+ * any other sockets at the same address once all four are there.
+ */
+static void addGroupSocket(struct group *group, uint32_t address, uint8_t socketNum) {
+
+    int i;
+    int j;
+    uint8_t sockets = 0;            // Bit n for socket n already in the group
+
+    for (i = 0; i < group->burstCount; ++i) {
+        if (group->bursts[i].address == address) {
+            sockets |= 1 << group->bursts[i].socketNum;
+        }
+    }
+
+    if (sockets & (1 << 0 | 1 << socketNum)) {
+        return;                     // Already covered
+    }
+
+    sockets |= 1 << socketNum;
+    if (socketNum == 0 || (sockets & 0x1e) == 0x1e) {
+        // Replace the separate sockets with one burst to them all
+        for (i = 0, j = 0; i < group->burstCount; ++i) {
+            if (group->bursts[i].address != address) {
+                group->bursts[j++] = group->bursts[i];
+            }
+        }
+        group->burstCount = j;
+        socketNum = 0;
+    }
+
+    group->bursts[group->burstCount].address = address;
+    group->bursts[group->burstCount].socketNum = socketNum;
+    group->burstCount++;
+}
+
+/* Reads one group, such as
+ *   "downstairs": { "eTRV": [ 329, 330 ],
+ *                   "ENER002": [ { "address": 444102, "socket": 1 } ] }
+ * where a socket left out, or 0, is every socket at the address.
+ */
+static bool parseGroup(cJSON *object, struct group *group) {
+
+    cJSON *list;
+    cJSON *item;
+    int i;
+
+    memset(group, 0, sizeof(*group));
+    if (object->type != cJSON_Object || strlen(object->string) >= MAX_GROUP_NAME
+        || object->string[0] == '\0' || strpbrk(object->string, "/+#") != NULL) {
+        log4c_category_error(configlog, "Config group %s must be an object, named with less "
+                             "than %d characters and no / + or #", object->string, MAX_GROUP_NAME);
+        return false;
+    }
+    strcpy(group->name, object->string);
+
+    if ((list = cJSON_GetObjectItem(object, "eTRV")) != NULL) {
+        if (list->type != cJSON_Array) {
+            log4c_category_error(configlog, "Config group %s eTRV must be an array", group->name);
+            return false;
+        }
+        for (item = list->child; item != NULL; item = item->next) {
+            if (item->type != cJSON_Number || item->valueint < 1 || item->valueint > 0xffffff) {
+                log4c_category_error(configlog, "Config group %s eTRV must be sensorIds",
+                                     group->name);
+                return false;
+            }
+            for (i = 0; i < group->sensorCount; ++i) {
+                if (group->sensorIds[i] == item->valueint) {
+                    break;
+                }
+            }
+            if (i < group->sensorCount) {
+                continue;
+            }
+            if (group->sensorCount == MAX_GROUP_SENSORS) {
+                log4c_category_error(configlog, "Config group %s has more than %d eTRVs",
+                                     group->name, MAX_GROUP_SENSORS);
+                return false;
+            }
+            group->sensorIds[group->sensorCount++] = item->valueint;
+        }
+    }
+
+    if ((list = cJSON_GetObjectItem(object, "ENER002")) != NULL) {
+        if (list->type != cJSON_Array) {
+            log4c_category_error(configlog, "Config group %s ENER002 must be an array", 
+                                 group->name);
+            return false;
+        }
+        for (item = list->child; item != NULL; item = item->next) {
+            int address = 0;
+            int socketNum = 0;
+
+            if (item->type != cJSON_Object || cJSON_GetObjectItem(item, "address") == NULL
+                || !getInt(item, "address", 1, 0xfffff, &address)
+                || !getInt(item, "socket", 0, 4, &socketNum)) {
+                log4c_category_error(configlog, "Config group %s ENER002 must be "
+                                     "{ \"address\": a, \"socket\": s }", group->name);
+                return false;
+            }
+            if (group->burstCount == MAX_GROUP_BURSTS) {
+                log4c_category_error(configlog, "Config group %s has more than %d sockets",
+                                     group->name, MAX_GROUP_BURSTS);
+                return false;
+            }
+            addGroupSocket(group, address, socketNum);
+        }
+    }
+    return true;
+}
+
+/* Reads the products decoded besides the eTRV, such as
+ *   [ { "manufacturerId": 4, "productId": 5, "encryptId": 242 } ]
+ */
+static bool parseProducts(cJSON *list, struct config *config) {
+
+    cJSON *item;
+    struct otProduct *product;
+    bool ok = true;
+
+    if (list->type != cJSON_Array) {
+        log4c_category_error(configlog, "Config products must be an array");
+        return false;
+    }
+
+    config->productCount = 1;
+    for (item = list->child; item != NULL && ok; item = item->next) {
+        if (config->productCount == MAX_PRODUCTS) {
+            log4c_category_error(configlog, "Config has more than %d products", 
+                                 MAX_PRODUCTS - 1);
+            return false;
+        }
+        if (item->type != cJSON_Object || cJSON_GetObjectItem(item, "manufacturerId") == NULL
+            || cJSON_GetObjectItem(item, "productId") == NULL
+            || cJSON_GetObjectItem(item, "encryptId") == NULL) {
+            log4c_category_error(configlog, 
+                                 "Config products must each have a manufacturerId, productId and encryptId");
+            return false;
+        }
+        product = &config->products[config->productCount++];
+        ok &= getByte(item, "manufacturerId", &product->manufacturerId);
+        ok &= getByte(item, "productId", &product->productId);
+        ok &= getByte(item, "encryptId", &product->encryptId);
+    }
+    return ok;
+}
+
+static bool parseConfig(cJSON *root, struct config *config) {
+
+    cJSON *object;
+    enum publishTopic topic;
+    int i;
+    bool ok = true;
+
+    if ((object = cJSON_GetObjectItem(root, "broker")) != NULL) {
+        ok &= getString(object, "host", config->brokerHost);
+        ok &= getInt(object, "port", 1, 65535, &config->brokerPort);
+        ok &= getString(object, "username", config->brokerUser);
+        ok &= getString(object, "password", config->brokerPass);
+        ok &= getInt(object, "keepalive", 5, 3600, &config->keepalive);
+        ok &= getBool(object, "mqtt5", &config->mqtt5);
+    }
+
+    ok &= getString(root, "topicBase", config->topicBase);
+
+    if ((object = cJSON_GetObjectItem(root, "ookRadio")) != NULL) {
+        config->ookRadio = true;
+        ok &= getInt(object, "chipSelect", 0, 1, &config->ookChipSelect);
+        ok &= getInt(object, "resetPin", 0, 53, &config->ookResetPin);
+    }
+    ok &= getInt(root, "dio0Pin", 0, 53, &config->dio0Pin);
+    ok &= getString(root, "gpioChip", config->gpioChip);
+    if (config->topicBase[0] == '\0' || strpbrk(config->topicBase, "/+#") != NULL) {
+        log4c_category_error(configlog, "Config topicBase must be a single topic level");
+        ok = false;
+    }
+
+    if ((object = cJSON_GetObjectItem(root, "gateway")) != NULL) {
+        ok &= getString(object, "id", config->gatewayId);
+        ok &= getInt(object, "handover", 60, 86400, &config->handoverSeconds);
+    }
+    if (strpbrk(config->gatewayId, "/+#") != NULL) {
+        log4c_category_error(configlog, "Config gateway id must not contain / + or #");
+        ok = false;
+    }
+
+    if ((object = cJSON_GetObjectItem(root, "publish")) != NULL) {
+        for (topic = 0; topic < PUBLISH_COUNT; ++topic) {
+            cJSON *settings = cJSON_GetObjectItem(object, publishTopicNames[topic]);
+
+            if (settings != NULL) {
+                ok &= getInt(settings, "qos", 0, 2, &config->publish[topic].qos);
+                ok &= getBool(settings, "retain", &config->publish[topic].retain);
+                ok &= getInt(settings, "expiry", 0, 86400 * 7, &config->publish[topic].expiry);
+            }
+        }
+    }
+
+    if ((object = cJSON_GetObjectItem(root, "ENER002")) != NULL) {
+        ok &= getInt(object, "repeat", 1, 100, &config->repeatSend);
+        ok &= getInt(object, "maxDelay", 0, 60000, &config->ookMaxDelayMs);
+    }
+
+    if ((object = cJSON_GetObjectItem(root, "eTRV")) != NULL) {
+        ok &= getInt(object, "retries", 0, 100, &config->retryLimit);
+        ok &= getInt(object, "maxCommands", 0, 100, &config->maxCommands);
+        ok &= getByte(object, "manufacturerId", &config->manufacturerId);
+        ok &= getByte(object, "productId", &config->eTRVProductId);
+        ok &= getByte(object, "encryptId", &config->eTRVEncryptId);
+        ok &= getBool(object, "linkQuality", &config->linkQuality);
+    }
+
+    if ((object = cJSON_GetObjectItem(root, "products")) != NULL) {
+        ok &= parseProducts(object, config);
+    }
+    config->products[0].manufacturerId = config->manufacturerId;
+    config->products[0].productId = config->eTRVProductId;
+    config->products[0].encryptId = config->eTRVEncryptId;
+    for (i = 1; i < config->productCount && ok; ++i) {
+        if (configFindProduct(config, config->products[i].manufacturerId,
+                              config->products[i].productId) != &config->products[i]) {
+            log4c_category_error(configlog, "Config product %d:%d is repeated",
+                                 config->products[i].manufacturerId, 
+                                 config->products[i].productId);
+            ok = false;
+        }
+    }
+
+    ok &= getNumber(root, "dutyCycle", 0.01, 100, &config->dutyCycle);
+
+    if ((object = cJSON_GetObjectItem(root, "groups")) != NULL) {
+        cJSON *item;
+
+        config->groupCount = 0;
+        for (item = object->child; item != NULL && ok; item = item->next) {
+            if (config->groupCount == MAX_GROUPS) {
+                log4c_category_error(configlog, "Config has more than %d groups", MAX_GROUPS);
+                ok = false;
+            } else if (configFindGroup(config, item->string) != NULL) {
+                log4c_category_error(configlog, "Config group %s is repeated", item->string);
+                ok = false;
+            } else {
+                ok &= parseGroup(item, &config->groups[config->groupCount++]);
+            }
+        }
+    }
+
+    if ((object = cJSON_GetObjectItem(root, "aggregate")) != NULL) {
+        cJSON *windows = cJSON_GetObjectItem(object, "windows");
+
+        if (windows != NULL && windows->type != cJSON_Array) {
+            log4c_category_error(configlog, "Config aggregate windows must be an array");
+            ok = false;
+        } else if (windows != NULL) {
+            cJSON *item;
+
+            config->aggregateWindowCount = 0;
+            for (item = windows->child; item != NULL && ok; item = item->next) {
+                if (config->aggregateWindowCount == MAX_AGGREGATE_WINDOWS) {
+                    log4c_category_error(configlog, "Config has more than %d aggregate windows",
+                                         MAX_AGGREGATE_WINDOWS);
+                    ok = false;
+                } else if (item->type != cJSON_Number || item->valueint < 60 
+                           || item->valueint > 86400 || 86400 % item->valueint != 0) {
+                    log4c_category_error(configlog, 
+                                         "Config aggregate windows must be seconds dividing a day");
+                    ok = false;
+                } else {
+                    config->aggregateWindows[config->aggregateWindowCount++] = item->valueint;
+                }
+            }
+        }
+        ok &= getBool(object, "raw", &config->rawReports);
+    }
+
+    if ((object = cJSON_GetObjectItem(root, "batch")) != NULL) {
+        cJSON *format = cJSON_GetObjectItem(object, "format");
+
+        ok &= getInt(object, "entries", 0, MAX_BATCH_ENTRIES, &config->batchEntries);
+        ok &= getInt(object, "maxDelay", 1, 60000, &config->batchMaxDelayMs);
+        if (format != NULL) {
+            enum batchFormat batchFormat;
+
+            for (batchFormat = BATCH_JSON; batchFormat <= BATCH_CBOR; ++batchFormat) {
+                if (format->type == cJSON_String 
+                    && strcmp(format->valuestring, batchFormatNames[batchFormat]) == 0) {
+                    config->batchFormat = batchFormat;
+                    break;
+                }
+            }
+            if (batchFormat > BATCH_CBOR) {
+                log4c_category_error(configlog, "Config batch format must be json or cbor");
+                ok = false;
+            }
+        }
+    }
+
+    if ((object = cJSON_GetObjectItem(root, "cbor")) != NULL) {
+        enum cborReports reports;
+
+        for (reports = CBOR_OFF; reports <= CBOR_PER_GATEWAY; ++reports) {
+            if (object->type == cJSON_String 
+                && strcmp(object->valuestring, cborReportNames[reports]) == 0) {
+                config->cborReports = reports;
+                break;
+            }
+        }
+        if (reports > CBOR_PER_GATEWAY) {
+            log4c_category_error(configlog, "Config cbor must be off, sensor or gateway");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* Returns the product, or NULL if its messages aren't decoded */
+const struct otProduct *configFindProduct(const struct config *config, 
+                                          uint8_t manufacturerId, uint8_t productId) {
+
+    int i;
+
+    for (i = 0; i < config->productCount; ++i) {
+        if (config->products[i].manufacturerId == manufacturerId 
+            && config->products[i].productId == productId) {
+            return &config->products[i];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the group called name, or NULL if there is none */
+const struct group *configFindGroup(const struct config *config, const char *name) {
+
+    int i;
+
+    for (i = 0; i < config->groupCount; ++i) {
+        if (strcmp(config->groups[i].name, name) == 0) {
+            return &config->groups[i];
+        }
+    }
+    return NULL;
+}
+
+/* Reads the configuration file at path into config, starting from the
+ * settings in base.  Returns false, leaving config unusable, if the 
+ * file can't be read or any setting in it is invalid.
+ */
+bool configLoad(const char *path, const struct config *base, struct config *config) {
+
+    FILE *file;
+    long size;
+    char *text;
+    cJSON *root;
+    bool ok;
+
+    *config = *base;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        log4c_category_error(configlog, "Unable to open config file %s", path);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+
+    text = malloc(size + 1);
+    if (size < 0 || fread(text, 1, size, file) != (size_t)size) {
+        log4c_category_error(configlog, "Unable to read config file %s", path);
+        free(text);
+        fclose(file);
+        return false;
+    }
+    text[size] = '\0';
+    fclose(file);
+
+    root = cJSON_Parse(text);
+    if (root == NULL || root->type != cJSON_Object) {
+        log4c_category_error(configlog, "Config file %s is not a JSON object", path);
+        cJSON_Delete(root);
+        free(text);
+        return false;
+    }
+
+    ok = parseConfig(root, config);
+    cJSON_Delete(root);
+    free(text);
+    return ok;
+}
+
+/* Puts the settings that are only read at startup back to those in old,
+ * returning true if new had changed any of them.
+ */
+bool configKeepStartupSettings(const struct config *old, struct config *new) {
+
+    bool changed = strcmp(old->brokerHost, new->brokerHost) != 0
+        || old->brokerPort != new->brokerPort
+        || strcmp(old->brokerUser, new->brokerUser) != 0
+        || strcmp(old->brokerPass, new->brokerPass) != 0
+        || old->keepalive != new->keepalive
+        || old->mqtt5 != new->mqtt5
+        || strcmp(old->topicBase, new->topicBase) != 0
+        || old->ookRadio != new->ookRadio
+        || old->ookChipSelect != new->ookChipSelect
+        || old->ookResetPin != new->ookResetPin
+        || old->dio0Pin != new->dio0Pin
+        || strcmp(old->gpioChip, new->gpioChip) != 0
+        || strcmp(old->gatewayId, new->gatewayId) != 0;
+
+    strcpy(new->brokerHost, old->brokerHost);
+    new->brokerPort = old->brokerPort;
+    strcpy(new->brokerUser, old->brokerUser);
+    strcpy(new->brokerPass, old->brokerPass);
+    new->keepalive = old->keepalive;
+    new->mqtt5 = old->mqtt5;
+    strcpy(new->topicBase, old->topicBase);
+    new->ookRadio = old->ookRadio;
+    new->ookChipSelect = old->ookChipSelect;
+    new->ookResetPin = old->ookResetPin;
+    new->dio0Pin = old->dio0Pin;
+    strcpy(new->gpioChip, old->gpioChip);
+    strcpy(new->gatewayId, old->gatewayId);
+    return changed;
+}
+
+/* Frees the configurations that have been replaced for long enough that
+ * no thread can still be using them
+ */
+static void freeRetiredConfigs(time_t now) {
+
+    struct retiredConfig *retired;
+
+    while ((retired = TAILQ_FIRST(&retiredConfigs)) != NULL
+           && now - retired->retired >= CONFIG_GRACE_SECONDS) {
+        TAILQ_REMOVE(&retiredConfigs, retired, entries);
+        free(retired->config);
+        free(retired);
+    }
+}
+
+/* Makes a copy of config the one in use.  Only called by one thread at a
+ * time: at startup, then by whichever handles SIGHUP.
+ */
+void configPublish(struct config *config) {
+
+    struct config *published = malloc(sizeof(struct config));
+    struct config *old = currentConfig;
+    struct retiredConfig *retired;
+    struct timespec now;
+
+    if (published == NULL) {
+        log4c_category_error(configlog, "No memory for the new configuration");
+        return;
+    }
+    *published = *config;
+    published->generation = old ? old->generation + 1 : 0;
+    __atomic_store_n(&currentConfig, published, __ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    freeRetiredConfigs(now.tv_sec);
+    if (old != NULL) {
+        retired = malloc(sizeof(struct retiredConfig));
+        if (retired == NULL) {
+            return;                     // Kept for good rather than freed too soon
+        }
+        retired->config = old;
+        retired->retired = now.tv_sec;
+        TAILQ_INSERT_TAIL(&retiredConfigs, retired, entries);
+    }
+}
+
+const struct config *configGet(void) {
+    return __atomic_load_n(&currentConfig, __ATOMIC_ACQUIRE);
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
@@ -0,0 +1,136 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "decoder.h"
+
+#define CONFIG_STRING_LENGTH 128
+
+/* Topics published with their own QoS and retain settings */
+enum publishTopic {
+    PUBLISH_TEMPERATURE,
+    PUBLISH_TARGET_TEMPERATURE,
+    PUBLISH_DIAGNOSTICS,
+    PUBLISH_VOLTAGE,
+    PUBLISH_RESULT,
+    PUBLISH_LINK_QUALITY,
+    PUBLISH_HEARD,
+    PUBLISH_FRAME,
+    PUBLISH_AGGREGATE,
+    PUBLISH_BATCH,
+    PUBLISH_COUNT
+};
+
+/* Where each frame received is also published as one CBOR message */
+enum cborReports {
+    CBOR_OFF,
+    CBOR_PER_SENSOR,                // /<topicBase>/eTRV/Frame/<sensorId>
+    CBOR_PER_GATEWAY                // /<topicBase>/eTRV/Frame
+};
+
+/* How the reports collected in a batch are published together, on
+ * /<topicBase>/eTRV/Batch
+ */
+enum batchFormat {
+    BATCH_JSON,                     // An array of objects
+    BATCH_CBOR                      // An array of the maps published on Frame
+};
+
+#define MAX_BATCH_ENTRIES 128
+
+struct publishSettings {
+    int qos;
+    bool retain;
+    int expiry;                     // Seconds until stale, with MQTT v5, 0 for never
+};
+
+/* A named set of devices, commanded together on /<topicBase>/group/<name>/.
+ * Sockets are kept as the bursts that will be sent, with every socket at
+ * an address merged into one burst to socket 0, so a command only has to
+ * walk the lists.
+ */
+#define MAX_GROUPS 16
+#define MAX_GROUP_NAME 32
+#define MAX_GROUP_SENSORS 128
+#define MAX_GROUP_BURSTS 64
+
+struct groupBurst {
+    uint32_t address;               // ENER002 20 bit address
+    uint8_t socketNum;              // 1-4, or 0 for all
+};
+
+struct group {
+    char name[MAX_GROUP_NAME];
+    int sensorCount;
+    int sensorIds[MAX_GROUP_SENSORS];   // eTRVs, each once
+    int burstCount;
+    struct groupBurst bursts[MAX_GROUP_BURSTS];
+};
+
+/* OpenThings products whose messages are decoded, the eTRV first */
+#define MAX_PRODUCTS 8
+
+/* eTRV readings are summarised over each window, aligned to multiples of
+ * its length since the epoch
+ */
+#define MAX_AGGREGATE_WINDOWS 4
+
+/* Settings read from the configuration file.  Once published a 
+ * configuration is never changed, a reload publishes a new one.
+ */
+struct config {
+    unsigned generation;            // Increases with each reload
+
+    // Only read at startup
+    char brokerHost[CONFIG_STRING_LENGTH];
+    int brokerPort;
+    char brokerUser[CONFIG_STRING_LENGTH];
+    char brokerPass[CONFIG_STRING_LENGTH];
+    int keepalive;
+    bool mqtt5;                     // Connect with MQTT v5 instead of 3.1.1
+    char topicBase[CONFIG_STRING_LENGTH];
+    bool ookRadio;                  // A second board sends OOK
+    int ookChipSelect;
+    int ookResetPin;                // BCM GPIO number
+    int dio0Pin;                    // BCM GPIO wired to DIO0, 0 if not
+    char gpioChip[CONFIG_STRING_LENGTH];    // GPIO character device with dio0Pin
+    char gatewayId[CONFIG_STRING_LENGTH];   // Shares eTRVs with other gateways, "" if not
+
+    // Applied when reloaded
+    struct publishSettings publish[PUBLISH_COUNT];
+    int repeatSend;                 // Times an OOK message is sent
+    int ookMaxDelayMs;              // Longest an OOK burst is held back for eTRV reports
+    int retryLimit;                 // Times an unconfirmed eTRV command is sent again
+    int maxCommands;                // Most eTRV commands in one reply, 0 for as many as fit
+    double dutyCycle;               // Percent
+    uint8_t manufacturerId;
+    uint8_t eTRVProductId;
+    uint8_t eTRVEncryptId;
+    int productCount;
+    struct otProduct products[MAX_PRODUCTS];
+    bool linkQuality;               // Publish eTRV link quality with each report
+    int handoverSeconds;            // Another gateway silent this long loses its eTRVs
+    enum cborReports cborReports;
+    int groupCount;
+    struct group groups[MAX_GROUPS];
+    int aggregateWindowCount;
+    int aggregateWindows[MAX_AGGREGATE_WINDOWS];    // Seconds
+    bool rawReports;                // Publish each eTRV temperature and voltage
+    int batchEntries;               // Reports published together, 0 to publish each alone
+    int batchMaxDelayMs;            // Longest a report waits for the batch to fill
+    enum batchFormat batchFormat;
+};
+
+void    configDefaults(struct config *config);
+bool    configLoad(const char *path, const struct config *base, struct config *config);
+bool    configKeepStartupSettings(const struct config *old, struct config *new);
+const char *publishTopicName(enum publishTopic topic);
+const struct group *configFindGroup(const struct config *config, const char *name);
+const struct otProduct *configFindProduct(const struct config *config, 
+                                          uint8_t manufacturerId, uint8_t productId);
+
+void    configPublish(struct config *config);
+const struct config *configGet(void);
+
+#endif /* CONFIG_H */
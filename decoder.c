@@ -1,27 +1,28 @@
 #include <stdint.h>
-static uint16_t ran;
+#include "decoder.h"
 
-void seed(uint8_t pid, uint16_t pip)
+void seed(struct cipher *cipher, uint8_t pid, uint16_t pip)
 {
-	ran = ((((uint16_t) pid) << 8) ^ pip);
+	cipher->ran = ((((uint16_t) pid) << 8) ^ pip);
 }
 
-uint8_t decrypt(uint8_t dat)
+uint8_t decrypt(struct cipher *cipher, uint8_t dat)
 {
 	unsigned char i;
 
 	for (i = 0; i < 5; ++i)
 	{
-		ran = (ran & 1) ? ((ran >> 1) ^ 62965U) : (ran >> 1);
+		cipher->ran = (cipher->ran & 1) ? ((cipher->ran >> 1) ^ 62965U) : (cipher->ran >> 1);
 	}
-	return (uint8_t)(ran ^ dat ^ 90U);
+	return (uint8_t)(cipher->ran ^ dat ^ 90U);
 }
 
 
-int16_t crc(uint8_t const mes[], unsigned char siz)
+int16_t crc(uint8_t const mes[], size_t siz)
 {
 	uint16_t rem = 0;
-	unsigned char byte, bit;
+	size_t byte;
+	unsigned char bit;
 
 	for (byte = 0; byte < siz; ++byte)
 	{
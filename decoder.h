@@ -1,6 +1,26 @@
+#ifndef DECODER_H
+#define DECODER_H
+
 #include <stdlib.h>
+#include <stdint.h>
+
+/* State of the OpenThings cipher through one message.  Each caller keeps
+ * its own, as frames are decrypted and replies encrypted on different
+ * threads at once.
+ */
+struct cipher {
+	uint16_t ran;
+};
+
+/* An OpenThings product, and the id its messages are encrypted with */
+struct otProduct {
+	uint8_t manufacturerId;
+	uint8_t productId;
+	uint8_t encryptId;
+};
 
-void seed(uint8_t, uint16_t);
-uint8_t decrypt(uint8_t);
+void seed(struct cipher *, uint8_t, uint16_t);
+uint8_t decrypt(struct cipher *, uint8_t);
 int16_t crc(uint8_t const mes[], size_t);
 
+#endif /* DECODER_H */
@@ -18,47 +18,67 @@
 #include <log4c.h>
 #include <bcm2835.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
 #include "decoder.h"
 #include "dev_HRF.h"
 #include "OpenThings.h"
-
-#define MSG_LOG_BUFFER_SIZE (MESSAGE_BUF_SIZE * 8)
-static char logBuffer[MSG_LOG_BUFFER_SIZE];
-static int logBufferUsedCount = 0;
-
-static pthread_mutex_t mutex;
+#include "led.h"
 
 extern log4c_category_t* hrflog;
 
-void HRF_config_FSK(){
-	regSet_t regSetup[] = {
-		{ADDR_REGDATAMODUL, VAL_REGDATAMODUL_FSK},	// modulation scheme FSK
-		{ADDR_FDEVMSB, 		VAL_FDEVMSB30},  			// frequency deviation 5kHz 0x0052 -> 30kHz 0x01EC
-		{ADDR_FDEVLSB, 		VAL_FDEVLSB30},			// frequency deviation 5kHz 0x0052 -> 30kHz 0x01EC
-		{ADDR_FRMSB, 		VAL_FRMSB434},			// carrier freq -> 434.3MHz 0x6C9333
-		{ADDR_FRMID, 		VAL_FRMID434},			// carrier freq -> 434.3MHz 0x6C9333
-		{ADDR_FRLSB, 		VAL_FRLSB434},			// carrier freq -> 434.3MHz 0x6C9333
-		{ADDR_AFCCTRL, 		VAL_AFCCTRLS},			// standard AFC routine
-		{ADDR_LNA, 			VAL_LNA50},				// 200ohms, gain by AGC loop -> 50ohms
-		{ADDR_RXBW, 		VAL_RXBW60},				// channel filter bandwidth 10kHz -> 60kHz  page:26
-		//{ADDR_AFCFEI, 		VAL_AFCFEIRX},		// AFC is performed each time rx mode is entered
-		//{ADDR_RSSITHRESH, 	VAL_RSSITHRESH220},	// RSSI threshold 0xE4 -> 0xDC (220)
-		{ADDR_PREAMBLELSB, 	VAL_PREAMBLELSB3},		// preamble size LSB -> 3
-		{ADDR_SYNCCONFIG, 	VAL_SYNCCONFIG2},		// Size of the Synch word = 2 (SyncSize + 1)
-		{ADDR_SYNCVALUE1, 	VAL_SYNCVALUE1FSK},		// 1st byte of Sync word
-		{ADDR_SYNCVALUE2, 	VAL_SYNCVALUE2FSK},		// 2nd byte of Sync word
-		{ADDR_PACKETCONFIG1, VAL_PACKETCONFIG1FSK},// Variable length, Manchester coding, Addr must match NodeAddress
-		{ADDR_PAYLOADLEN, 	VAL_PAYLOADLEN64},		// max Length in RX, not used in Tx
-		{ADDR_NODEADDRESS, 	VAL_NODEADDRESS01},		// Node address used in address filtering
-		{ADDR_FIFOTHRESH, 	VAL_FIFOTHRESH1},		// Condition to start packet transmission: at least one byte in FIFO
-		{ADDR_OPMODE, 		MODE_RECEIVER}			// Operating mode to Receiver
-	}; 
-	uint8_t size = sizeof(regSetup)/sizeof(regSet_t), i;
+static const regSet_t fskRegSetup[] = {
+	{ADDR_REGDATAMODUL, VAL_REGDATAMODUL_FSK},	// modulation scheme FSK
+	{ADDR_FDEVMSB, 		VAL_FDEVMSB30},  			// frequency deviation 5kHz 0x0052 -> 30kHz 0x01EC
+	{ADDR_FDEVLSB, 		VAL_FDEVLSB30},			// frequency deviation 5kHz 0x0052 -> 30kHz 0x01EC
+	{ADDR_FRMSB, 		VAL_FRMSB434},			// carrier freq -> 434.3MHz 0x6C9333
+	{ADDR_FRMID, 		VAL_FRMID434},			// carrier freq -> 434.3MHz 0x6C9333
+	{ADDR_FRLSB, 		VAL_FRLSB434},			// carrier freq -> 434.3MHz 0x6C9333
+	{ADDR_AFCCTRL, 		VAL_AFCCTRLS},			// standard AFC routine
+	{ADDR_LNA, 			VAL_LNA50},				// 200ohms, gain by AGC loop -> 50ohms
+	{ADDR_RXBW, 		VAL_RXBW60},				// channel filter bandwidth 10kHz -> 60kHz  page:26
+	//{ADDR_AFCFEI, 		VAL_AFCFEIRX},		// AFC is performed each time rx mode is entered
+	//{ADDR_RSSITHRESH, 	VAL_RSSITHRESH220},	// RSSI threshold 0xE4 -> 0xDC (220)
+	{ADDR_PREAMBLELSB, 	VAL_PREAMBLELSB3},		// preamble size LSB -> 3
+	{ADDR_SYNCCONFIG, 	VAL_SYNCCONFIG2},		// Size of the Synch word = 2 (SyncSize + 1)
+	{ADDR_SYNCVALUE1, 	VAL_SYNCVALUE1FSK},		// 1st byte of Sync word
+	{ADDR_SYNCVALUE2, 	VAL_SYNCVALUE2FSK},		// 2nd byte of Sync word
+	{ADDR_PACKETCONFIG1, VAL_PACKETCONFIG1FSK},// Variable length, Manchester coding, Addr must match NodeAddress
+	{ADDR_PAYLOADLEN, 	VAL_PAYLOADLEN64},		// max Length in RX, not used in Tx
+	{ADDR_NODEADDRESS, 	VAL_NODEADDRESS01},		// Node address used in address filtering
+	{ADDR_FIFOTHRESH, 	VAL_FIFOTHRESH1},		// Condition to start packet transmission: at least one byte in FIFO
+	{ADDR_OPMODE, 		MODE_RECEIVER}			// Operating mode to Receiver
+};
+
+void HRF_config_FSK(struct hrfRadio *radio){
+	uint8_t size = sizeof(fskRegSetup)/sizeof(regSet_t), i;
 	for (i=0; i<size; ++i){
-		HRF_reg_W(regSetup[i].addr, regSetup[i].val);
+		HRF_reg_W(radio, fskRegSetup[i].addr, fskRegSetup[i].val);
 	}
+	radio->modulation = HRF_MODULATION_FSK;
 }
-void HRF_config_OOK(){
+/* Reads back the FSK configuration, returning true if the radio still
+ * holds it, as it does when the program is restarted without the radio
+ * being reset or powered off.  The operating mode isn't checked as it
+ * depends on what the radio was doing when the program stopped.
+ */
+bool HRF_check_FSK(struct hrfRadio *radio){
+	uint8_t size = sizeof(fskRegSetup)/sizeof(regSet_t), i;
+	uint8_t val;
+	for (i=0; i<size; ++i){
+		if (fskRegSetup[i].addr == ADDR_OPMODE)
+			continue;
+		val = HRF_reg_R(radio, fskRegSetup[i].addr);
+		if (val != fskRegSetup[i].val){
+			log4c_category_info(hrflog, "Register %02x is %02x not %02x", 
+                                fskRegSetup[i].addr, val, fskRegSetup[i].val);
+			return false;
+		}
+	}
+	return true;
+}
+void HRF_config_OOK(struct hrfRadio *radio){
 	static regSet_t regSetup[] = {
 		{ADDR_REGDATAMODUL, VAL_REGDATAMODUL_OOK},	// modulation scheme OOK
 		{ADDR_FDEVMSB, 		0}, 					// frequency deviation -> 0kHz 
@@ -85,53 +105,57 @@ void HRF_config_OOK(){
 	}; 
 	uint8_t size = sizeof(regSetup)/sizeof(regSet_t), i;
 	for (i=0; i<size; ++i){
-		HRF_reg_W(regSetup[i].addr, regSetup[i].val);
+		HRF_reg_W(radio, regSetup[i].addr, regSetup[i].val);
 	}
+	radio->modulation = HRF_MODULATION_OOK;
 }
-void HRF_clr_fifo(void){
-	while (HRF_reg_R(ADDR_IRQFLAGS2) & MASK_FIFONOTEMPTY)				// FIFO FLAG FifoNotEmpty
+void HRF_clr_fifo(struct hrfRadio *radio){
+	while (HRF_reg_R(radio, ADDR_IRQFLAGS2) & MASK_FIFONOTEMPTY)				// FIFO FLAG FifoNotEmpty
 	{
-		HRF_reg_R(ADDR_FIFO);
+		HRF_reg_R(radio, ADDR_FIFO);
 	}
 	return;
 }
-void HRF_reg_Rn(uint8_t *retBuf, uint8_t addr, uint8_t size){
+void HRF_reg_Rn(struct hrfRadio *radio, uint8_t *retBuf, uint8_t addr, uint8_t size){
 	uint8_t tmp = retBuf[0];
 	retBuf[0] = addr;
-	bcm2835_spi_transfern((char*)retBuf, size + 1);
+	radio->spi->transfer(radio, retBuf, size + 1);
 	retBuf[0] = tmp;
 	return;
 }
-void HRF_reg_Wn(uint8_t *retBuf, uint8_t addr, uint8_t size){
+void HRF_reg_Wn(struct hrfRadio *radio, uint8_t *retBuf, uint8_t addr, uint8_t size){
 	uint8_t tmp = retBuf[0];
 	retBuf[0] = addr | MASK_WRITE_DATA;
-	bcm2835_spi_writenb((char*)retBuf, size + 1);
+	radio->spi->write(radio, retBuf, size + 1);
 	retBuf[0] = tmp;
 	return;
 }
-uint8_t HRF_reg_R(uint8_t addr){
+uint8_t HRF_reg_R(struct hrfRadio *radio, uint8_t addr){
 	uint8_t buf[2];
 	buf[0] = addr;
-	bcm2835_spi_transfern((char*)buf, 2);
+	radio->spi->transfer(radio, buf, 2);
 	return buf[1];
 }
-void HRF_reg_W(uint8_t addr, uint8_t val){
+void HRF_reg_W(struct hrfRadio *radio, uint8_t addr, uint8_t val){
 	uint8_t buf[2];
 	buf[0] = addr | MASK_WRITE_DATA;
 	buf[1] = val;
-	bcm2835_spi_writenb((char*)buf, 2);
+	radio->spi->write(radio, buf, 2);
+	if (addr == ADDR_OPMODE)
+		radio->mode = val;
 	return;
 }
-void HRF_change_mode(uint8_t mode){
+void HRF_change_mode(struct hrfRadio *radio, uint8_t mode){
 	uint8_t buf[2];
 	buf[0] = ADDR_OPMODE | MASK_WRITE_DATA;
 	buf[1] = mode;
-	bcm2835_spi_writenb((char*)buf, 2);
+	radio->spi->write(radio, buf, 2);
+	radio->mode = mode;
 }
-void HRF_assert_reg_val(uint8_t addr, uint8_t mask, uint8_t val, char *desc){
+void HRF_assert_reg_val(struct hrfRadio *radio, uint8_t addr, uint8_t mask, uint8_t val, char *desc){
 	uint8_t buf[2];
 	buf[0] = addr;
-	bcm2835_spi_transfern((char*)buf, 2);
+	radio->spi->transfer(radio, buf, 2);
 	if (val){
 		if ((buf[1] & mask) != mask)
 			log4c_category_warn(hrflog, 
@@ -144,7 +168,7 @@ void HRF_assert_reg_val(uint8_t addr, uint8_t mask, uint8_t val, char *desc){
                  addr, val, mask, buf[1], desc);
 	}
 }
-void HRF_wait_for(uint8_t addr, uint8_t mask, uint8_t val){
+void HRF_wait_for(struct hrfRadio *radio, uint8_t addr, uint8_t mask, uint8_t val){
 	uint32_t cnt = 0; 
 	uint8_t ret;
 	do {
@@ -152,15 +176,39 @@ void HRF_wait_for(uint8_t addr, uint8_t mask, uint8_t val){
 		if (cnt > 4000000)
 		{
 			log4c_category_warn(hrflog, "timeout inside a while for addr %02x\n", addr);
+			ledEvent(LED_ERROR);
 			break;
 		}
-		ret = HRF_reg_R(addr);
+		ret = HRF_reg_R(radio, addr);
 	} while ((ret & mask) != (val ? mask : 0));
 }
 
-void HRF_send_OOK_msg(uint8_t *address, int socketNum, int On, int repeat_send)
+/* Sends an ENER002 burst, returning once it is sent */
+void HRF_send_OOK_msg(struct hrfRadio *radio, uint8_t *address, int socketNum, int On, int repeat_send)
 {
-	uint8_t buf[OOK_BUF_SIZE];
+	struct hrfOOKBurst burst;
+
+	pthread_mutex_lock(&radio->mutex);
+	if (HRF_start_OOK_msg(radio, &burst, address, socketNum, On, repeat_send)) {
+		while (!HRF_continue_OOK_msg(radio, &burst))
+			;
+	}
+	pthread_mutex_unlock(&radio->mutex);
+
+	// The caller must leave HRF_OOK_GAP_US(repeat_send) before the next burst
+}
+
+/* A burst is sent in steps so that a caller with other work, like the
+ * reactor, needn't wait the few hundred ms it is on the air.  This
+ * starts it, returning false if socketNum is invalid and there is
+ * nothing to send, then HRF_continue_OOK_msg must be called at least
+ * every HRF_OOK_FIFO_DRAIN_US until it returns true.  The caller holds
+ * the radio's mutex, or is its only user, from start to finish.
+ */
+bool HRF_start_OOK_msg(struct hrfRadio *radio, struct hrfOOKBurst *burst, uint8_t *address, 
+                       int socketNum, int On, int repeat_send)
+{
+	uint8_t *buf = burst->buf;
 	uint8_t i;
 
 	
@@ -229,65 +277,119 @@ void HRF_send_OOK_msg(uint8_t *address, int socketNum, int On, int repeat_send)
         default:
             log4c_category_warn(hrflog, "Invalid socket number: %d", 
                                 socketNum);
-            return;
+            return false;
 
     }
 	
-    ledControl(redLED, ledOn);
-    pthread_mutex_lock(&mutex);
+    ledEvent(LED_TRANSMIT);
 
-    // Put this inside the lock as it uses logBuffer in common
+    // The caller holds the radio, whose logBuffer this uses
     if (log4c_category_is_trace_enabled(hrflog)) {
 
-        logBufferUsedCount = 0;
+        int logBufferUsedCount = 0;
 
         for (i=1; i < OOK_BUF_SIZE; ++i) {
             logBufferUsedCount += 
-                snprintf(&logBuffer[logBufferUsedCount],
+                snprintf(&radio->logBuffer[logBufferUsedCount],
                          MSG_LOG_BUFFER_SIZE - logBufferUsedCount,
                          "[%d]=%02x%c", i, buf[i], i%8==7?'\n':'\t');
         }
-        logBuffer[MSG_LOG_BUFFER_SIZE - 1] = '\0';
+        radio->logBuffer[MSG_LOG_BUFFER_SIZE - 1] = '\0';
         log4c_category_log(hrflog, LOG4C_PRIORITY_TRACE, 
-                           "OOK msg sent\n%s", logBuffer);
+                           "%s OOK msg sent\n%s", radio->name, radio->logBuffer);
     }
 
-	HRF_config_OOK();
+	if (radio->modulation == HRF_MODULATION_OOK)
+		HRF_change_mode(radio, MODE_TRANSMITER);		// Still configured from the last burst
+	else
+		HRF_config_OOK(radio);
 
-	HRF_wait_for (ADDR_IRQFLAGS1, MASK_MODEREADY | MASK_TXREADY, TRUE);		// wait for ModeReady + TX ready
+	HRF_wait_for (radio, ADDR_IRQFLAGS1, MASK_MODEREADY | MASK_TXREADY, TRUE);		// wait for ModeReady + TX ready
 	
-	HRF_reg_Wn(buf + 4, 0, 12);		// Send few more same messages
+	HRF_reg_Wn(radio, buf + 4, 0, 12);		// Send few more same messages
+
+	burst->remaining = repeat_send;
+	clock_gettime(CLOCK_MONOTONIC, &burst->deadline);
+	burst->deadline.tv_nsec += HRF_OOK_AIRTIME_US(repeat_send) * 2 * 1000L;
+	burst->deadline.tv_sec += burst->deadline.tv_nsec / 1000000000L;
+	burst->deadline.tv_nsec %= 1000000000L;
+	HRF_continue_OOK_msg(radio, burst);
+	return true;
+}
 
-	for (i = 0; i < repeat_send; ++i)
-	{
-		HRF_wait_for(ADDR_IRQFLAGS2, MASK_FIFOLEVEL, FALSE);
-		HRF_reg_Wn(buf, 0, 16);			// +4 sync bytes
+/* Writes as many messages of the burst as the FIFO has room for, then
+ * once they are all sent puts the radio back to receiving FSK, or in 
+ * standby, and returns true.  A burst taking twice its airtime is given
+ * up on in the same way.
+ */
+bool HRF_continue_OOK_msg(struct hrfRadio *radio, struct hrfOOKBurst *burst)
+{
+	struct timespec now;
+	bool late;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = (now.tv_sec > burst->deadline.tv_sec 
+	        || (now.tv_sec == burst->deadline.tv_sec && now.tv_nsec > burst->deadline.tv_nsec));
+	if (late) {
+		log4c_category_warn(hrflog, "%s OOK burst not sent in time", radio->name);
+		ledEvent(LED_ERROR);
+	} else if (burst->remaining > 0) {
+		while (burst->remaining > 0 
+		       && !(HRF_reg_R(radio, ADDR_IRQFLAGS2) & MASK_FIFOLEVEL)) {
+			HRF_reg_Wn(radio, burst->buf, 0, 16);	// +4 sync bytes
+			--burst->remaining;
+		}
+		return false;
+	} else if (!(HRF_reg_R(radio, ADDR_IRQFLAGS2) & MASK_PACKETSENT)) {
+		return false;
+	} else {
+		HRF_assert_reg_val(radio, ADDR_IRQFLAGS2, MASK_FIFONOTEMPTY | MASK_FIFOOVERRUN, FALSE, "are all bytes sent?");
 	}
 
-	HRF_wait_for (ADDR_IRQFLAGS2, MASK_PACKETSENT, TRUE);		// wait for Packet sent
-	
-	HRF_assert_reg_val(ADDR_IRQFLAGS2, MASK_FIFONOTEMPTY | MASK_FIFOOVERRUN, FALSE, "are all bytes sent?");
-
-	HRF_config_FSK();
-	HRF_wait_for (ADDR_IRQFLAGS1, MASK_MODEREADY, TRUE);			// wait for ModeReady
-    pthread_mutex_unlock(&mutex);
-    ledControl(redLED, ledOff);
-
-    // Delay found necessary to enable sending messages to a number of different
-    // devices in a short time.
-    // From Whaleygeek
-    //  * At OOK 4800bps, 1 bit is 20uS, 1 byte is 1.6ms, 16 bytes is 26.6ms
-    // Delay by this times the number of repeats plus a fudge factor
-    usleep(repeat_send * (26600) + 38000 );
+	if (radio->receiveFSK) {
+		HRF_config_FSK(radio);
+	} else {
+		HRF_change_mode(radio, MODE_STANDBY);		// Only sends OOK, so keep the configuration
+	}
+	HRF_wait_for (radio, ADDR_IRQFLAGS1, MASK_MODEREADY, TRUE);			// wait for ModeReady
+	return true;
 }
 
 uint8_t* HRF_make_FSK_msg(uint8_t manufacturerId, uint8_t encryptionId,
 						  uint8_t productId, uint32_t sensorId, uint8_t paramNum, ...){
-	uint8_t *msgData = (uint8_t*)malloc(MAX_FIFO_SIZE * sizeof(uint8_t));
+	uint8_t records[MAX_FSK_RECORDS_LEN];
 	uint8_t i;
 	va_list valist;
+
+	va_start(valist, paramNum);
+	for (i = 0; i < paramNum && i < MAX_FSK_RECORDS_LEN; ++i)
+	{
+		records[i] = va_arg(valist, uint);
+	}
+	va_end(valist);
+	return HRF_make_FSK_records_msg(manufacturerId, encryptionId, productId, sensorId,
+	                                records, i);
+}
+/* Builds an encrypted message from an already encoded block of
+ * OpenThings records, so several records can share one frame.
+ * recordsLen must not exceed MAX_FSK_RECORDS_LEN.
+ */
+uint8_t* HRF_make_FSK_records_msg(uint8_t manufacturerId, uint8_t encryptionId,
+                                  uint8_t productId, uint32_t sensorId,
+                                  const uint8_t *records, uint8_t recordsLen){
+	uint8_t *msgData = (uint8_t*)malloc(MAX_FIFO_SIZE * sizeof(uint8_t));
+	HRF_build_FSK_records_msg(msgData, manufacturerId, encryptionId, productId, sensorId,
+	                          records, recordsLen);
+	return msgData;
+}
+/* As HRF_make_FSK_records_msg, but into a caller supplied buffer of
+ * MAX_FIFO_SIZE bytes, so a reply can be prepared before it is needed.
+ */
+void HRF_build_FSK_records_msg(uint8_t *msgData, uint8_t manufacturerId, uint8_t encryptionId,
+                               uint8_t productId, uint32_t sensorId,
+                               const uint8_t *records, uint8_t recordsLen){
 	//										msgData[0] reserved, reg used while sending
-	msgData[MSG_REMAINING_LEN+1] = MSG_OVERHEAD_LEN + paramNum;
+	msgData[MSG_REMAINING_LEN+1] = MSG_OVERHEAD_LEN + recordsLen;
 	msgData[MSG_MANUF_ID+1] = manufacturerId;
 	msgData[MSG_PRODUCT_ID+1] = productId;
 	msgData[MSG_RESERVED_HI+1] = rand();
@@ -295,73 +397,73 @@ uint8_t* HRF_make_FSK_msg(uint8_t manufacturerId, uint8_t encryptionId,
 	msgData[MSG_SENSOR_ID_2+1] = (sensorId >> 16) & 0xff;
 	msgData[MSG_SENSOR_ID_1+1] = (sensorId >> 8) & 0xff;
 	msgData[MSG_SENSOR_ID_0+1] = sensorId & 0xFF;
-	
-	va_start(valist, paramNum);
-	for (i = 0; i < paramNum; ++i)
-	{
-		msgData[MSG_DATA_START+1 + i] = va_arg(valist, uint);
-	}
-	va_end(valist);
+	memcpy(&msgData[MSG_DATA_START+1], records, recordsLen);
 	setupCrc(msgData + 1);
 	encryptMsg(encryptionId, msgData + 1, msgData[MSG_REMAINING_LEN+1]);
-	return msgData;
 }
-void HRF_send_FSK_msg(uint8_t* buf, uint8_t encryptionId){
+void HRF_send_FSK_msg(struct hrfRadio *radio, uint8_t* buf){
+
+	HRF_send_FSK_frame(radio, buf, NULL);
+	free(buf);
+	return;
+}
+/* Sends an already encrypted message, leaving buf untouched.
+ * If txStarted is not NULL it is set to the time the frame
+ * had been written to the FIFO.
+ */
+void HRF_send_FSK_frame(struct hrfRadio *radio, const uint8_t* buf, struct timespec *txStarted){
 	uint8_t size = buf[MSG_REMAINING_LEN+1], i;
 
 
-    ledControl(redLED, ledOn);
-    pthread_mutex_lock(&mutex);
+    ledEvent(LED_TRANSMIT);
+    pthread_mutex_lock(&radio->mutex);
 
-	HRF_change_mode(MODE_TRANSMITER);									// Switch to TX mode
-	HRF_wait_for(ADDR_IRQFLAGS1, MASK_MODEREADY | MASK_TXREADY, TRUE);		// wait for ModeReady + TX ready
-	HRF_reg_Wn(buf, 0, size + 1);
+	HRF_change_mode(radio, MODE_TRANSMITER);									// Switch to TX mode
+	HRF_wait_for(radio, ADDR_IRQFLAGS1, MASK_MODEREADY | MASK_TXREADY, TRUE);		// wait for ModeReady + TX ready
+	HRF_reg_Wn(radio, (uint8_t*)buf, 0, size + 1);
+
+	if (txStarted) {
+		clock_gettime(CLOCK_MONOTONIC, txStarted);
+	}
 
-	encryptMsg(encryptionId, buf + 1, buf[MSG_REMAINING_LEN+1]);
-	// printf("Send msg data: ");
-	//for (i=1; i <= buf[MSG_REMAINING_LEN+1] + 1 ; ++i)
-		//printf("%02x, ",buf[i]);
-	//printf("\n\n");
     if (log4c_category_is_trace_enabled(hrflog)) {
 
-        logBufferUsedCount = 0;
+        int logBufferUsedCount = 0;
 
-        for (i=1; i <= buf[MSG_REMAINING_LEN+1] + 1 ; ++i) {
-            logBufferUsedCount += snprintf(&logBuffer[logBufferUsedCount],
+        for (i=1; i <= size + 1 ; ++i) {
+            logBufferUsedCount += snprintf(&radio->logBuffer[logBufferUsedCount],
                                            MSG_LOG_BUFFER_SIZE - logBufferUsedCount,
                                            "[%d]=%02x%c", 
                                            i, buf[i], i%8==7?'\n':'\t');
         }
-        logBuffer[MSG_LOG_BUFFER_SIZE - 1] = '\0';
+        radio->logBuffer[MSG_LOG_BUFFER_SIZE - 1] = '\0';
         log4c_category_log(hrflog, LOG4C_PRIORITY_TRACE, 
-                           "Msg Data Sent\n%s", logBuffer);
+                           "%s Encrypted Msg Data Sent\n%s", radio->name, radio->logBuffer);
     }
 
-	HRF_wait_for(ADDR_IRQFLAGS2, MASK_PACKETSENT, TRUE);					// wait for Packet sent
-	HRF_assert_reg_val(ADDR_IRQFLAGS2, MASK_FIFONOTEMPTY | MASK_FIFOOVERRUN, FALSE, "are all bytes sent?");
-
-	HRF_change_mode(MODE_RECEIVER);												// Switch to RX mode
-	HRF_wait_for(ADDR_IRQFLAGS1, MASK_MODEREADY, TRUE);						// wait for ModeReady
+	HRF_wait_for(radio, ADDR_IRQFLAGS2, MASK_PACKETSENT, TRUE);					// wait for Packet sent
+	HRF_assert_reg_val(radio, ADDR_IRQFLAGS2, MASK_FIFONOTEMPTY | MASK_FIFOOVERRUN, FALSE, "are all bytes sent?");
 
-    pthread_mutex_unlock(&mutex);
-    ledControl(redLED, ledOff);
+	HRF_change_mode(radio, MODE_RECEIVER);												// Switch to RX mode
+	HRF_wait_for(radio, ADDR_IRQFLAGS1, MASK_MODEREADY, TRUE);						// wait for ModeReady
 
-	free(buf);
-	return;
+    pthread_mutex_unlock(&radio->mutex);
 }
 #if 0
 void decryptMsg(uint8_t *buf, uint8_t size){
 	uint8_t i;
-	seed(SEED_PID, (uint16_t)(buf[MSG_RESERVED_HI]<<8)|buf[MSG_RESERVED_LO]);
+	struct cipher cipher;
+	seed(&cipher, SEED_PID, (uint16_t)(buf[MSG_RESERVED_HI]<<8)|buf[MSG_RESERVED_LO]);
 	for (i = MSG_ENCR_START; i <= size; ++i)
-		buf[i] = decrypt(buf[i]);	
+		buf[i] = decrypt(&cipher, buf[i]);	
 }
 #endif
 void encryptMsg(uint8_t encryptionId, uint8_t *buf, uint8_t size){
 	uint8_t i;
-	seed(encryptionId, (uint16_t)(buf[MSG_RESERVED_HI]<<8)|buf[MSG_RESERVED_LO]);
+	struct cipher cipher;
+	seed(&cipher, encryptionId, (uint16_t)(buf[MSG_RESERVED_HI]<<8)|buf[MSG_RESERVED_LO]);
 	for (i = MSG_ENCR_START; i <= size; ++i)
-		buf[i] = decrypt(buf[i]);	
+		buf[i] = decrypt(&cipher, buf[i]);	
 }
 void setupCrc(uint8_t *buf){
 	uint16_t val, size = buf[MSG_REMAINING_LEN];
@@ -371,76 +473,258 @@ void setupCrc(uint8_t *buf){
 	buf[size] = val & 0x00FF;
 }	
 	
-void HRF_receive_FSK_msg(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerId, 
-                         struct ReceivedMsgData *msgData )
+/* Identifies a frame by its header up to the sensorId, which is still
+ * encrypted, so a repeat can be recognised without decoding it.
+ */
+static uint64_t frameKey(const uint8_t *frame)
+{
+	uint64_t key = 0;
+	int i;
+
+	for (i = MSG_MANUF_ID; i <= MSG_SENSOR_ID_0; ++i)
+		key = (key << 8) | frame[i];
+	return key;
+}
+
+static uint32_t timeMs(const struct timespec *time)
+{
+	return time->tv_sec * 1000 + time->tv_nsec / 1000000;
+}
+
+/* Returns true if the frame with key was received and decoded within 
+ * the last HRF_DUPLICATE_WINDOW_MS.
+ */
+static bool HRF_seen_frame(struct hrfRadio *radio, uint64_t key, uint32_t nowMs)
+{
+	int i;
+
+	for (i = 0; i < HRF_RECENT_FRAMES; ++i)
+	{
+		if (radio->recentKeys[i] == key)
+			return nowMs - radio->recentMs[i] < HRF_DUPLICATE_WINDOW_MS;
+	}
+	return false;
+}
+
+/* Remembers a decoded frame, in place of the least recent */
+static void HRF_remember_frame(struct hrfRadio *radio, uint64_t key, uint32_t nowMs)
+{
+	memmove(&radio->recentKeys[1], &radio->recentKeys[0], 
+	        (HRF_RECENT_FRAMES - 1) * sizeof(radio->recentKeys[0]));
+	memmove(&radio->recentMs[1], &radio->recentMs[0], 
+	        (HRF_RECENT_FRAMES - 1) * sizeof(radio->recentMs[0]));
+	radio->recentKeys[0] = key;
+	radio->recentMs[0] = nowMs;
+}
+
+/* Opens a line event for the radio's DIO0 pin, which is mapped to
+ * PayloadReady, so that frames can be waited for with poll or epoll.
+ * Returns -1 if DIO0 isn't wired or the GPIO device can't be used.
+ */
+int HRF_open_irq(struct hrfRadio *radio)
+{
+	struct gpioevent_request request;
+	int chip;
+
+	if (radio->dio0Pin == 0 || radio->spi != &hrfBcm2835Ops)
+		return -1;
+
+	chip = open(radio->gpioChip, O_RDONLY | O_CLOEXEC);
+	if (chip < 0)
+	{
+		log4c_category_warn(hrflog, "%s unable to open %s", radio->name, radio->gpioChip);
+		return -1;
+	}
+
+	memset(&request, 0, sizeof(request));
+	request.lineoffset = radio->dio0Pin;
+	request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	request.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+	strncpy(request.consumer_label, "engMQTTClient", sizeof(request.consumer_label) - 1);
+	if (ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &request) < 0)
+	{
+		log4c_category_warn(hrflog, "%s unable to use GPIO %d for DIO0", 
+		                    radio->name, radio->dio0Pin);
+		close(chip);
+		return -1;
+	}
+	close(chip);
+
+	pthread_mutex_lock(&radio->mutex);
+	HRF_reg_W(radio, ADDR_DIOMAPPING1, VAL_DIOMAPPING1_PAYLOADRDY);
+	pthread_mutex_unlock(&radio->mutex);
+	return request.fd;
+}
+
+/* Takes the event that made the DIO0 line readable */
+void HRF_ack_irq(int fd)
 {
-	static uint16_t msg_cnt = 0;
+	struct gpioevent_data event;
 
-    ledControl(redLED, ledOn);
-    pthread_mutex_lock(&mutex);
+	if (read(fd, &event, sizeof(event)) != sizeof(event))
+		log4c_category_warn(hrflog, "DIO0 event read failed");
+}
 
-	if ((HRF_reg_R(ADDR_IRQFLAGS2) & MASK_PAYLOADRDY) == MASK_PAYLOADRDY)
+/* Reads the frame waiting in the FIFO into frame, with the RSSI and 
+ * frequency error it was received with.  Returns false if there is no
+ * complete frame, clearing the FIFO if it has overrun.
+ */
+bool HRF_read_FSK_frame(struct hrfRadio *radio, struct hrfFrame *frame)
+{
+	uint8_t link[5];							// [0] reserved for the address
+	uint8_t flags;
+	uint8_t len;
+
+	pthread_mutex_lock(&radio->mutex);
+
+	flags = HRF_reg_R(radio, ADDR_IRQFLAGS2);
+	if (flags & MASK_FIFOOVERRUN)
 	{
-		uint8_t recordBytesRead = 0;
+		radio->fifoOverruns++;
+		ledEvent(LED_ERROR);
+		log4c_category_warn(hrflog, "%s FIFO overrun", radio->name);
+		HRF_reg_W(radio, ADDR_IRQFLAGS2, MASK_FIFOOVERRUN);	// Clears the FIFO
+		pthread_mutex_unlock(&radio->mutex);
+		return false;
+	}
+	if ((flags & MASK_PAYLOADRDY) != MASK_PAYLOADRDY)
+	{
+		pthread_mutex_unlock(&radio->mutex);
+		return false;
+	}
+
+	ledEvent(LED_FRAME_RECEIVED);
+	clock_gettime(CLOCK_MONOTONIC, &frame->receivedTime);
+	frame->msgNumber = ++radio->msgCount;
+
+	// FEI and RSSI in one burst, then the length and the rest of the frame in another
+	HRF_reg_Rn(radio, link, ADDR_FEIMSB, 4);
+	frame->fei = (int32_t)((int16_t)((link[1] << 8) | link[2]) * HRF_FSTEP_HZ);
+	frame->rssi = -link[4] / 2.0f;
+
+	len = HRF_reg_R(radio, ADDR_FIFO);
+	if (len >= MAX_FIFO_SIZE)
+		len = MAX_FIFO_SIZE - 1;
+	if (len > 0)
+		HRF_reg_Rn(radio, frame->data + 1, ADDR_FIFO, len);	// data[1] holds the address during the burst
+	frame->data[1] = len;
+	HRF_clr_fifo(radio);						// Anything left over is discarded
+
+	pthread_mutex_unlock(&radio->mutex);
+
+	log4c_category_debug(hrflog, "Received Message %d", frame->msgNumber);
+	return true;
+}
+
+/* Decrypts and decodes frame into msgData, unless it is a repeat of one
+ * already decoded or from none of the productCount products.  Only the 
+ * thread decoding frames for radio may call this.
+ */
+void HRF_decode_FSK_frame(struct hrfRadio *radio, const struct hrfFrame *frame, 
+                          const struct otProduct *products, int productCount,
+                          struct ReceivedMsgData *msgData)
+{
+	uint8_t recordBytesRead = 0;
+	uint8_t fifoLen = frame->data[1] + 1;
+	uint8_t fifoPos = 1;
+	uint64_t key = 0;
+	uint16_t msg_cnt = frame->msgNumber;
+
+	msg_t msg = {S_MSGLEN, 1, SIZE_MSGLEN, 0, 0, 0, 0, 0};	// message strucure instance
 
-		msg_t msg = {S_MSGLEN, 1, SIZE_MSGLEN, 0, 0, 0, 0, 0};	// message strucure instance
-        ++msg_cnt;
-        log4c_category_debug(hrflog, "Receiving Message %d", msg_cnt);
+	msgData->receivedTime = frame->receivedTime;
+	msgData->rssi = frame->rssi;
+	msgData->fei = frame->fei;
 
-		while (msg.state != S_FINISH)
+	if (fifoLen >= MSG_SENSOR_ID_0 + 1)
+	{
+		key = frameKey(frame->data + 1);
+		if (HRF_seen_frame(radio, key, timeMs(&msgData->receivedTime)))
 		{
-			if (msg.msgSize == 0){
-				log4c_category_error(hrflog, "Msg %d: Trying to read more data than should be read", msg_cnt);
-				msg.state = S_FINISH;
-				break;
-			}
-			//HRF_wait_for(ADDR_IRQFLAGS2, MASK_FIFONOTEMPTY, TRUE);		// Not needed now. All message bytes should be already waiting in FIFO
-			if (msg.state > S_ENCRYPTPIP)						// in states after S_ENCYPTPIP bytes need to be decrypted
-			{
-				msg.buf[msg.bufCnt++] = decrypt(HRF_reg_R(ADDR_FIFO));
-			}
-			else
-			{
-				msg.buf[msg.bufCnt++] = HRF_reg_R(ADDR_FIFO);
-			}
-			msg.value = (msg.value << 8) | msg.buf[msg.bufCnt - 1];
-			++recordBytesRead;
-			--msg.msgSize;
+			log4c_category_debug(hrflog, "Msg %d: Dropping duplicate frame", msg_cnt);
+			radio->duplicates++;
+			msg.state = S_FINISH;
+			msg.msgSize = 0;
+		}
+	}
 
-			if (recordBytesRead == msg.recordBytesToRead)
-			{
-				recordBytesRead = 0;
-				msgNextState(encryptionId, productId, manufacturerId, &msg, msgData);
-				msg.value = 0;
-			}
+	while (msg.state != S_FINISH)
+	{
+		if (msg.msgSize == 0){
+			log4c_category_error(hrflog, "Msg %d: Trying to read more data than should be read", msg_cnt);
+			msg.state = S_FINISH;
+			break;
+		}
+		uint8_t byte = (fifoPos <= fifoLen) ? frame->data[fifoPos++] : 0;
+		if (msg.state > S_ENCRYPTPIP)						// in states after S_ENCYPTPIP bytes need to be decrypted
+		{
+			msg.buf[msg.bufCnt++] = decrypt(&msg.cipher, byte);
+		}
+		else
+		{
+			msg.buf[msg.bufCnt++] = byte;
 		}
+		msg.value = (msg.value << 8) | msg.buf[msg.bufCnt - 1];
+		++recordBytesRead;
+		--msg.msgSize;
 
-        if (msg.crcPassed) {
-            msgData->msgAvailable = 1;
-            msgData->manufId = msg.manufId;
-            msgData->prodId = msg.prodId;
-            msgData->sensorId = msg.sensorId;
-            msgData->joinCommand = msg.gotJoin;
-            if (msgData->receivedTempReport) {
-                log4c_category_info(hrflog, "Msg=%d, SensorId=%d, Temperature=%s", 
-                                    msg_cnt, msg.sensorId, msgData->receivedTemperature);
-            }
+		if (recordBytesRead == msg.recordBytesToRead)
+		{
+			recordBytesRead = 0;
+			msgNextState(radio, products, productCount, &msg, msgData);
+			msg.value = 0;
+		}
+	}
+
+    if (msg.crcPassed) {
+        HRF_remember_frame(radio, key, timeMs(&msgData->receivedTime));
+        msgData->msgAvailable = 1;
+        msgData->manufId = msg.manufId;
+        msgData->prodId = msg.prodId;
+        msgData->sensorId = msg.sensorId;
+        msgData->joinCommand = msg.gotJoin;
+        if (msgData->receivedTempReport) {
+            log4c_category_info(hrflog, "Msg=%d, SensorId=%d, Temperature=%s RSSI=%.1fdBm", 
+                                msg_cnt, msg.sensorId, msgData->receivedTemperature,
+                                msgData->rssi);
         }
+    } else if (msg.sensorId != 0) {
+        msgData->crcFailed = 1;
+        msgData->sensorId = msg.sensorId;
+    }
 
-		msgNextState(encryptionId, productId, manufacturerId, &msg, msgData);
-		                
-	}
+	msgNextState(radio, products, productCount, &msg, msgData);
+}
 
-    pthread_mutex_unlock(&mutex);
-    ledControl(redLED, ledOff);
+void HRF_receive_FSK_msg(struct hrfRadio *radio, const struct otProduct *products, int productCount,
+                         struct ReceivedMsgData *msgData )
+{
+	struct hrfFrame frame;
 
+	if (HRF_read_FSK_frame(radio, &frame))
+		HRF_decode_FSK_frame(radio, &frame, products, productCount, msgData);
 }
 
 
+/* Keeps a decoded record in msgData, if there is room */
+static void addRecord(struct ReceivedMsgData *msgData, uint8_t paramId, uint8_t type,
+                      uint8_t length, uint32_t value)
+{
+	struct otRecord *record;
+
+	if (msgData->recordCount == MAX_OT_RECORDS)
+		return;
+	record = &msgData->records[msgData->recordCount++];
+	record->paramId = paramId;
+	record->type = type;
+	record->length = length;
+	record->value = value;
+}
 
-void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerId, msg_t *msgPtr,
+void msgNextState(struct hrfRadio *radio, const struct otProduct *products, int productCount, msg_t *msgPtr,
                   struct ReceivedMsgData *msgData){		// Switch and initialize next state
 	const char *temp;
+	int i;
 	switch (msgPtr->state)
 	{
 		case S_MSGLEN:							// Read message length
@@ -449,8 +733,11 @@ void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerI
 			msgPtr->msgSize = msgPtr->value;
 			break;
 		case S_MANUFID:
-               if (msgPtr->value == manufacturerId)
+			for (i = 0; i < productCount && products[i].manufacturerId != msgPtr->value; ++i)
+				;
+               if (i < productCount)
             {
+                msgPtr->manufId = msgPtr->value;
                 msgPtr->state = S_PRODID;
                 msgPtr->recordBytesToRead = SIZE_PRODID;
                 log4c_category_debug(hrflog, " ManufacturerID=%#02x", msgPtr->value);
@@ -464,8 +751,13 @@ void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerI
 			break;
 		case S_PRODID:							// Read product identifier
 			
-			  if (msgPtr->value == productId)
+			for (i = 0; i < productCount 
+			     && (products[i].manufacturerId != msgPtr->manufId || products[i].productId != msgPtr->value); ++i)
+				;
+			  if (i < productCount)
             {
+                msgPtr->prodId = msgPtr->value;
+                msgPtr->encryptionId = products[i].encryptId;
                 msgPtr->state = S_ENCRYPTPIP;
                 msgPtr->recordBytesToRead = SIZE_ENCRYPTPIP;
                 log4c_category_debug(hrflog, " ProductID=%#02x", msgPtr->value);
@@ -480,7 +772,7 @@ void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerI
 			msgPtr->state = S_SENSORID;
 			msgPtr->recordBytesToRead = SIZE_SENSORID;
 			msgPtr->pip = msgPtr->value;
-			seed(encryptionId, msgPtr->pip);
+			seed(&msgPtr->cipher, msgPtr->encryptionId, msgPtr->pip);
 			break;
 		case S_SENSORID:						// Read sensor ID		
 
@@ -530,6 +822,10 @@ void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerI
                         msgData->receivedVoltage = 1;
                         break;
 
+                    case OT_TEMP_SET:
+                        msgData->receivedTargetTemperature = 1;
+                        break;
+
                     default:
                         log4c_category_error(hrflog, 
                                              "Don't understand OpenThings message 0x%x",
@@ -546,6 +842,7 @@ void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerI
 
 			if ((msgPtr->value & 0x0F) == 0)	// No more data to read in that record
 			{
+				addRecord(msgData, msgPtr->paramId, msgPtr->value >> 4, 0, 0);
 				msgPtr->state = S_DATA_PARAMID;
 				msgPtr->recordBytesToRead = SIZE_DATA_PARAMID;
 			}
@@ -557,6 +854,8 @@ void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerI
 			msgPtr->type = msgPtr->value;
 			break;
 		case S_DATA_VAL:						// Read record data
+            addRecord(msgData, msgPtr->paramId, msgPtr->type >> 4, 
+                      msgPtr->recordBytesToRead, msgPtr->value);
             switch (msgPtr->paramId) {
                 case OT_TEMP_REPORT:
                     temp = getValString(msgPtr->value, msgPtr->type >> 4, msgPtr->recordBytesToRead);
@@ -579,6 +878,12 @@ void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerI
                     msgData->voltageData[MAX_DATA_LENGTH] = '\0';
                     break;
 
+                case OT_TEMP_SET:
+                    temp = getValString(msgPtr->value, msgPtr->type >> 4, msgPtr->recordBytesToRead);
+                    log4c_category_debug(hrflog, " target=%s", temp);
+                    msgData->targetTemperature = (uint32_t)(atof(temp) + 0.5);
+                    break;
+
 
                 default:
                     break;
@@ -614,25 +919,22 @@ void msgNextState(uint8_t encryptionId, uint8_t productId, uint8_t manufacturerI
             if (log4c_category_is_trace_enabled(hrflog)) {
 
                 int i;
-                logBufferUsedCount = 0;
+                int logBufferUsedCount = 0;
 
                 for (i = 0; i < msgPtr->bufCnt; ++i){
                     logBufferUsedCount += 
-                        snprintf(&logBuffer[logBufferUsedCount],
+                        snprintf(&radio->logBuffer[logBufferUsedCount],
                                  MSG_LOG_BUFFER_SIZE - logBufferUsedCount,
                                  "[%d]=%02x%c", 
                                  i, msgPtr->buf[i], i%8==7?'\n':'\t');
                 }
-                logBuffer[MSG_LOG_BUFFER_SIZE - 1] = '\0';
+                radio->logBuffer[MSG_LOG_BUFFER_SIZE - 1] = '\0';
                 log4c_category_log(hrflog, LOG4C_PRIORITY_TRACE, 
-                                   "Msg Data\n%s", logBuffer);
+                                   "%s Msg Data\n%s", radio->name, radio->logBuffer);
             }
 
 			msgPtr->bufCnt = 0;
 			msgPtr->value = 0;
-			HRF_clr_fifo();						// If there is an error, 
-                                                // remaining of the message 
-                                                // should be discarded
 	
 			break;
 		default:
@@ -734,8 +1036,106 @@ char* getValString(uint64_t dataVal, uint8_t type, uint8_t length){
 	return str;
 }
 
+/* Reads a numeric record value, scaled as getValString does.  Returns
+ * false for characters, reserved types and records without a value.
+ */
+bool otRecordValue(const struct otRecord *record, double *value){
+	int length = record->length > 4 ? 4 : record->length;
+	int64_t signedValue = record->value;
+
+	if (length == 0)
+		return false;
+
+	if (record->type <= 6){					// unsigned integer
+		*value = (double)record->value / (1 << (4*record->type));
+		return true;
+	}
+
+	if (record->value & (1uLL << (length*8-1)))	// check neg
+		signedValue -= 1LL << (length*8);
+
+	if (record->type >= 8 && record->type <= 11){		// signed integer
+		*value = (double)signedValue / (1 << (8*(record->type-8)));
+		return true;
+	}
+	if (record->type == 15 && (length == 2 || length == 4)){	// floating point
+		*value = (double)signedValue / (1 << (length == 2 ? 11 : 24));
+		return true;
+	}
+	return false;
+}
+
 void ledControl(enum ledColor led, enum ledOnOff OnOff) {
 	bcm2835_gpio_write(led, OnOff);
 }
 
+void HRF_led(struct hrfRadio *radio, enum ledColor led, enum ledOnOff OnOff) {
+	radio->spi->led(radio, led, OnOff);
+}
+
+/* Brings up the radio, for FSK reception if receiveFSK is set and for
+ * sending OOK otherwise.  A radio that still holds the FSK configuration
+ * is not reset, and true is returned for this warm start.
+ */
+bool HRF_init(struct hrfRadio *radio){
+	bool warm = false;
+
+	pthread_mutex_init(&radio->mutex, NULL);
+
+	if (radio->receiveFSK && HRF_check_FSK(radio)) {
+		HRF_change_mode(radio, MODE_RECEIVER);
+		radio->modulation = HRF_MODULATION_FSK;
+		warm = true;
+	} else {
+		radio->spi->reset(radio);
+		if (radio->receiveFSK) {
+			HRF_config_FSK(radio);
+		} else {
+			HRF_config_OOK(radio);
+			HRF_change_mode(radio, MODE_STANDBY);
+		}
+	}
+	HRF_wait_for(radio, ADDR_IRQFLAGS1, MASK_MODEREADY, TRUE);		// wait until ready after mode switching
+	HRF_clr_fifo(radio);
+	log4c_category_info(hrflog, "%s radio ready on chip select %d, %s start", 
+	                    radio->name, radio->chipSelect, warm ? "warm" : "cold");
+	return warm;
+}
+
+/* SPI backend for radios on the Pi's SPI bus.  The bus is shared, so
+ * the chip select is set for each transfer under a bus lock.
+ */
+static pthread_mutex_t spiBusMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void bcm2835Transfer(struct hrfRadio *radio, uint8_t *buf, uint32_t len){
+	pthread_mutex_lock(&spiBusMutex);
+	bcm2835_spi_chipSelect(radio->chipSelect);
+	bcm2835_spi_transfern((char*)buf, len);
+	pthread_mutex_unlock(&spiBusMutex);
+}
+static void bcm2835Write(struct hrfRadio *radio, const uint8_t *buf, uint32_t len){
+	pthread_mutex_lock(&spiBusMutex);
+	bcm2835_spi_chipSelect(radio->chipSelect);
+	bcm2835_spi_writenb((char*)buf, len);
+	pthread_mutex_unlock(&spiBusMutex);
+}
+static void bcm2835Reset(struct hrfRadio *radio){
+	bcm2835_gpio_write(radio->resetPin, LOW);
+	bcm2835_gpio_fsel(radio->resetPin, BCM2835_GPIO_FSEL_OUTP);
+	bcm2835_gpio_write(radio->resetPin, HIGH);
+	usleep(10000);
+	bcm2835_gpio_write(radio->resetPin, LOW);
+	usleep(10000);
+}
+static void bcm2835Led(struct hrfRadio *radio, enum ledColor led, enum ledOnOff OnOff){
+	ledControl(led, OnOff);
+}
+
+const struct hrfSpiOps hrfBcm2835Ops = {
+	bcm2835Transfer,
+	bcm2835Write,
+	bcm2835Reset,
+	bcm2835Led
+};
+
 /* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
@@ -2,6 +2,10 @@
 #define DEV_HRF_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "decoder.h"
 
 #define SEED_PID			0x01
 #define MANUF_SENTEC        0x01
@@ -23,6 +27,9 @@
 #define ADDR_LNA			0x18
 #define ADDR_RXBW			0x19
 #define ADDR_AFCFEI			0x1E
+#define ADDR_FEIMSB			0x21	// FeiMsb, FeiLsb, RssiConfig and RssiValue follow
+#define ADDR_RSSIVALUE		0x24
+#define ADDR_DIOMAPPING1	0x25
 #define ADDR_IRQFLAGS1		0x27
 #define ADDR_IRQFLAGS2		0x28
 #define ADDR_RSSITHRESH		0x29
@@ -89,6 +96,7 @@
 #define VAL_PAYLOADLEN64		0x40	// max Length in RX, not used in Tx
 #define VAL_PAYLOADLEN_OOK		(13 + 8 * 17)	// Payload Length
 #define VAL_NODEADDRESS01		0x04	// Node address used in address filtering
+#define VAL_DIOMAPPING1_PAYLOADRDY	0x40	// DIO0 is PayloadReady in RX
 #define VAL_FIFOTHRESH1			0x81	// Condition to start packet transmission: at least one byte in FIFO
 #define VAL_FIFOTHRESH30		0x1E	// Condition to start packet transmission: wait for 30 bytes in FIFO
 
@@ -104,12 +112,44 @@
 #define MSG_ENCR_START    MSG_SENSOR_ID_2
 #define MSG_OVERHEAD_LEN  (MSG_DATA_START+2)
 
+/* Space left for records once the reserved register byte, the length
+ * byte and the message overhead are taken out of the FIFO buffer */
+#define MAX_FSK_RECORDS_LEN (MAX_FIFO_SIZE - 2 - MSG_OVERHEAD_LEN)
+
 #define MAX_DATA_LENGTH MESSAGE_BUF_SIZE
 
 /* OOK Message Parameters */
 #define OOK_BUF_SIZE 17
 #define OOK_MSG_ADDRESS_LENGTH  10   /* 10 bytes in address */
 
+/* Airtime of an OOK burst of repeat messages at 4800b/s.  12 bytes
+ * are sent before the repeats of 16 bytes, each byte taking 1.67ms */
+#define HRF_OOK_AIRTIME_US(repeat)  ((12 + 16 * (repeat)) * 8 * 1000000LL / 4800)
+
+/* Delay found necessary after an OOK burst to enable sending messages 
+ * to a number of different devices in a short time.
+ * From Whaleygeek
+ *  * At OOK 4800bps, 1 bit is 20uS, 1 byte is 1.6ms, 16 bytes is 26.6ms
+ * Delay by this times the number of repeats plus a fudge factor
+ */
+#define HRF_OOK_GAP_US(repeat)      ((repeat) * 26600 + 38000)
+
+/* How long the FIFO lasts once it has dropped to the FIFO threshold, so
+ * how often a burst sent in steps must be topped up */
+#define HRF_OOK_FIFO_DRAIN_US       (VAL_FIFOTHRESH30 * 8 * 1000000LL / 4800)
+
+/* An ENER002 burst being sent in steps */
+struct hrfOOKBurst {
+	uint8_t buf[OOK_BUF_SIZE];
+	int remaining;					// Messages still to write to the FIFO
+	struct timespec deadline;		// Given up on if not sent by then
+};
+
+/* Airtime of an FSK message of size bytes after the length byte, at
+ * the default 4800b/s with Manchester coding doubling the bits sent.
+ * The preamble and sync word add 5 bytes */
+#define HRF_FSK_AIRTIME_US(size)    ((5 + 1 + (size)) * 16 * 1000000LL / 4800)
+
 
 enum ledColor {
     redLED = RPI_V2_GPIO_P1_15,
@@ -153,13 +193,28 @@ typedef struct msg_t {
 	uint8_t	gotJoin;
 	uint8_t paramId;
 	uint8_t type;
+	uint8_t encryptionId;
 	uint16_t pip;
+	struct cipher cipher;
 	uint32_t value;
 	uint8_t bufCnt;
 	uint8_t buf[MESSAGE_BUF_SIZE];
         uint8_t crcPassed;
 } msg_t;
 
+/* A record as received, for passing on with its native type.  type is
+ * the OpenThings type, the top nibble of the type description, and
+ * length its number of bytes, 0 for a record with no value.
+ */
+#define MAX_OT_RECORDS 16
+
+struct otRecord {
+    uint8_t paramId;
+    uint8_t type;
+    uint8_t length;
+    uint32_t value;
+};
+
 struct ReceivedMsgData {
     uint8_t msgAvailable;
     uint8_t joinCommand;
@@ -172,30 +227,118 @@ struct ReceivedMsgData {
     uint8_t diagnosticData[2];   /* 0 - Low Byte, 1 - High Byte */
     uint8_t receivedVoltage;
     char voltageData[MAX_DATA_LENGTH];
+    uint8_t receivedTargetTemperature;
+    uint32_t targetTemperature;     /* Whole degrees */
+    struct timespec receivedTime;   /* When PayloadReady was seen */
+    float rssi;                     /* dBm, sampled at PayloadReady */
+    int32_t fei;                    /* Hz, the last frequency error measured */
+    uint8_t crcFailed;              /* sensorId decoded, but the CRC didn't match */
+    uint8_t recordCount;            /* The first MAX_OT_RECORDS */
+    struct otRecord records[MAX_OT_RECORDS];
+};
+
+
+
+#define MSG_LOG_BUFFER_SIZE (MESSAGE_BUF_SIZE * 8)
+
+/* A frame as read from the FIFO, before it is decrypted and decoded */
+struct hrfFrame {
+    struct timespec receivedTime;   /* When PayloadReady was seen */
+    float rssi;                     /* dBm */
+    int32_t fei;                    /* Hz */
+    uint16_t msgNumber;
+    uint8_t data[MAX_FIFO_SIZE + 1];    /* [0] reserved, [1] length, then the frame */
+};
+
+/* Frames received again within HRF_DUPLICATE_WINDOW_MS, from a
+ * retransmission or a reflection, are dropped.  The last HRF_RECENT_FRAMES
+ * are remembered, most recent first.
+ */
+#define HRF_RECENT_FRAMES 16
+#define HRF_DUPLICATE_WINDOW_MS 2000
+
+/* Frequency synthesizer step, 32MHz / 2^19 */
+#define HRF_FSTEP_HZ 61.03515625
+
+struct hrfRadio;
+
+/* Access to a radio's registers and pins, so the driver can be run
+ * against hardware or a simulation.  transfer sends buf and replaces
+ * it with what was read back.
+ */
+struct hrfSpiOps {
+	void (*transfer)(struct hrfRadio *radio, uint8_t *buf, uint32_t len);
+	void (*write)(struct hrfRadio *radio, const uint8_t *buf, uint32_t len);
+	void (*reset)(struct hrfRadio *radio);
+	void (*led)(struct hrfRadio *radio, enum ledColor led, enum ledOnOff OnOff);
 };
 
+extern const struct hrfSpiOps hrfBcm2835Ops;
 
+enum hrfModulation {
+	HRF_MODULATION_UNKNOWN,
+	HRF_MODULATION_FSK,
+	HRF_MODULATION_OOK
+};
+
+/* One RFM69 board.  Each radio has its own lock, so two boards can be
+ * used at once, one receiving FSK while the other sends OOK.
+ */
+struct hrfRadio {
+	const char *name;
+	const struct hrfSpiOps *spi;
+	void *backend;					// Backend's own state
+	uint8_t chipSelect;				// BCM2835_SPI_CS0 or BCM2835_SPI_CS1
+	uint8_t resetPin;
+	uint8_t dio0Pin;				// PayloadReady in RX, PacketSent in TX
+	const char *gpioChip;			// Character device dio0Pin is on
+	bool receiveFSK;				// Listens for FSK when not sending OOK
+	pthread_mutex_t mutex;
+	uint8_t mode;					// Last operating mode written
+	enum hrfModulation modulation;	// Register table last written
+	uint16_t msgCount;
+	char logBuffer[MSG_LOG_BUFFER_SIZE];
+	uint64_t recentKeys[HRF_RECENT_FRAMES];		// Manufacturer, product, pip and
+	uint32_t recentMs[HRF_RECENT_FRAMES];		// encrypted sensorId, and when seen
+	unsigned long duplicates;
+	unsigned long fifoOverruns;
+};
 
-void 	HRF_config_FSK();
-void 	HRF_config_OOK();
-void 	HRF_clr_fifo(void);
-void 	HRF_reg_Rn(uint8_t* , uint8_t, uint8_t);
-void 	HRF_reg_Wn(uint8_t*, uint8_t, uint8_t);
-uint8_t HRF_reg_R(uint8_t);
-void 	HRF_reg_W(uint8_t, uint8_t);
-void 	HRF_change_mode(uint8_t);
-void 	HRF_assert_reg_val(uint8_t, uint8_t, uint8_t, char*);
-void 	HRF_wait_for(uint8_t, uint8_t, uint8_t);
-void	HRF_send_OOK_msg(uint8_t *address, int socketNum, int On, int repeat);
+bool	HRF_init(struct hrfRadio *);
+void	HRF_led(struct hrfRadio *, enum ledColor, enum ledOnOff);
+void 	HRF_config_FSK(struct hrfRadio *);
+bool	HRF_check_FSK(struct hrfRadio *);
+void 	HRF_config_OOK(struct hrfRadio *);
+void 	HRF_clr_fifo(struct hrfRadio *);
+void 	HRF_reg_Rn(struct hrfRadio *, uint8_t* , uint8_t, uint8_t);
+void 	HRF_reg_Wn(struct hrfRadio *, uint8_t*, uint8_t, uint8_t);
+uint8_t HRF_reg_R(struct hrfRadio *, uint8_t);
+void 	HRF_reg_W(struct hrfRadio *, uint8_t, uint8_t);
+void 	HRF_change_mode(struct hrfRadio *, uint8_t);
+void 	HRF_assert_reg_val(struct hrfRadio *, uint8_t, uint8_t, uint8_t, char*);
+void 	HRF_wait_for(struct hrfRadio *, uint8_t, uint8_t, uint8_t);
+void	HRF_send_OOK_msg(struct hrfRadio *, uint8_t *address, int socketNum, int On, int repeat);
+bool	HRF_start_OOK_msg(struct hrfRadio *, struct hrfOOKBurst *, uint8_t *address, 
+                          int socketNum, int On, int repeat);
+bool	HRF_continue_OOK_msg(struct hrfRadio *, struct hrfOOKBurst *);
 uint8_t* HRF_make_FSK_msg(uint8_t, uint8_t, uint8_t, uint32_t, uint8_t, ...);
-void 	HRF_send_FSK_msg(uint8_t*, uint8_t);
+uint8_t* HRF_make_FSK_records_msg(uint8_t, uint8_t, uint8_t, uint32_t, const uint8_t*, uint8_t);
+void 	HRF_build_FSK_records_msg(uint8_t*, uint8_t, uint8_t, uint8_t, uint32_t, const uint8_t*, uint8_t);
+void 	HRF_send_FSK_msg(struct hrfRadio *, uint8_t*);
+void 	HRF_send_FSK_frame(struct hrfRadio *, const uint8_t*, struct timespec *);
 //void 	decryptMsg(uint8_t*, uint8_t);
 void 	encryptMsg(uint8_t, uint8_t*, uint8_t);
 void 	setupCrc(uint8_t*);
-void 	HRF_receive_FSK_msg(uint8_t, uint8_t, uint8_t, struct ReceivedMsgData *);
-void 	msgNextState(uint8_t, uint8_t, uint8_t, msg_t*, struct ReceivedMsgData *);
+int		HRF_open_irq(struct hrfRadio *);
+void	HRF_ack_irq(int);
+bool	HRF_read_FSK_frame(struct hrfRadio *, struct hrfFrame *);
+void	HRF_decode_FSK_frame(struct hrfRadio *, const struct hrfFrame *, 
+                             const struct otProduct *, int, struct ReceivedMsgData *);
+void 	HRF_receive_FSK_msg(struct hrfRadio *, const struct otProduct *, int, struct ReceivedMsgData *);
+void 	msgNextState(struct hrfRadio *, const struct otProduct *, int, msg_t*, struct ReceivedMsgData *);
 char* 	getIdName(uint8_t);
 char* 	getValString(uint64_t, uint8_t, uint8_t);
+bool	otRecordValue(const struct otRecord *, double *);
 
 
 
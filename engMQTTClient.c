@@ -23,6 +23,7 @@ SOFTWARE.
 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <bcm2835.h>
@@ -31,26 +32,43 @@ SOFTWARE.
 #include <unistd.h>
 #include <log4c.h>
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
 #include <sys/queue.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
 #include "engMQTTClient.h"
 #include "dev_HRF.h"
 #include "OpenThings.h"
 #include "decoder.h"
 #include "cJSON.h"
+#include "airtime.h"
+#include "journal.h"
+#include "config.h"
+#include "hrf_sim.h"
+#include "capture.h"
+#include "led.h"
+#include "timerwheel.h"
+#include "cbor.h"
+#include "format.h"
 
 /* MQTT Definitions */
 
-#define MQTT_TOPIC_BASE "energenie"
-
 /* eTRV Topics */
 #define MQTT_TOPIC_ETRV       "eTRV"
 #define MQTT_TOPIC_COMMAND    "Command"
 #define MQTT_TOPIC_REPORT     "Report"
+#define MQTT_TOPIC_RESULT     "Result"
 
-#define MQTT_TOPIC_ETRV_COMMAND "/" MQTT_TOPIC_BASE "/" MQTT_TOPIC_ETRV "/" MQTT_TOPIC_COMMAND
-#define MQTT_TOPIC_ETRV_REPORT  "/" MQTT_TOPIC_BASE "/" MQTT_TOPIC_ETRV "/" MQTT_TOPIC_REPORT
+#define MQTT_TOPIC_ETRV_COMMAND MQTT_TOPIC_ETRV "/" MQTT_TOPIC_COMMAND
+#define MQTT_TOPIC_ETRV_REPORT  MQTT_TOPIC_ETRV "/" MQTT_TOPIC_REPORT
+#define MQTT_TOPIC_ETRV_RESULT  MQTT_TOPIC_ETRV "/" MQTT_TOPIC_RESULT
 
 #define MQTT_TOPIC_BASE_INDEX 1
 #define MQTT_TOPIC_DEVICE_INDEX 2
@@ -66,6 +84,10 @@ SOFTWARE.
 #define MQTT_TOPIC_REPORTING_INTERVAL "ReportingInterval" /* OT_SET_REPORTING_INTERVAL */
 
 #define MQTT_TOPIC_TARGET_TEMPERATURE "TargetTemperature"
+#define MQTT_TOPIC_LINK_QUALITY "LinkQuality"
+#define MQTT_TOPIC_FRAME        "Frame"
+#define MQTT_TOPIC_AGGREGATE    "Aggregate"
+#define MQTT_TOPIC_BATCH        "Batch"
 
 #define MQTT_TOPIC_RCVD_TEMP_COMMAND MQTT_TOPIC_ETRV_COMMAND "/" MQTT_TOPIC_TEMPERATURE
 #define MQTT_TOPIC_SENT_TEMP_REPORT  MQTT_TOPIC_ETRV_REPORT "/" MQTT_TOPIC_TEMPERATURE
@@ -79,274 +101,3207 @@ SOFTWARE.
 
 #define MQTT_TOPIC_ETRV_COUNT (MQTT_TOPIC_SENSORID_INDEX + 1)
 
+/* Many eTRV commands in one JSON message, with the results of each in reply */
+#define MQTT_TOPIC_BULK         "Bulk"
+#define MQTT_TOPIC_SENT_BULK_REPLY MQTT_TOPIC_ETRV_REPORT "/" MQTT_TOPIC_BULK
+#define MQTT_TOPIC_BULK_COUNT (MQTT_TOPIC_TYPE_INDEX + 1)
+
+#define MAX_BULK_COMMANDS 64
+#define MAX_BULK_PAYLOAD 8192
+
 #define MQTT_TOPIC_MAX_SENSOR_LENGTH  8          // length of string of largest sensorId
                                                  // 16777215 (0xffffff)
 /* ENER002 Topics */
 #define MQTT_TOPIC_ENER002    "ENER002"
-#define MQTT_TOPIC_ENER002_COMMAND     "/" MQTT_TOPIC_BASE "/" MQTT_TOPIC_ENER002
+#define MQTT_TOPIC_ENER002_COMMAND     MQTT_TOPIC_ENER002
 
 #define MQTT_TOPIC_OOK_ADDRESS_INDEX 3
 #define MQTT_TOPIC_OOK_SOCKET_INDEX 4
 #define MQTT_TOPIC_ENER002_COUNT (MQTT_TOPIC_OOK_SOCKET_INDEX + 1)
 
-// host and port can be overriden at run time
-static char* mqttBrokerHost =  "localhost";  // TODO improve hacky configuration for other set ups
-static int   mqttBrokerPort = 1883;
-static char* mqttBrokerUser = "";
-static char* mqttBrokerPass = "";
-static const int keepalive = 60;
-static const bool clean_session = true;
+/* Group Topics, for the groups of devices in the configuration file */
+#define MQTT_TOPIC_GROUP      "group"
+
+#define MQTT_TOPIC_GROUP_NAME_INDEX 3
+#define MQTT_TOPIC_GROUP_DEVICE_INDEX 4
+#define MQTT_TOPIC_GROUP_TYPE_INDEX 5
+#define MQTT_TOPIC_GROUP_ENER002_COUNT (MQTT_TOPIC_GROUP_DEVICE_INDEX + 1)
+#define MQTT_TOPIC_GROUP_ETRV_COUNT (MQTT_TOPIC_GROUP_TYPE_INDEX + 1)
+
+/* Gateway Topics, shared by gateways covering the same eTRVs */
+#define MQTT_TOPIC_GATEWAY    "Gateway"
+#define MQTT_TOPIC_HEARD      "Heard"
+#define MQTT_TOPIC_GATEWAY_HEARD MQTT_TOPIC_GATEWAY "/" MQTT_TOPIC_HEARD
+#define MQTT_TOPIC_GATEWAY_RESULT MQTT_TOPIC_GATEWAY "/" MQTT_TOPIC_RESULT
+
+#define MQTT_TOPIC_GATEWAY_SENSORID_INDEX 4
+#define MQTT_TOPIC_GATEWAY_COUNT (MQTT_TOPIC_GATEWAY_SENSORID_INDEX + 1)
+
+/* Simulated eTRV reports, only subscribed to with simulated radios */
+#define MQTT_TOPIC_SIMULATE   "Simulate"
+#define MQTT_TOPIC_SIMULATE_ETRV MQTT_TOPIC_SIMULATE "/" MQTT_TOPIC_ETRV
 
-/* OpenThings definitions */
-static const uint8_t engManufacturerId = 0x04;   // Energenie Manufacturer Id
-static const uint8_t eTRVProductId = 0x3;        // Product ID for eTRV
-static const uint8_t encryptId = 0xf2;           // Encryption ID for eTRV
+#define MQTT_TOPIC_SIMULATE_SENSORID_INDEX 4
+#define MQTT_TOPIC_SIMULATE_COUNT (MQTT_TOPIC_SIMULATE_SENSORID_INDEX + 1)
+
+#define MQTT_MAX_JSON_PAYLOAD 256       // Longest Heard or Simulate message
+
+static const bool clean_session = true;
 
 static int err = 0;
 
-/* Options */
-static int repeat_send = 8;                     // The number of times to 
-                                                // send an ook message
+/* Options 
+ * Broker, OpenThings and sending settings are in struct config, set
+ * from the configuration file and then the command line.
+ */
+static char *config_path = NULL;                // Configuration file, NULL for none
+static char *journal_path = NULL;               // Journal of queued eTRV commands,
+                                                // NULL for none
+static bool simulate_radio = false;             // Use simulated radios, for running
+                                                // without the board
+static bool reactor_mode = false;               // Run everything from one epoll loop
+static char *capture_path = NULL;               // pcap file of frames, NULL for none
+
+/* The radio that receives eTRV reports, and the one that sends to ENER002
+ * sockets, which is the same board unless a second one is configured.
+ */
+static struct hrfRadio fskRadio = {
+    .name = "FSK",
+    .spi = &hrfBcm2835Ops,
+    .chipSelect = BCM2835_SPI_CS1,
+    .resetPin = RESET_PIN,
+    .receiveFSK = true
+};
+static struct hrfRadio ookRadio = {
+    .name = "OOK",
+    .spi = &hrfBcm2835Ops,
+    .receiveFSK = false
+};
+static struct hrfRadio *ookSender = &fskRadio;
+
+/* Command line options, kept so that they still take precedence over the
+ * configuration file when it is reloaded. */
+#define MAX_OPTIONS 32
+static struct {
+    int opt;
+    const char *arg;
+} options[MAX_OPTIONS];
+static int optionCount = 0;
 
 static pthread_mutex_t sensorListMutex;
 static TAILQ_HEAD(tailhead, entry) sensorListHead;
 
 struct tailhead  *headp;
 
+/* Commands are sent in priority order, a class at a time.  A command
+ * moves up a class for every PRIORITY_AGING_SECONDS it has waited, so
+ * lower priority commands are never held back indefinitely.
+ */
+enum commandPriority {
+    PRIORITY_INTERACTIVE,           // Identify, Temperature, ValveState
+    PRIORITY_MAINTENANCE,           // Exercise, Diagnostics, Voltage
+    PRIORITY_CONFIGURATION,         // PowerMode, ReportingInterval
+    PRIORITY_COUNT,
+    PRIORITY_DEFAULT = -1           // Use the class for the command
+};
+
+static const char *priorityNames[] = { "interactive", "maintenance", "configuration" };
+
+#define PRIORITY_AGING_SECONDS 900
+
+/* Per message settings, given as name=value topic levels after the sensorId */
+struct commandOptions {
+    enum commandPriority priority;
+    int ttl;                        // Seconds, 0 for the command's default
+};
+
+#define MAX_COMMAND_OPTIONS 2
+
+/* A command not finished with ttl seconds after it was queued expires,
+ * so commands for sensors that have gone quiet don't build up.  Each
+ * command's expiry is a timer on commandWheel, ticking in seconds of
+ * CLOCK_MONOTONIC, advanced every COMMAND_EXPIRY_CHECK_SECONDS.
+ */
+#define MAX_COMMAND_TTL 2592000         // 30 days, a literal so it can go in messages
+#define COMMAND_TTL_STRING(ttl) #ttl
+#define COMMAND_TTL_TEXT(ttl) COMMAND_TTL_STRING(ttl)
+#define COMMAND_EXPIRY_CHECK_SECONDS 1
+
+static struct timerWheel commandWheel;
+
+enum commandState {
+    COMMAND_PENDING,                // Waiting for the sensor to report
+    COMMAND_IN_FLIGHT               // Sent, waiting for the sensor to confirm it
+};
+
 struct entry {
     TAILQ_ENTRY(entry) entries;
     int sensorId;
     uint8_t command;
     uint32_t data;
+    enum commandState state;
+    int retries;
+    enum commandPriority priority;
+    struct timespec queuedTime;
+    uint32_t ttl;                   // Seconds from queuedTime it expires
+    struct wheelTimer expiry;
+};
+
+#define entryFromExpiry(timer) \
+    ((struct entry *)((char *)(timer) - offsetof(struct entry, expiry)))
+
+/* What finally happened to a command, published on the Result topic */
+enum commandOutcome {
+    OUTCOME_SENT,                   // No report confirms this command
+    OUTCOME_CONFIRMED,
+    OUTCOME_FAILED,                 // Not confirmed after retryLimit retries
+    OUTCOME_EXPIRED                 // Not finished with within its ttl
+};
+
+static const char *outcomeNames[] = { "Sent", "Confirmed", "Failed", "Expired" };
+
+/* The longest record encodeCommandRecord will produce */
+#define MAX_OT_RECORD_LEN 4
+/* The most commands that can be packed into one message */
+#define MAX_COMMANDS_PER_MSG (MAX_FSK_RECORDS_LEN / 2)
+
+/* How well a sensor is heard, over its last LINK_SAMPLES frames and
+ * since startup.  The report interval is learned from the gaps between
+ * temperature reports, so that longer gaps can be counted as missed reports.
+ */
+#define LINK_SAMPLES 32
+
+struct linkStats {
+    float rssi[LINK_SAMPLES];       // dBm, the latest frames
+    int rssiCount;
+    int rssiNext;
+    int32_t fei;                    // Hz, of the latest frame
+    unsigned long frames;           // Received with a good CRC
+    unsigned long crcFailures;
+    unsigned long missedReports;
+    double interval;                // Seconds between reports, 0 until learned
+    struct timespec lastReport;
+};
+
+/* With a gatewayId, each gateway publishes a Heard message whenever it
+ * receives from an eTRV, and the gateway hearing it best owns it: only
+ * the owner replies and publishes its reports.  The best of the other
+ * gateways hearing a sensor is kept here.  Ownership only changes when
+ * the signal is HANDOVER_MARGIN_DB better, or the owner hasn't heard the
+ * sensor for handoverSeconds.
+ */
+#define HANDOVER_MARGIN_DB 3.0f
+
+struct remoteGateway {
+    char gatewayId[CONFIG_STRING_LENGTH];   // "" for none
+    float rssi;                         // Its mean, dBm
+    bool owner;                         // It claims the sensor
+    struct timespec heardTime;          // When its Heard message arrived
+};
+
+/* Readings from each eTRV are summarised over the configured windows,
+ * each aligned to a multiple of its length, and published when the
+ * window ends.  A sample only updates running values, so a sensor's
+ * memory is fixed however often it reports.
+ */
+enum aggregateQuantity {
+    AGGREGATE_TEMPERATURE,
+    AGGREGATE_VOLTAGE,
+    AGGREGATE_POWER,
+    AGGREGATE_QUANTITIES
+};
+
+static const uint8_t aggregateParams[AGGREGATE_QUANTITIES] = { 
+    OT_TEMP_REPORT, OT_VOLTAGE, OT_POWER 
+};
+static const char *aggregateNames[AGGREGATE_QUANTITIES] = { "temperature", "voltage", "power" };
+
+/* Interval in seconds between checks for windows that have ended */
+#define AGGREGATE_SWEEP_SECONDS 10
+
+struct windowStats {
+    double min;
+    double max;
+    double sum;
+    double last;
+    unsigned count;                     // Samples, 0 if the others aren't set
+};
+
+struct aggregateWindow {
+    int seconds;                        // Length, 0 if not configured
+    time_t start;                       // Wall clock
+    struct windowStats stats[AGGREGATE_QUANTITIES];
+};
+
+/* Every eTRV that has reported or had a command queued keeps the
+ * encrypted reply for its next report ready to send, rebuilt whenever
+ * its commands change, so the radio can answer without delay.
+ */
+struct sensor {
+    TAILQ_ENTRY(sensor) sensors;
+    int sensorId;
+    uint8_t replyFrame[MAX_FIFO_SIZE];
+    struct entry *replyCommands[MAX_COMMANDS_PER_MSG];  // Commands carried in replyFrame
+    int replyCommandCount;
+    int replyLeftOut;               // Commands that didn't make it into replyFrame
+    uint8_t replyRecordsLen;
+    struct timespec stagedTime;
+    struct linkStats link;
+    struct remoteGateway remote;
+    bool owned;                     // This gateway answers the sensor
+    struct aggregateWindow aggregates[MAX_AGGREGATE_WINDOWS];
+};
+
+static TAILQ_HEAD(sensorhead, sensor) sensorTableHead;
+
+/* A decoded report, queued by the radio loop for the publisher thread */
+#define REPORT_TEMPERATURE        0x01
+#define REPORT_COMMANDS_SENT      0x02
+#define REPORT_DIAGNOSTICS        0x04
+#define REPORT_VOLTAGE            0x08
+#define REPORT_RESULTS            0x10
+#define REPORT_LINK_QUALITY       0x20
+#define REPORT_HEARD              0x40
+#define REPORT_FRAME              0x80
+#define REPORT_AGGREGATE          0x100
+#define REPORT_BATCH              0x200
+
+// Published in the batch instead of on their own topics, when batching
+#define REPORT_BATCHED  (REPORT_TEMPERATURE | REPORT_DIAGNOSTICS | REPORT_VOLTAGE \
+                         | REPORT_LINK_QUALITY | REPORT_FRAME)
+
+#define REPORT_VALUE_LENGTH 20          // Size of the getValString buffer
+
+struct sentCommand {
+    uint8_t command;
+    uint32_t data;
+};
+
+struct commandResult {
+    uint8_t command;
+    uint32_t data;
+    enum commandOutcome outcome;
+};
+
+struct report {
+    int sensorId;
+    struct timespec receivedTime;       // Wall clock
+    uint16_t flags;                     // REPORT_* values present
+    uint8_t batchedTopics;              // Publishes the batch entry replaces
+    uint8_t commandCount;               // Commands sent in reply
+    struct sentCommand commands[MAX_COMMANDS_PER_MSG];
+    uint8_t resultCount;                // Commands finished with
+    struct commandResult results[MAX_COMMANDS_PER_MSG];
+    char temperature[REPORT_VALUE_LENGTH];
+    uint8_t diagnosticData[2];
+    char voltage[REPORT_VALUE_LENGTH];
+    struct linkQuality link;
+    float heardRssi;                    // Mean dBm, for the Heard message
+    bool owned;
+    struct reportFrame frame;           // For the CBOR message
+    struct aggregateWindow aggregate;   // A window that has ended
+};
+
+#define REPORT_QUEUE_SIZE 64
+
+static struct {
+    struct report reports[REPORT_QUEUE_SIZE];
+    int head;                           // Next report to publish
+    int count;
+    int maxCount;                       // Deepest the queue has been
+    unsigned long queued;
+    unsigned long dropped;              // Reports lost because the queue was full
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+} reportQueue = { .mutex = PTHREAD_MUTEX_INITIALIZER, .notEmpty = PTHREAD_COND_INITIALIZER };
+
+/* With MQTT v5 each topic published at QoS 0 is given a topic alias, up to the
+ * most the broker allows, so that after the first publish only the alias
+ * is sent.  Aliases only last as long as the connection.
+ */
+#define TOPIC_ALIAS_TABLE_SIZE 512
+#define TOPIC_ALIAS_MAX 256             // Most used, whatever the broker allows
+
+#define MQTT_PROPERTY_RECEIVED "received"
+
+static struct {
+    struct {
+        uint16_t alias;                 // 0 for an unused slot
+        char topic[MQTT_TOPIC_MAX_LENGTH];
+    } slots[TOPIC_ALIAS_TABLE_SIZE];
+    uint16_t count;
+    uint16_t maximum;                   // Allowed on this connection
+    pthread_mutex_t mutex;
+} topicAliases = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/* PUBLISH packet bytes sent, against the same publishes as MQTT 3.1.1.
+ * Bulk command replies are published from the broker callback, so these
+ * can be counted from two threads.
+ */
+static struct {
+    unsigned long publishes;
+    unsigned long aliased;              // Sent with only a topic alias
+    unsigned long long bytes;
+    unsigned long long v311Bytes;
+    pthread_mutex_t mutex;
+} publishStats = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/* Frames are read from the radio by the main loop and decoded and
+ * answered by the decoder thread, so nothing the decoder does can hold
+ * up emptying the FIFO.  The ring has one writer and one reader, and
+ * each index is only advanced by its own side.
+ */
+#define FRAME_RING_SIZE 32                  // A power of two
+
+static struct {
+    struct hrfFrame frames[FRAME_RING_SIZE];
+    unsigned head;                          // Next to decode, advanced by the decoder
+    unsigned tail;                          // Next to fill, advanced by the reader
+    unsigned maxDepth;
+    unsigned long full;                     // Frames dropped because the ring was full
+    sem_t ready;                            // Counts the frames in the ring
+} frameRing;
+
+/* ENER002 bursts wait here for the radio loop, which sends them between
+ * eTRV reports when the 433MHz band has airtime to spare */
+struct ookRequest {
+    TAILQ_ENTRY(ookRequest) requests;
+    uint8_t address[OOK_MSG_ADDRESS_LENGTH];
+    int socketNum;
+    int onOff;
+    struct timespec queuedTime;
+    bool deferred;                      // Has had to wait for airtime
+    bool avoiding;                      // Has waited for an eTRV report
 };
 
+static pthread_mutex_t ookListMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ookListNotEmpty = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(ookhead, ookRequest) ookListHead;
+
+static struct {
+    unsigned long sent;
+    unsigned long deferred;             // Bursts that had to wait for airtime
+    unsigned long collisionsAvoided;    // Bursts held back for a predicted eTRV report, then sent clear of it
+    unsigned long collisionsSuffered;   // Bursts sent over one, having waited long enough
+    long long totalDelayUs;             // Queued to sent
+    long long maxDelayUs;
+} ookStats;
+
+static struct {
+    unsigned long heard;                // Heard messages from other gateways
+    unsigned long takeovers;            // Sensors this gateway became owner of
+    unsigned long handovers;            // Sensors another gateway became owner of
+    unsigned long reportsSuppressed;    // Frames from sensors owned elsewhere
+    unsigned long commandsDropped;      // Finished with by the owner
+} gatewayStats;
+
+/* A frame as one CBOR message, compared with the same frame as text
+ * topics, measured by the publisher.
+ */
+#define CBOR_FRAME_SIZE 320             // Enough for MAX_OT_RECORDS of any type
+
+static struct {
+    unsigned long frames;               // Published as CBOR
+    unsigned long overflows;            // Too big for CBOR_FRAME_SIZE
+    unsigned long long bytes[PUBLISH_COUNT];    // Topic and payload
+    long long textCpuNs;                // Formatting and publishing the text topics
+    long long cborCpuNs;
+} formatStats;
+
+/* With batching, the readings of each report are collected by the
+ * publisher, and published together when batchEntries have been
+ * collected or the oldest has waited batchMaxDelayMs.  A full batch is
+ * published before the next report is taken from the queue, so a burst
+ * backs up into the report queue rather than growing the batch.
+ */
+#define BATCH_POLL_MS 10                // Checks for a batch that has waited long enough
+
+static struct {
+    struct report reports[MAX_BATCH_ENTRIES];
+    struct timespec added[MAX_BATCH_ENTRIES];   // Monotonic
+    int count;
+} batch;
+
+static struct {
+    unsigned long batches;
+    unsigned long entries;
+    unsigned long full;                 // Published because batchEntries were waiting
+    unsigned long replaced;             // Publishes there would have been without batching
+    unsigned long overflows;            // Too big for CBOR
+    long long latencyUs;                // From being received to published, over all entries
+    long long maxLatencyUs;
+} batchStats;
+
+/* Interval in seconds between statistics being logged */
+#define STATISTICS_INTERVAL 3600
+
+/* Startup timing, to compare warm starts with cold ones */
+static struct timespec startTime;
+static bool warmStart = false;
+static bool brokerConnected = false;
+
+static struct {
+    unsigned long windows;              // Temperature reports replied to
+    unsigned long windowsWithCommands;  // Replies carrying at least one command
+    unsigned long commandsSent;
+    unsigned long recordBytesSent;
+    int maxCommandsPerWindow;
+    long long minTurnaroundUs;          // Report received to reply in the FIFO
+    long long maxTurnaroundUs;
+    long long totalTurnaroundUs;
+} replyStats;
+
+static struct {
+    unsigned long retries;
+    unsigned long outcomes[OUTCOME_EXPIRED + 1];
+    struct {
+        unsigned long sent;
+        long long totalWaitUs;      // Queued to first sent
+        long long maxWaitUs;
+    } priorities[PRIORITY_COUNT];
+} commandStats;
+
 enum fail_codes {
     ERROR_LOG4C_INIT=1,
     ERROR_MOSQ_NEW,
     ERROR_MOSQ_CONNECT,
     ERROR_MOSQ_LOOP_START,
     ERROR_ENER_INIT_FAIL,
-    ERROR_INVALID_PARAM
+    ERROR_INVALID_PARAM,
+    ERROR_PUBLISHER_START,
+    ERROR_JOURNAL_OPEN,
+    ERROR_CONFIG_START,
+    ERROR_RADIO_THREAD_START,
+    ERROR_REACTOR_START,
+    ERROR_CAPTURE_OPEN
 };
 
 
 static log4c_category_t* clientlog = NULL;
+log4c_category_t* configlog = NULL;
 static log4c_category_t* stacklog = NULL;
+log4c_category_t* journallog = NULL;
+log4c_category_t* capturelog = NULL;
 log4c_category_t* hrflog = NULL;
 
-/* Adds a command and data to the list of things to be sent
- * to an OpenThings type device
- * TODO:  Prioritize IDENTITY commands
- */
-void addCommandToSend(int deviceId, uint8_t command, uint32_t value) {
+/* Returns the number of microseconds from start to end, in 64 bits as
+ * commands can wait for days and time_t and long may be 32 */
+static int64_t elapsedMicroseconds(const struct timespec *start, const struct timespec *end) {
+    return (int64_t)(end->tv_sec - start->tv_sec) * 1000000LL 
+        + (end->tv_nsec - start->tv_nsec) / 1000;
+}
 
-    struct entry *newEntry;
-    struct entry *p;
+/* Records a change to a queued command in the journal, if there is one.
+ * The journal holds wall clock times, as monotonic ones don't survive
+ * a restart.
+ */
+static void journalCommand(enum journalOp op, const struct entry *command) {
 
+    struct journalEntry entry;
+    struct timespec now;
 
-    pthread_mutex_lock(&sensorListMutex);
-    /* Find an existing entry in the queue and replace that */
-    for (p = sensorListHead.tqh_first; p != NULL; p = p->entries.tqe_next) {
-        if (p->sensorId == deviceId && p->command == command) {
-            log4c_category_debug(clientlog, "Replacing existing command with %d:%x:%d",
-                                 deviceId, command, value);
-            p->data = value;
-            pthread_mutex_unlock(&sensorListMutex);
-            return;
-        }
+    if (journal_path == NULL) {
+        return;
     }
-    pthread_mutex_unlock(&sensorListMutex);
 
-    /* No equivalent found, so create a new entry */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    entry.sensorId = command->sensorId;
+    entry.command = command->command;
+    entry.state = command->state;
+    entry.priority = command->priority;
+    entry.retries = command->retries;
+    entry.data = command->data;
+    entry.queuedTime = time(NULL) - (now.tv_sec - command->queuedTime.tv_sec);
+    entry.ttl = command->ttl;
+    journalWrite(op, &entry);
+}
 
-    newEntry = malloc(sizeof(struct entry));
-    newEntry->sensorId = deviceId;
-    newEntry->command = command;
-    newEntry->data = value;
+/* Takes a finished command off the queue and frees it.  The caller must
+ * restage the sensor's reply.
+ * Must be called with sensorListMutex held.
+ */
+static void removeCommand(struct entry *command) {
 
-    log4c_category_debug(clientlog, "Adding command to send %d:%x:%d", deviceId, command, value);
-    pthread_mutex_lock(&sensorListMutex);
-    TAILQ_INSERT_TAIL(&sensorListHead, newEntry, entries);
-    pthread_mutex_unlock(&sensorListMutex);
+    TAILQ_REMOVE(&sensorListHead, command, entries);
+    journalCommand(JOURNAL_REMOVE, command);
+    wheelCancel(&command->expiry);
+    free(command);
 }
 
-struct entry * findCommandToSend(int deviceId) {
+/* Sets the command's expiry timer from its queuedTime and ttl.
+ * Must be called with sensorListMutex held.
+ */
+static void scheduleExpiry(struct entry *command) {
 
-    struct entry *p;
+    // Recovered commands can have been queued before the clock started
+    int64_t expires = (int64_t)command->queuedTime.tv_sec + command->ttl;
 
-    for (p = sensorListHead.tqh_first; p != NULL; p = p->entries.tqe_next) {
-        if (p->sensorId == deviceId) {
-            log4c_category_debug(clientlog, "Removing command to send %d:%x:%d", 
-                                 p->sensorId, p->command, p->data);
-            pthread_mutex_lock(&sensorListMutex);
-            TAILQ_REMOVE(&sensorListHead, p, entries);
-            pthread_mutex_unlock(&sensorListMutex);
-            return p;
-        }
-    }
-    // No commands
-    log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "No Commands to send");
-    return NULL;
+    wheelAdd(&commandWheel, &command->expiry, expires > 0 ? expires : 0);
 }
 
-/* Converts hex string in hex to equivalent bytes
- * in bytes.
- * No input checking performed.  hex is expected
- * to contain the exact number of characters 
- * intended for output.
+/* Encodes the OpenThings record for a queued command into record.
+ * Returns the number of bytes used, or 0 if the command is not understood.
  */
-void hexToBytes(uint8_t *bytes, char *hex) {
-
-    int hexlength = strlen(hex);
-    int bytelength = hexlength/2;
-    int i;
-
-    for (i = 0; i < hexlength; ++i) {
-        int high = hex[i*2];
-        int low = hex[(i*2) + 1];
-        high = (high & 0xf) + ((high & 0x40) >> 6) * 9;
-        low = (low & 0xf) + ((low & 0x40) >> 6) * 9;
+static uint8_t encodeCommandRecord(const struct entry *command, uint8_t *record) {
+
+    switch (command->command) {
+        case OT_IDENTIFY:
+        case OT_EXERCISE_VALVE:
+        case OT_REQUEST_VOLTAGE:
+        case OT_REQUEST_DIAGNOTICS:
+            record[0] = command->command;
+            record[1] = 0x00;
+            return 2;
+
+        case OT_TEMP_SET:
+            record[0] = OT_TEMP_SET;
+            record[1] = 0x92;
+            record[2] = command->data & 0xff;
+            record[3] = 0x00;
+            return 4;
+
+        case OT_SET_VALVE_STATE:
+        case OT_SET_LOW_POWER_MODE:
+            record[0] = command->command;
+            record[1] = 0x01;
+            record[2] = command->data & 0xff;
+            return 3;
+
+        case OT_SET_REPORTING_INTERVAL:
+            // Unsigned integer length 2, most significant byte first
+            record[0] = OT_SET_REPORTING_INTERVAL;
+            record[1] = 0x02;
+            record[2] = (command->data >> 8) & 0xff;
+            record[3] = command->data & 0xff;
+            return 4;
 
-        bytes[i] = (high << 4) | low;
+        default:
+            return 0;
     }
+}
 
-    if (log4c_category_is_trace_enabled(clientlog)) {
-        int HEX_LOG_BUF_SIZE =  bytelength * 8;
-        char logBuffer[HEX_LOG_BUF_SIZE];
-        
-        int logBufferUsedCount = 0;
+/* Returns the class a command is sent in unless told otherwise */
+static enum commandPriority defaultPriority(uint8_t command) {
 
-        for (i=0; i < bytelength; ++i) {
-            logBufferUsedCount += 
-                snprintf(&logBuffer[logBufferUsedCount],
-                         HEX_LOG_BUF_SIZE - logBufferUsedCount,
-                         "[%d]=%02x%c", i, bytes[i], i%8==7?'\n':'\t');
-        }
+    switch (command) {
+        case OT_IDENTIFY:
+        case OT_TEMP_SET:
+        case OT_SET_VALVE_STATE:
+            return PRIORITY_INTERACTIVE;
 
-        logBuffer[HEX_LOG_BUF_SIZE - 1] = '\0';
+        case OT_EXERCISE_VALVE:
+        case OT_REQUEST_DIAGNOTICS:
+        case OT_REQUEST_VOLTAGE:
+            return PRIORITY_MAINTENANCE;
 
-        log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, 
-                           "Converted %s to \n%s",
-                           hex,
-                           logBuffer);
+        default:
+            return PRIORITY_CONFIGURATION;
     }
 }
 
-/*
- * Creates a JSON object representing the data in the 
- * diagnostic data array
+/* Returns the seconds a command is kept for if the message doesn't say.
+ * A setting that is hours late is unlikely to still be wanted, while
+ * configuration changes can wait for a sensor that is out of reach.
  */
-cJSON * createDiagnosticDataJson(uint8_t *diagnosticData) {
-    static const uint8_t D0_MASK = 0x01;
-    static const uint8_t D1_MASK = 0x02;
-    static const uint8_t D2_MASK = 0x04;
-    static const uint8_t D3_MASK = 0x08;
-    static const uint8_t D4_MASK = 0x10;
-    static const uint8_t D5_MASK = 0x20;
-    static const uint8_t D6_MASK = 0x40;
-    static const uint8_t D7_MASK = 0x80;
+static int defaultTtl(uint8_t command) {
 
-    cJSON *root = cJSON_CreateObject();
-    if (root == NULL) return NULL;
-    cJSON_AddItemToObject(root, "Motor current below expectation", cJSON_CreateBool(*diagnosticData & D0_MASK));
-    cJSON_AddItemToObject(root, "Motor current always high", cJSON_CreateBool(*diagnosticData & D1_MASK));
-    cJSON_AddItemToObject(root, "Motor taking too long", cJSON_CreateBool(*diagnosticData & D2_MASK));
-    cJSON_AddItemToObject(root, "discrepancy between air and pipe sensors", cJSON_CreateBool(*diagnosticData & D3_MASK));
-    cJSON_AddItemToObject(root, "air sensor out of expected range", cJSON_CreateBool(*diagnosticData & D4_MASK));
-    cJSON_AddItemToObject(root, "pipe sensor out of expected range", cJSON_CreateBool(*diagnosticData & D5_MASK));
-    cJSON_AddItemToObject(root, "low power mode is enabled", cJSON_CreateBool(*diagnosticData & D6_MASK));
-    cJSON_AddItemToObject(root, "no target temperature has been set by host", cJSON_CreateBool(*diagnosticData & D7_MASK));
-    diagnosticData++;
+    switch (defaultPriority(command)) {
+        case PRIORITY_INTERACTIVE:
+            return 3600;
 
-    cJSON_AddItemToObject(root, "valve may be sticking", cJSON_CreateBool(*diagnosticData & D0_MASK));
-    cJSON_AddItemToObject(root, "valve exercise was successful", cJSON_CreateBool(*diagnosticData & D1_MASK));
-    cJSON_AddItemToObject(root, "valve exercise was unsuccessful", cJSON_CreateBool(*diagnosticData & D2_MASK));
-    cJSON_AddItemToObject(root, "driver micro has suffered a watchdog reset and needs data refresh", cJSON_CreateBool(*diagnosticData & D3_MASK));
-    cJSON_AddItemToObject(root, "driver micro has suffered a noise reset and needs data refresh", cJSON_CreateBool(*diagnosticData & D4_MASK));
-    cJSON_AddItemToObject(root, "battery voltage has fallen below 2p2V and valve has been opened", cJSON_CreateBool(*diagnosticData & D5_MASK));
-    cJSON_AddItemToObject(root, "request for heat messaging is enabled", cJSON_CreateBool(*diagnosticData & D6_MASK));
-    cJSON_AddItemToObject(root, "request for heat", cJSON_CreateBool(*diagnosticData & D7_MASK));
+        case PRIORITY_MAINTENANCE:
+            return 86400;
 
-    return root;
+        default:
+            return 7 * 86400;
+    }
 }
 
-void my_message_callback(struct mosquitto *mosq, void *userdata, 
-                         const struct mosquitto_message *message)
-{
-    char **topics;
-    int topic_count;
+/* Returns the priority class of the command once aged, lower first */
+static int effectivePriority(const struct entry *command, const struct timespec *now) {
+    return (int)command->priority 
+        - (int)((now->tv_sec - command->queuedTime.tv_sec) / PRIORITY_AGING_SECONDS);
+}
+
+/* Chooses the commands queued for the sensor to go in one OpenThings
+ * message, highest priority first, and prepares the encrypted reply
+ * carrying them.  With no commands queued the reply is a NIL message.
+ * Must be called with sensorListMutex held.
+ */
+static void stageReply(struct sensor *sensor) {
+
+    struct entry *p;
+    struct entry *next;
+    struct entry *candidates[MAX_COMMANDS_PER_MSG];
+    int candidatePriority[MAX_COMMANDS_PER_MSG];
+    int candidateCount = 0;
+    const struct config *config = configGet();
+    int maxCommands = (config->maxCommands > 0) ? config->maxCommands : MAX_COMMANDS_PER_MSG;
+    uint8_t records[MAX_FSK_RECORDS_LEN];
+    uint8_t record[MAX_OT_RECORD_LEN];
+    uint8_t length;
     int i;
+    int j;
 
-    log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "%s", __FUNCTION__);
+    clock_gettime(CLOCK_MONOTONIC, &sensor->stagedTime);
+    sensor->replyCommandCount = 0;
+    sensor->replyLeftOut = 0;
+    sensor->replyRecordsLen = 0;
 
-    if (mosquitto_sub_topic_tokenise(message->topic, &topics, &topic_count) 
-        != 
-        MOSQ_ERR_SUCCESS) {
-        log4c_category_error(clientlog, "Unable to tokenise topic");
-        return;
-    }
+    /* Sort the sensor's commands by priority, keeping queue order within
+     * a priority.  Replacement keeps it to one of each command type. */
+    for (p = sensorListHead.tqh_first; p != NULL; p = next) {
+        next = p->entries.tqe_next;
 
-    if (log4c_category_is_trace_enabled(clientlog)) {
-        for (i=0; i<topic_count; i++) {
-            log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE,
-                               "%d: %s", i, topics[i]);
+        if (p->sensorId != sensor->sensorId) {
+            continue;
         }
-    }
 
-    if (topic_count < 2) {
-        log4c_category_error(clientlog, "Invalid Topic count %d", topic_count);
-        mosquitto_sub_topic_tokens_free(&topics, topic_count);
-        return;
-    }
+        if (candidateCount == MAX_COMMANDS_PER_MSG) {
+            sensor->replyLeftOut++;
+            continue;
+        }
 
-    if (strcmp(MQTT_TOPIC_BASE, topics[MQTT_TOPIC_BASE_INDEX]) != 0) {
-        log4c_category_error(clientlog, "Received base topic %s", topics[MQTT_TOPIC_BASE_INDEX]);
-        mosquitto_sub_topic_tokens_free(&topics, topic_count);
-        return;
+        int priority = effectivePriority(p, &sensor->stagedTime);
+        for (i = candidateCount; i > 0 && candidatePriority[i - 1] > priority; --i) {
+            candidates[i] = candidates[i - 1];
+            candidatePriority[i] = candidatePriority[i - 1];
+        }
+        candidates[i] = p;
+        candidatePriority[i] = priority;
+        candidateCount++;
     }
 
-    if (strcmp(MQTT_TOPIC_ENER002, topics[MQTT_TOPIC_DEVICE_INDEX]) == 0) {
-        // Message for plug in socket type ENER002
+    for (j = 0; j < candidateCount; ++j) {
+        p = candidates[j];
 
-        if (topic_count != MQTT_TOPIC_ENER002_COUNT) {
-            log4c_category_error(clientlog, "Invalid topic count(%d) for %s", 
-                                 topic_count,
-                                 MQTT_TOPIC_ENER002);
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
-            return;
+        length = encodeCommandRecord(p, record);
+
+        if (length == 0) {
+            log4c_category_warn(clientlog, "Don't understand command to send %x", p->command);
+            removeCommand(p);
+            continue;
         }
 
-#define MAX_OOK_ADDRESS_TOPIC_LENGTH (OOK_MSG_ADDRESS_LENGTH * 2)
-#define MAX_OOK_SOCKET_TOPIC_LENGTH  1
+        if (sensor->replyCommandCount == maxCommands
+            || sensor->replyRecordsLen + length > MAX_FSK_RECORDS_LEN) {
+            // Leave it for the next report, but a smaller one may still fit
+            sensor->replyLeftOut++;
+            continue;
+        }
 
-        char address[MAX_OOK_ADDRESS_TOPIC_LENGTH + 1];
-        char device[MAX_OOK_SOCKET_TOPIC_LENGTH + 1];
+        memcpy(&records[sensor->replyRecordsLen], record, length);
+        sensor->replyRecordsLen += length;
+        sensor->replyCommands[sensor->replyCommandCount++] = p;
+    }
 
-        strncpy(address, topics[MQTT_TOPIC_OOK_ADDRESS_INDEX], MAX_OOK_ADDRESS_TOPIC_LENGTH);
-        address[MAX_OOK_ADDRESS_TOPIC_LENGTH] = '\0';
-        strncpy(device, topics[MQTT_TOPIC_OOK_SOCKET_INDEX], MAX_OOK_SOCKET_TOPIC_LENGTH);
-        device[MAX_OOK_SOCKET_TOPIC_LENGTH] = '\0';
+    HRF_build_FSK_records_msg(sensor->replyFrame, config->manufacturerId, config->eTRVEncryptId,
+                              config->eTRVProductId, sensor->sensorId, 
+                              records, sensor->replyRecordsLen);
+}
 
-        log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "Freeing tokens");
+/* Finds the entry for sensorId in the sensor table, or NULL if it 
+ * hasn't been seen.
+ * Must be called with sensorListMutex held.
+ */
+static struct sensor * lookupSensor(int sensorId) {
 
-        mosquitto_sub_topic_tokens_free(&topics, topic_count);
+    struct sensor *sensor;
 
-        log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "Tokens Freed");
+    for (sensor = sensorTableHead.tqh_first; sensor != NULL; sensor = sensor->sensors.tqe_next) {
+        if (sensor->sensorId == sensorId) {
+            return sensor;
+        }
+    }
+    return NULL;
+}
 
+/* Finds the entry for sensorId in the sensor table, adding it if
+ * this is the first time it has been seen.  Returns NULL if there is
+ * no memory to add it.
+ * Must be called with sensorListMutex held.
+ */
+static struct sensor * findSensor(int sensorId) {
 
-        if(message->payloadlen == 0) {
-            log4c_category_error(clientlog, "No Payload for %s", 
-                                 MQTT_TOPIC_ENER002);
-            return;
-        }
+    struct sensor *sensor = lookupSensor(sensorId);
 
-        int onOff;
-        int socketNum;
+    if (sensor != NULL) {
+        return sensor;
+    }
 
-        if (strcasecmp("On", message->payload) == 0) {
-            onOff = 1;
-        } else if (strcasecmp("Off", message->payload) == 0) {
-            onOff = 0;
+    log4c_category_debug(clientlog, "Adding sensorId %d to sensor table", sensorId);
+    sensor = calloc(1, sizeof(struct sensor));
+    if (sensor == NULL) {
+        log4c_category_error(clientlog, "No memory to add sensorId %d to sensor table", sensorId);
+        return NULL;
+    }
+    sensor->sensorId = sensorId;
+    stageReply(sensor);
+    TAILQ_INSERT_TAIL(&sensorTableHead, sensor, sensors);
+    return sensor;
+}
+
+/* Restages the reply for sensorId, adding it to the sensor table if
+ * need be.  Its commands stay queued if it can't be added.
+ * Must be called with sensorListMutex held.
+ */
+static void stageSensorReply(int sensorId) {
+
+    struct sensor *sensor = findSensor(sensorId);
+
+    if (sensor != NULL) {
+        stageReply(sensor);
+    }
+}
+
+/* Returns the mean RSSI of the latest frames from a sensor, in dBm */
+static float meanRssi(const struct linkStats *link) {
+
+    float total = 0;
+    int i;
+
+    if (link->rssiCount == 0) {
+        return -127.5f;                 // The weakest signal the radio reports
+    }
+    for (i = 0; i < link->rssiCount; ++i) {
+        total += link->rssi[i];
+    }
+    return total / link->rssiCount;
+}
+
+/* Adds the RSSI and FEI of a frame to the link statistics of the sensor
+ * that sent it.  A frame that failed its CRC only counts against a sensor
+ * already in the table, as its sensorId may be corrupt too.  For a
+ * temperature report the statistics are copied into report, to be 
+ * published if configured.
+ */
+static void recordLinkQuality(const struct ReceivedMsgData *msgData, struct report *report) {
+
+    struct sensor *sensor;
+    struct linkStats *link;
+    int i;
+
+    pthread_mutex_lock(&sensorListMutex);
+    if (msgData->crcFailed) {
+        sensor = lookupSensor(msgData->sensorId);
+        if (sensor != NULL) {
+            sensor->link.crcFailures++;
+        }
+        pthread_mutex_unlock(&sensorListMutex);
+        return;
+    }
+
+    sensor = findSensor(msgData->sensorId);
+    if (sensor == NULL) {
+        pthread_mutex_unlock(&sensorListMutex);
+        return;
+    }
+    link = &sensor->link;
+    link->frames++;
+    link->fei = msgData->fei;
+    link->rssi[link->rssiNext] = msgData->rssi;
+    link->rssiNext = (link->rssiNext + 1) % LINK_SAMPLES;
+    if (link->rssiCount < LINK_SAMPLES) {
+        link->rssiCount++;
+    }
+
+    if (msgData->receivedTempReport) {
+        if (link->lastReport.tv_sec != 0) {
+            double gap = (double)(msgData->receivedTime.tv_sec - link->lastReport.tv_sec)
+                + (msgData->receivedTime.tv_nsec - link->lastReport.tv_nsec) / 1e9;
+
+            if (link->interval == 0) {
+                link->interval = gap;
+            } else if (gap < link->interval * 1.5) {
+                link->interval += (gap - link->interval) / 8;
+            } else {
+                link->missedReports += (unsigned long)(gap / link->interval + 0.5) - 1;
+            }
+        }
+        link->lastReport = msgData->receivedTime;
+
+        if (configGet()->linkQuality) {
+            report->flags |= REPORT_LINK_QUALITY;
+            report->link.rssi = msgData->rssi;
+            report->link.fei = link->fei;
+            report->link.frames = link->frames;
+            report->link.crcFailures = link->crcFailures;
+            report->link.missedReports = link->missedReports;
+            report->link.interval = link->interval;
+            report->link.minRssi = 0;
+            report->link.meanRssi = meanRssi(link);
+            for (i = 0; i < link->rssiCount; ++i) {
+                if (i == 0 || link->rssi[i] < report->link.minRssi) {
+                    report->link.minRssi = link->rssi[i];
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Decides whether this gateway owns the sensor that sent msgData, from
+ * how well it hears the sensor against the best other gateway, and adds
+ * the Heard message to report.  Without a gatewayId every sensor is owned.
+ */
+static bool claimSensor(const struct ReceivedMsgData *msgData, struct report *report,
+                        const struct config *config) {
+
+    struct sensor *sensor;
+    struct remoteGateway *remote;
+    bool silent;
+    bool owned;
+    float rssi;
+
+    if (config->gatewayId[0] == '\0') {
+        return true;
+    }
+
+    pthread_mutex_lock(&sensorListMutex);
+    sensor = findSensor(msgData->sensorId);
+    if (sensor == NULL) {
+        // Answered as if there were no other gateways
+        pthread_mutex_unlock(&sensorListMutex);
+        return true;
+    }
+    remote = &sensor->remote;
+    rssi = meanRssi(&sensor->link);
+    silent = remote->gatewayId[0] == '\0'
+        || msgData->receivedTime.tv_sec - remote->heardTime.tv_sec >= config->handoverSeconds;
+
+    if (silent || rssi > remote->rssi + HANDOVER_MARGIN_DB) {
+        owned = true;
+    } else if (rssi < remote->rssi - HANDOVER_MARGIN_DB) {
+        owned = false;
+    } else if (sensor->owned != remote->owner) {
+        owned = sensor->owned;          // Too close to call, the owner keeps it
+    } else {
+        owned = strcmp(config->gatewayId, remote->gatewayId) < 0;
+    }
+
+    if (owned != sensor->owned) {
+        if (owned) {
+            gatewayStats.takeovers++;
+        } else {
+            gatewayStats.handovers++;
+        }
+        if (remote->gatewayId[0] == '\0') {
+            log4c_category_notice(clientlog, "Taking over sensorId %d at %.1fdBm, "
+                                  "no other gateway hears it", msgData->sensorId, rssi);
+        } else {
+            log4c_category_notice(clientlog, "%s sensorId %d at %.1fdBm, %s %s at %.1fdBm",
+                                  owned ? "Taking over" : "Handing over", 
+                                  msgData->sensorId, rssi, silent ? "silent" : "against",
+                                  remote->gatewayId, remote->rssi);
+        }
+        sensor->owned = owned;
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+
+    report->flags |= REPORT_HEARD;
+    report->heardRssi = rssi;
+    report->owned = owned;
+    return owned;
+}
+
+/* Records a Heard message from another gateway, such as
+ * {"gateway": "hall", "rssi": -71.5, "owner": true}.  It replaces the
+ * other gateway known for the sensor if it is the same one, claims the
+ * sensor, hears it better, or the known one has gone silent.  Arrival
+ * times are used rather than the time in the message, so the gateways'
+ * clocks needn't agree.
+ */
+static void recordHeard(int sensorId, const char *payload, int payloadLen) {
+
+    const struct config *config = configGet();
+    char json[MQTT_MAX_JSON_PAYLOAD + 1];
+    cJSON *root;
+    cJSON *gateway;
+    cJSON *rssi;
+    cJSON *owner;
+    struct sensor *sensor;
+    struct remoteGateway *remote;
+    struct timespec now;
+    bool claims;
+
+    if (payloadLen > MQTT_MAX_JSON_PAYLOAD) {
+        log4c_category_error(clientlog, "Heard message for sensorId %d too long", sensorId);
+        return;
+    }
+    memcpy(json, payload, payloadLen);
+    json[payloadLen] = '\0';
+    root = cJSON_Parse(json);
+    if (root == NULL || root->type != cJSON_Object) {
+        log4c_category_error(clientlog, "Heard message for sensorId %d is not a JSON object",
+                             sensorId);
+        cJSON_Delete(root);
+        return;
+    }
+
+    gateway = cJSON_GetObjectItem(root, "gateway");
+    rssi = cJSON_GetObjectItem(root, "rssi");
+    owner = cJSON_GetObjectItem(root, "owner");
+    if (gateway == NULL || gateway->type != cJSON_String 
+        || strlen(gateway->valuestring) >= CONFIG_STRING_LENGTH
+        || rssi == NULL || rssi->type != cJSON_Number
+        || owner == NULL || (owner->type != cJSON_True && owner->type != cJSON_False)) {
+        log4c_category_error(clientlog, "Heard message for sensorId %d needs gateway, "
+                             "rssi and owner", sensorId);
+        cJSON_Delete(root);
+        return;
+    }
+
+    if (strcmp(gateway->valuestring, config->gatewayId) == 0) {
+        // Our own
+        cJSON_Delete(root);
+        return;
+    }
+
+    claims = (owner->type == cJSON_True);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&sensorListMutex);
+    gatewayStats.heard++;
+    sensor = findSensor(sensorId);
+    if (sensor == NULL) {
+        pthread_mutex_unlock(&sensorListMutex);
+        cJSON_Delete(root);
+        return;
+    }
+    remote = &sensor->remote;
+    if (remote->gatewayId[0] == '\0'
+        || now.tv_sec - remote->heardTime.tv_sec >= config->handoverSeconds
+        || strcmp(remote->gatewayId, gateway->valuestring) == 0
+        || (claims && !remote->owner)
+        || (claims == remote->owner && rssi->valuedouble > remote->rssi)) {
+
+        strcpy(remote->gatewayId, gateway->valuestring);
+        remote->rssi = rssi->valuedouble;
+        remote->owner = claims;
+        remote->heardTime = now;
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+    cJSON_Delete(root);
+}
+
+/* Adds a command to the queue, or replaces the one already queued for 
+ * the same sensor and command.  The caller must restage the sensor's reply.
+ * Must be called with sensorListMutex held.
+ */
+static void queueCommand(int deviceId, uint8_t command, uint32_t value,
+                         enum commandPriority priority, int ttl) {
+
+    struct entry *newEntry;
+    struct entry *p;
+    struct timespec now;
+
+    if (ttl == 0) {
+        ttl = defaultTtl(command);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* Find an existing entry in the queue and replace that */
+    for (p = sensorListHead.tqh_first; p != NULL; p = p->entries.tqe_next) {
+        if (p->sensorId == deviceId && p->command == command) {
+            log4c_category_debug(clientlog, "Replacing existing command with %d:%x:%d",
+                                 deviceId, command, value);
+            // Keeps its place, and the time it has waited, in the queue
+            p->data = value;
+            p->state = COMMAND_PENDING;
+            p->retries = 0;
+            if (priority != PRIORITY_DEFAULT) {
+                p->priority = priority;
+            }
+            // But expires ttl from now
+            p->ttl = now.tv_sec - p->queuedTime.tv_sec + ttl;
+            scheduleExpiry(p);
+            journalCommand(JOURNAL_REPLACE, p);
+            return;
+        }
+    }
+
+    /* No equivalent found, so create a new entry */
+
+    newEntry = malloc(sizeof(struct entry));
+    newEntry->sensorId = deviceId;
+    newEntry->command = command;
+    newEntry->data = value;
+    newEntry->state = COMMAND_PENDING;
+    newEntry->retries = 0;
+    newEntry->priority = (priority == PRIORITY_DEFAULT) ? defaultPriority(command) : priority;
+    newEntry->queuedTime = now;
+    newEntry->ttl = ttl;
+    newEntry->expiry.slot = NULL;
+    scheduleExpiry(newEntry);
+
+    log4c_category_debug(clientlog, "Adding %s command to send %d:%x:%d", 
+                         priorityNames[newEntry->priority], deviceId, command, value);
+    TAILQ_INSERT_TAIL(&sensorListHead, newEntry, entries);
+    journalCommand(JOURNAL_ADD, newEntry);
+}
+
+/* Adds a command and data to the list of things to be sent
+ * to an OpenThings type device.  options may be NULL for the defaults.
+ */
+void addCommandToSend(int deviceId, uint8_t command, uint32_t value,
+                      const struct commandOptions *options) {
+
+    pthread_mutex_lock(&sensorListMutex);
+    queueCommand(deviceId, command, value, options ? options->priority : PRIORITY_DEFAULT,
+                 options ? options->ttl : 0);
+    stageSensorReply(deviceId);
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Puts a command recovered from the journal back in the queue.
+ * Called from journalOpen at startup, before anything else is queued.
+ */
+static void recoverCommand(const struct journalEntry *recovered) {
+
+    struct entry *newEntry;
+    struct timespec now;
+    time_t waited = time(NULL) - recovered->queuedTime;
+
+    if (recovered->priority >= PRIORITY_COUNT) {
+        log4c_category_warn(clientlog, "Ignoring journal command %d:%x with priority %d",
+                            recovered->sensorId, recovered->command, recovered->priority);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    newEntry = malloc(sizeof(struct entry));
+    newEntry->sensorId = recovered->sensorId;
+    newEntry->command = recovered->command;
+    newEntry->data = recovered->data;
+    newEntry->state = recovered->state;
+    newEntry->retries = recovered->retries;
+    newEntry->priority = recovered->priority;
+    newEntry->queuedTime.tv_sec = now.tv_sec - ((waited > 0) ? waited : 0);
+    newEntry->queuedTime.tv_nsec = now.tv_nsec;
+    newEntry->ttl = recovered->ttl ? recovered->ttl : defaultTtl(recovered->command);
+    newEntry->expiry.slot = NULL;
+
+    log4c_category_debug(clientlog, "Recovered %s command to send %d:%x:%d", 
+                         priorityNames[newEntry->priority], newEntry->sensorId, 
+                         newEntry->command, newEntry->data);
+
+    pthread_mutex_lock(&sensorListMutex);
+    TAILQ_INSERT_TAIL(&sensorListHead, newEntry, entries);
+    scheduleExpiry(newEntry);           // Expires on the first check if already due
+    stageSensorReply(newEntry->sensorId);
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Returns true if there will be a report from the sensor confirming
+ * that it acted on the command.
+ */
+static bool needsConfirmation(uint8_t command) {
+
+    switch (command) {
+        case OT_TEMP_SET:
+        case OT_EXERCISE_VALVE:
+        case OT_REQUEST_DIAGNOTICS:
+        case OT_REQUEST_VOLTAGE:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/* Returns true if the received message shows the command was acted on */
+static bool isConfirmedBy(const struct entry *command, const struct ReceivedMsgData *msgData) {
+
+    switch (command->command) {
+        case OT_TEMP_SET:
+            return msgData->receivedTargetTemperature
+                && msgData->targetTemperature == command->data;
+
+        case OT_EXERCISE_VALVE:
+        case OT_REQUEST_DIAGNOTICS:
+            // Exercising the valve finishes with a diagnostics report
+            return msgData->receivedDiagnostics;
+
+        case OT_REQUEST_VOLTAGE:
+            return msgData->receivedVoltage;
+
+        default:
+            return false;
+    }
+}
+
+/* Adds the outcome of a command to the report to be published */
+static void addResult(struct report *report, const struct entry *command,
+                      enum commandOutcome outcome) {
+
+    commandStats.outcomes[outcome]++;
+
+    if (report->resultCount < MAX_COMMANDS_PER_MSG) {
+        report->results[report->resultCount].command = command->command;
+        report->results[report->resultCount].data = command->data;
+        report->results[report->resultCount].outcome = outcome;
+        report->resultCount++;
+        report->flags |= REPORT_RESULTS;
+    }
+}
+
+/* Checks the commands in flight to the sensor that sent msgData against
+ * what it reported.  Confirmed commands are finished with.  If this is
+ * a new report window, commands that have used up their retries have
+ * failed, and the rest stay in the reply to be sent again.
+ */
+void confirmCommands(const struct ReceivedMsgData *msgData, struct report *report) {
+
+    struct entry *p;
+    struct entry *next;
+    bool changed = false;
+    int retryLimit = configGet()->retryLimit;
+
+    pthread_mutex_lock(&sensorListMutex);
+    for (p = sensorListHead.tqh_first; p != NULL; p = next) {
+        next = p->entries.tqe_next;
+
+        if (p->sensorId != msgData->sensorId || p->state != COMMAND_IN_FLIGHT) {
+            continue;
+        }
+
+        if (isConfirmedBy(p, msgData)) {
+            log4c_category_debug(clientlog, "Confirmed command %d:%x:%d", 
+                                 p->sensorId, p->command, p->data);
+            addResult(report, p, OUTCOME_CONFIRMED);
+        } else if (msgData->receivedTempReport && p->retries >= retryLimit) {
+            log4c_category_warn(clientlog, "No confirmation of command %d:%x:%d after %d retries", 
+                                p->sensorId, p->command, p->data, p->retries);
+            addResult(report, p, OUTCOME_FAILED);
+        } else {
+            continue;
+        }
+
+        removeCommand(p);
+        changed = true;
+    }
+
+    if (changed) {
+        stageSensorReply(msgData->sensorId);
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Copies the prepared reply for deviceId into frame and records the
+ * commands it carries in the report.  Commands that will be confirmed
+ * by a later report stay queued, in flight, until they are; the rest
+ * are finished with once sent.
+ * Returns the number of commands in the reply, or -1 if there is none
+ * as the sensor couldn't be added to the table.
+ */
+int takeReplyToSend(int deviceId, uint8_t *frame, struct report *report,
+                    uint8_t *recordsLen) {
+
+    struct sensor *sensor;
+    struct entry *p;
+    struct timespec now;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&sensorListMutex);
+    sensor = findSensor(deviceId);
+    if (sensor == NULL) {
+        pthread_mutex_unlock(&sensorListMutex);
+        return -1;
+    }
+
+    if (sensor->replyLeftOut > 0 
+        && now.tv_sec - sensor->stagedTime.tv_sec >= PRIORITY_AGING_SECONDS) {
+        // Commands left out may have aged enough to go first
+        stageReply(sensor);
+    }
+
+    memcpy(frame, sensor->replyFrame, sensor->replyFrame[MSG_REMAINING_LEN+1] + 2);
+    *recordsLen = sensor->replyRecordsLen;
+
+    for (i = 0; i < sensor->replyCommandCount; ++i) {
+        p = sensor->replyCommands[i];
+        report->commands[i].command = p->command;
+        report->commands[i].data = p->data;
+
+        if (p->state == COMMAND_PENDING) {
+            int64_t waitUs = elapsedMicroseconds(&p->queuedTime, &now);
+
+            commandStats.priorities[p->priority].sent++;
+            commandStats.priorities[p->priority].totalWaitUs += waitUs;
+            if (waitUs > commandStats.priorities[p->priority].maxWaitUs) {
+                commandStats.priorities[p->priority].maxWaitUs = waitUs;
+            }
+        }
+
+        if (!needsConfirmation(p->command)) {
+            log4c_category_debug(clientlog, "Removing command to send %d:%x:%d", 
+                                 p->sensorId, p->command, p->data);
+            addResult(report, p, OUTCOME_SENT);
+            removeCommand(p);
+        } else if (p->state == COMMAND_IN_FLIGHT) {
+            log4c_category_debug(clientlog, "Retrying command %d:%x:%d", 
+                                 p->sensorId, p->command, p->data);
+            p->retries++;
+            commandStats.retries++;
+            journalCommand(JOURNAL_SEND, p);
+        } else {
+            p->state = COMMAND_IN_FLIGHT;
+            journalCommand(JOURNAL_SEND, p);
+        }
+    }
+    sensor->replyCommandCount = 0;
+    pthread_mutex_unlock(&sensorListMutex);
+
+    report->commandCount = i;
+    if (i == 0) {
+        log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "No Commands to send");
+    } else {
+        report->flags |= REPORT_COMMANDS_SENT;
+    }
+    return i;
+}
+
+/* Prepares the next reply for deviceId once the last one has been sent,
+ * so that it doesn't reuse the same encryption pip.
+ */
+void restageReply(int deviceId) {
+
+    pthread_mutex_lock(&sensorListMutex);
+    stageSensorReply(deviceId);
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Converts a 20 bit ENER002 address into the bytes sent for it, each
+ * pair of bits being sent as a nibble.
+ */
+static void ookAddressBytes(uint32_t addressNumber, uint8_t *addressBytes) {
+
+    int i;
+
+    for (i = OOK_MSG_ADDRESS_LENGTH - 1; i>=0; --i) {
+        int lownibble = (addressNumber & 0x01) ? 0x0E : 0x08;
+        int highnibble = (addressNumber & 0x02) ? 0xE0 : 0x80;
+        addressBytes[i] = highnibble | lownibble;
+        addressNumber = addressNumber >> 2;
+    }
+}
+
+/* Makes a request for an ENER002 burst, not yet queued */
+static struct ookRequest *newOOKRequest(const uint8_t *address, int socketNum, int onOff) {
+
+    struct ookRequest *request = malloc(sizeof(struct ookRequest));
+
+    memcpy(request->address, address, OOK_MSG_ADDRESS_LENGTH);
+    request->socketNum = socketNum;
+    request->onOff = onOff;
+    request->deferred = false;
+    request->avoiding = false;
+    clock_gettime(CLOCK_MONOTONIC, &request->queuedTime);
+    return request;
+}
+
+/* Queues an ENER002 burst for the radio loop to send */
+void addOOKToSend(const uint8_t *address, int socketNum, int onOff) {
+
+    struct ookRequest *request = newOOKRequest(address, socketNum, onOff);
+
+    pthread_mutex_lock(&ookListMutex);
+    TAILQ_INSERT_TAIL(&ookListHead, request, requests);
+    pthread_cond_signal(&ookListNotEmpty);
+    pthread_mutex_unlock(&ookListMutex);
+}
+
+/* Queues the ENER002 bursts for a group together */
+static void addGroupOOKToSend(const struct group *group, int onOff) {
+
+    struct ookRequest *requests[MAX_GROUP_BURSTS];
+    uint8_t addressBytes[OOK_MSG_ADDRESS_LENGTH];
+    int i;
+
+    for (i = 0; i < group->burstCount; ++i) {
+        ookAddressBytes(group->bursts[i].address, addressBytes);
+        requests[i] = newOOKRequest(addressBytes, group->bursts[i].socketNum, onOff);
+    }
+
+    pthread_mutex_lock(&ookListMutex);
+    for (i = 0; i < group->burstCount; ++i) {
+        TAILQ_INSERT_TAIL(&ookListHead, requests[i], requests);
+    }
+    pthread_cond_signal(&ookListNotEmpty);
+    pthread_mutex_unlock(&ookListMutex);
+}
+
+/* Returns the sensorId of an eTRV predicted to report while a burst of 
+ * burstUs sent now is on the air, or 0 if there is none.  Reports are
+ * predicted from the last one received and the interval learned for 
+ * each sensor, and are allowed REPORT_GUARD_US either side.
+ */
+#define REPORT_GUARD_US 300000L
+#define REPORT_PREDICTION_PERIODS 8     // Sensors silent for longer are ignored
+
+static int predictedReport(const struct timespec *now, long burstUs) {
+
+    struct sensor *sensor;
+    int sensorId = 0;
+
+    pthread_mutex_lock(&sensorListMutex);
+    for (sensor = sensorTableHead.tqh_first; sensor != NULL; sensor = sensor->sensors.tqe_next) {
+        const struct linkStats *link = &sensor->link;
+        long long intervalUs = link->interval * 1000000;
+        long long sinceUs;
+        long long phaseUs;
+
+        if (link->interval == 0 || link->lastReport.tv_sec == 0) {
+            continue;
+        }
+        sinceUs = elapsedMicroseconds(&link->lastReport, now);
+        if (sinceUs > intervalUs * REPORT_PREDICTION_PERIODS) {
+            continue;
+        }
+
+        phaseUs = sinceUs % intervalUs;
+        if (intervalUs - phaseUs < burstUs + REPORT_GUARD_US 
+            || (sinceUs > intervalUs / 2 && phaseUs < REPORT_GUARD_US)) {
+            // Due during the burst, or due just now and not yet received
+            sensorId = sensor->sensorId;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+    return sensorId;
+}
+
+static struct timespec nextOOKTime;            // When the gap after the last burst ends
+
+/* Takes the next queued ENER002 burst to send on radio if the gap after 
+ * the last one has passed and the band has the airtime, or returns NULL.
+ * When the radio also receives eTRV reports, the burst is held back, for
+ * up to ookMaxDelayMs after it was queued, while an eTRV is predicted to
+ * report.  Only called from the loop of the radio sending OOK, which is
+ * the only remover from the queue.
+ */
+static struct ookRequest *takeQueuedOOK(struct hrfRadio *radio) {
+
+    struct ookRequest *request;
+    struct timespec now;
+    int sensorId = 0;
+    int repeatSend = configGet()->repeatSend;
+    int maxDelayMs = configGet()->ookMaxDelayMs;
+
+    // Compared directly, as nextOOKTime is zero until the first burst
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec < nextOOKTime.tv_sec 
+        || (now.tv_sec == nextOOKTime.tv_sec && now.tv_nsec < nextOOKTime.tv_nsec)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ookListMutex);
+    request = ookListHead.tqh_first;
+    pthread_mutex_unlock(&ookListMutex);
+
+    if (request == NULL) {
+        return NULL;
+    }
+
+    if (radio->receiveFSK 
+        && (sensorId = predictedReport(&now, HRF_OOK_AIRTIME_US(repeatSend))) != 0) {
+        if (elapsedMicroseconds(&request->queuedTime, &now) < maxDelayMs * 1000L) {
+            if (!request->avoiding) {
+                log4c_category_debug(clientlog, "Holding socket %d burst for report from sensorId %d",
+                                     request->socketNum, sensorId);
+                request->avoiding = true;
+            }
+            return NULL;
+        }
+    }
+
+    if (!airtimeRequest(BAND_OOK_433, HRF_OOK_AIRTIME_US(repeatSend), true)) {
+        if (!request->deferred) {
+            log4c_category_info(clientlog, "Deferring socket %d burst, no 433MHz airtime left",
+                                request->socketNum);
+            request->deferred = true;
+            ookStats.deferred++;
+        }
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ookListMutex);
+    TAILQ_REMOVE(&ookListHead, request, requests);
+    pthread_mutex_unlock(&ookListMutex);
+
+    if (sensorId != 0) {
+        log4c_category_info(clientlog, "Sending socket %d burst over report from sensorId %d",
+                            request->socketNum, sensorId);
+        ookStats.collisionsSuffered++;
+    } else if (request->avoiding) {
+        ookStats.collisionsAvoided++;
+    }
+    return request;
+}
+
+/* Records a burst taken by takeQueuedOOK as sent, starting the gap 
+ * before the next one, and frees it */
+static void finishOOK(struct ookRequest *request) {
+
+    int64_t delayUs;
+    int repeatSend = configGet()->repeatSend;
+
+    clock_gettime(CLOCK_MONOTONIC, &nextOOKTime);
+    delayUs = elapsedMicroseconds(&request->queuedTime, &nextOOKTime);
+    ookStats.sent++;
+    ookStats.totalDelayUs += delayUs;
+    if (delayUs > ookStats.maxDelayUs) {
+        ookStats.maxDelayUs = delayUs;
+    }
+
+    nextOOKTime.tv_nsec += HRF_OOK_GAP_US(repeatSend) * 1000L;
+    nextOOKTime.tv_sec += nextOOKTime.tv_nsec / 1000000000L;
+    nextOOKTime.tv_nsec %= 1000000000L;
+
+    free(request);
+}
+
+/* Sends the next queued ENER002 burst on radio, if it can be sent yet */
+static void sendQueuedOOK(struct hrfRadio *radio) {
+
+    struct ookRequest *request = takeQueuedOOK(radio);
+
+    if (request != NULL) {
+        HRF_send_OOK_msg(radio, request->address, request->socketNum, request->onOff,
+                         configGet()->repeatSend);
+        finishOOK(request);
+    }
+}
+
+/* Loop for a radio that only sends OOK, so the FSK radio never stops
+ * listening to send ENER002 commands.
+ */
+static void *ookRadioThread(void *arg) {
+
+    struct hrfRadio *radio = arg;
+
+    while (1) {
+        pthread_mutex_lock(&ookListMutex);
+        while (ookListHead.tqh_first == NULL) {
+            pthread_cond_wait(&ookListNotEmpty, &ookListMutex);
+        }
+        pthread_mutex_unlock(&ookListMutex);
+
+        sendQueuedOOK(radio);
+        usleep(5000);
+    }
+    return NULL;
+}
+
+/* Records how well, and how quickly, a reply used the report window */
+static void recordReplyStatistics(int commandCount, uint8_t recordsLen, int64_t turnaroundUs) {
+
+    if (replyStats.windows == 0 || turnaroundUs < replyStats.minTurnaroundUs) {
+        replyStats.minTurnaroundUs = turnaroundUs;
+    }
+    if (turnaroundUs > replyStats.maxTurnaroundUs) {
+        replyStats.maxTurnaroundUs = turnaroundUs;
+    }
+    replyStats.totalTurnaroundUs += turnaroundUs;
+
+    replyStats.windows++;
+
+    if (commandCount > 0) {
+        replyStats.windowsWithCommands++;
+        replyStats.commandsSent += commandCount;
+        replyStats.recordBytesSent += recordsLen;
+        if (commandCount > replyStats.maxCommandsPerWindow) {
+            replyStats.maxCommandsPerWindow = commandCount;
+        }
+    }
+}
+
+/* Logs the gateway statistics gathered since startup */
+static void logStatistics(void) {
+
+    enum airtimeBand band;
+    int priority;
+
+    log4c_category_notice(clientlog, 
+                          "Reply windows=%lu with commands=%lu commands sent=%lu "
+                          "max per window=%d",
+                          replyStats.windows, replyStats.windowsWithCommands,
+                          replyStats.commandsSent, replyStats.maxCommandsPerWindow);
+
+    if (replyStats.windowsWithCommands > 0) {
+        log4c_category_notice(clientlog, 
+                              "Commands per window=%.2f frame fill=%.1f%% of %d record bytes",
+                              (double)replyStats.commandsSent / replyStats.windowsWithCommands,
+                              100.0 * replyStats.recordBytesSent 
+                              / (replyStats.windowsWithCommands * MAX_FSK_RECORDS_LEN),
+                              MAX_FSK_RECORDS_LEN);
+    }
+
+    if (replyStats.windows > 0) {
+        log4c_category_notice(clientlog, 
+                              "Receive to transmit turnaround min=%lldus mean=%lldus max=%lldus",
+                              replyStats.minTurnaroundUs,
+                              replyStats.totalTurnaroundUs / replyStats.windows,
+                              replyStats.maxTurnaroundUs);
+    }
+
+    log4c_category_notice(clientlog, 
+                          "Commands sent=%lu confirmed=%lu failed=%lu expired=%lu retries=%lu",
+                          commandStats.outcomes[OUTCOME_SENT],
+                          commandStats.outcomes[OUTCOME_CONFIRMED],
+                          commandStats.outcomes[OUTCOME_FAILED],
+                          commandStats.outcomes[OUTCOME_EXPIRED],
+                          commandStats.retries);
+
+    for (priority = 0; priority < PRIORITY_COUNT; ++priority) {
+        if (commandStats.priorities[priority].sent > 0) {
+            log4c_category_notice(clientlog, 
+                                  "%s commands sent=%lu wait mean=%llds max=%llds",
+                                  priorityNames[priority],
+                                  commandStats.priorities[priority].sent,
+                                  commandStats.priorities[priority].totalWaitUs 
+                                  / commandStats.priorities[priority].sent / 1000000,
+                                  commandStats.priorities[priority].maxWaitUs / 1000000);
+        }
+    }
+
+    if (ookStats.sent > 0) {
+        log4c_category_notice(clientlog, 
+                              "OOK bursts sent=%lu deferred=%lu delay mean=%lldus max=%lldus "
+                              "eTRV collisions avoided=%lu suffered=%lu",
+                              ookStats.sent, ookStats.deferred,
+                              ookStats.totalDelayUs / ookStats.sent, ookStats.maxDelayUs,
+                              ookStats.collisionsAvoided, ookStats.collisionsSuffered);
+    }
+
+    for (band = 0; band < BAND_COUNT; ++band) {
+        struct airtimeStatistics airtime;
+
+        airtimeGetStatistics(band, &airtime);
+        if (band == 0) {
+            log4c_category_notice(clientlog, 
+                                  "433MHz sub-band airtime last hour=%lldms of %lldms (%.2f%%)",
+                                  (long long)airtime.subBandUsedUs / 1000,
+                                  (long long)airtime.windowBudgetUs / 1000,
+                                  100.0 * airtime.subBandUsedUs / (AIRTIME_WINDOW_SECONDS * 1000000LL));
+        }
+        log4c_category_notice(clientlog, 
+                              "%s airtime last hour=%lldms "
+                              "transmissions=%lu refused=%lu over budget=%lu",
+                              airtimeBandName(band),
+                              (long long)airtime.windowUsedUs / 1000,
+                              airtime.transmissions, airtime.refusals, airtime.overBudget);
+    }
+
+    if (journal_path != NULL) {
+        struct journalStatistics journal;
+
+        journalGetStatistics(&journal);
+        log4c_category_notice(clientlog, 
+                              "Journal records=%lu commits=%lu compactions=%lu "
+                              "used=%u of %u recovered=%lu in %ldus",
+                              journal.records, journal.commits, journal.compactions,
+                              journal.used, journal.capacity,
+                              journal.recovered, journal.recoveryUs);
+    }
+
+    {
+        struct rusage usage;
+
+        getrusage(RUSAGE_SELF, &usage);
+        log4c_category_notice(clientlog, 
+                              "%s mode CPU user=%ld.%03lds system=%ld.%03lds "
+                              "context switches voluntary=%ld involuntary=%ld",
+                              reactor_mode ? "Reactor" : "Threaded",
+                              (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec / 1000,
+                              (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec / 1000,
+                              usage.ru_nvcsw, usage.ru_nivcsw);
+    }
+
+    log4c_category_notice(clientlog, 
+                          "Frame ring max=%u of %d full=%lu FIFO overruns=%lu duplicates dropped=%lu",
+                          frameRing.maxDepth, FRAME_RING_SIZE, frameRing.full,
+                          fskRadio.fifoOverruns, fskRadio.duplicates);
+
+    if (publishStats.publishes > 0) {
+        log4c_category_notice(clientlog, 
+                              "MQTT %s publishes=%lu aliased=%lu bytes=%llu "
+                              "(%llu as 3.1.1, %.1f%%)",
+                              configGet()->mqtt5 ? "v5" : "3.1.1",
+                              publishStats.publishes, publishStats.aliased,
+                              publishStats.bytes, publishStats.v311Bytes,
+                              100.0 * publishStats.bytes / publishStats.v311Bytes);
+    }
+
+    if (configGet()->gatewayId[0] != '\0') {
+        log4c_category_notice(clientlog, 
+                              "Gateway %s heard from others=%lu takeovers=%lu handovers=%lu "
+                              "reports left to owner=%lu commands finished by owner=%lu",
+                              configGet()->gatewayId, gatewayStats.heard,
+                              gatewayStats.takeovers, gatewayStats.handovers,
+                              gatewayStats.reportsSuppressed, gatewayStats.commandsDropped);
+    }
+
+    if (formatStats.frames > 0) {
+        unsigned long long textBytes = formatStats.bytes[PUBLISH_TEMPERATURE]
+            + formatStats.bytes[PUBLISH_DIAGNOSTICS] + formatStats.bytes[PUBLISH_VOLTAGE]
+            + formatStats.bytes[PUBLISH_LINK_QUALITY];
+
+        log4c_category_notice(clientlog, 
+                              "CBOR frames=%lu too big=%lu bytes=%llu cpu=%lldus, "
+                              "text reports bytes=%llu cpu=%lldus (CBOR %.1f%% of bytes)",
+                              formatStats.frames, formatStats.overflows,
+                              formatStats.bytes[PUBLISH_FRAME], formatStats.cborCpuNs / 1000,
+                              textBytes, formatStats.textCpuNs / 1000,
+                              textBytes ? 100.0 * formatStats.bytes[PUBLISH_FRAME] / textBytes : 0);
+    }
+
+    if (batchStats.batches > 0) {
+        struct timespec now;
+        double seconds;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = now.tv_sec - startTime.tv_sec;
+        log4c_category_notice(clientlog, 
+                              "Batches=%lu reports=%lu full=%lu too big=%lu publishes saved=%lu "
+                              "(%.2f/s) latency mean=%.1fms max=%.1fms",
+                              batchStats.batches, batchStats.entries, batchStats.full,
+                              batchStats.overflows, batchStats.replaced - batchStats.batches,
+                              (batchStats.replaced - batchStats.batches) / seconds,
+                              batchStats.latencyUs / 1000.0 / batchStats.entries,
+                              batchStats.maxLatencyUs / 1000.0);
+    }
+
+    if (capture_path != NULL) {
+        struct captureStatistics capture;
+
+        captureGetStatistics(&capture);
+        log4c_category_notice(clientlog, "Captured frames=%lu dropped=%lu rotations=%lu",
+                              capture.frames, capture.dropped, capture.rotations);
+    }
+
+    pthread_mutex_lock(&reportQueue.mutex);
+    log4c_category_notice(clientlog, 
+                          "Report queue depth=%d max=%d of %d queued=%lu dropped=%lu",
+                          reportQueue.count, reportQueue.maxCount, REPORT_QUEUE_SIZE,
+                          reportQueue.queued, reportQueue.dropped);
+    pthread_mutex_unlock(&reportQueue.mutex);
+}
+
+/* Converts hex string in hex to equivalent bytes
+ * in bytes.
+ * No input checking performed.  hex is expected
+ * to contain the exact number of characters 
+ * intended for output.
+ */
+void hexToBytes(uint8_t *bytes, char *hex) {
+
+    int hexlength = strlen(hex);
+    int bytelength = hexlength/2;
+    int i;
+
+    for (i = 0; i < hexlength; ++i) {
+        int high = hex[i*2];
+        int low = hex[(i*2) + 1];
+        high = (high & 0xf) + ((high & 0x40) >> 6) * 9;
+        low = (low & 0xf) + ((low & 0x40) >> 6) * 9;
+
+        bytes[i] = (high << 4) | low;
+    }
+
+    if (log4c_category_is_trace_enabled(clientlog)) {
+        int HEX_LOG_BUF_SIZE =  bytelength * 8;
+        char logBuffer[HEX_LOG_BUF_SIZE];
+        
+        int logBufferUsedCount = 0;
+
+        for (i=0; i < bytelength; ++i) {
+            logBufferUsedCount += 
+                snprintf(&logBuffer[logBufferUsedCount],
+                         HEX_LOG_BUF_SIZE - logBufferUsedCount,
+                         "[%d]=%02x%c", i, bytes[i], i%8==7?'\n':'\t');
+        }
+
+        logBuffer[HEX_LOG_BUF_SIZE - 1] = '\0';
+
+        log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, 
+                           "Converted %s to \n%s",
+                           hex,
+                           logBuffer);
+    }
+}
+
+/*
+ * Creates a JSON object representing the data in the 
+ * diagnostic data array
+ */
+cJSON * createDiagnosticDataJson(uint8_t *diagnosticData) {
+    static const uint8_t D0_MASK = 0x01;
+    static const uint8_t D1_MASK = 0x02;
+    static const uint8_t D2_MASK = 0x04;
+    static const uint8_t D3_MASK = 0x08;
+    static const uint8_t D4_MASK = 0x10;
+    static const uint8_t D5_MASK = 0x20;
+    static const uint8_t D6_MASK = 0x40;
+    static const uint8_t D7_MASK = 0x80;
+
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) return NULL;
+    cJSON_AddItemToObject(root, "Motor current below expectation", cJSON_CreateBool(*diagnosticData & D0_MASK));
+    cJSON_AddItemToObject(root, "Motor current always high", cJSON_CreateBool(*diagnosticData & D1_MASK));
+    cJSON_AddItemToObject(root, "Motor taking too long", cJSON_CreateBool(*diagnosticData & D2_MASK));
+    cJSON_AddItemToObject(root, "discrepancy between air and pipe sensors", cJSON_CreateBool(*diagnosticData & D3_MASK));
+    cJSON_AddItemToObject(root, "air sensor out of expected range", cJSON_CreateBool(*diagnosticData & D4_MASK));
+    cJSON_AddItemToObject(root, "pipe sensor out of expected range", cJSON_CreateBool(*diagnosticData & D5_MASK));
+    cJSON_AddItemToObject(root, "low power mode is enabled", cJSON_CreateBool(*diagnosticData & D6_MASK));
+    cJSON_AddItemToObject(root, "no target temperature has been set by host", cJSON_CreateBool(*diagnosticData & D7_MASK));
+    diagnosticData++;
+
+    cJSON_AddItemToObject(root, "valve may be sticking", cJSON_CreateBool(*diagnosticData & D0_MASK));
+    cJSON_AddItemToObject(root, "valve exercise was successful", cJSON_CreateBool(*diagnosticData & D1_MASK));
+    cJSON_AddItemToObject(root, "valve exercise was unsuccessful", cJSON_CreateBool(*diagnosticData & D2_MASK));
+    cJSON_AddItemToObject(root, "driver micro has suffered a watchdog reset and needs data refresh", cJSON_CreateBool(*diagnosticData & D3_MASK));
+    cJSON_AddItemToObject(root, "driver micro has suffered a noise reset and needs data refresh", cJSON_CreateBool(*diagnosticData & D4_MASK));
+    cJSON_AddItemToObject(root, "battery voltage has fallen below 2p2V and valve has been opened", cJSON_CreateBool(*diagnosticData & D5_MASK));
+    cJSON_AddItemToObject(root, "request for heat messaging is enabled", cJSON_CreateBool(*diagnosticData & D6_MASK));
+    cJSON_AddItemToObject(root, "request for heat", cJSON_CreateBool(*diagnosticData & D7_MASK));
+
+    return root;
+}
+
+/* Passes a report to the publisher thread.  The radio loop must never
+ * wait for the broker, so if the queue is full the report is dropped.
+ */
+static void queueReport(const struct report *report) {
+
+    pthread_mutex_lock(&reportQueue.mutex);
+    if (reportQueue.count == REPORT_QUEUE_SIZE) {
+        reportQueue.dropped++;
+        pthread_mutex_unlock(&reportQueue.mutex);
+        log4c_category_warn(clientlog, "Report queue full, dropping report for sensorId %d",
+                            report->sensorId);
+        return;
+    }
+
+    reportQueue.reports[(reportQueue.head + reportQueue.count) % REPORT_QUEUE_SIZE] = *report;
+    reportQueue.count++;
+    reportQueue.queued++;
+    if (reportQueue.count > reportQueue.maxCount) {
+        reportQueue.maxCount = reportQueue.count;
+    }
+    pthread_cond_signal(&reportQueue.notEmpty);
+    pthread_mutex_unlock(&reportQueue.mutex);
+}
+
+/* Returns true if any commands are queued for sensorId.
+ * Must be called with sensorListMutex held.
+ */
+static bool hasCommands(int sensorId) {
+
+    struct entry *p;
+
+    for (p = sensorListHead.tqh_first; p != NULL; p = p->entries.tqe_next) {
+        if (p->sensorId == sensorId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Finishes with a command whose ttl has passed, publishing that it
+ * expired unless another gateway owns the sensor and will publish it.
+ * A sensor only in the table for its commands, never having been heard
+ * by any gateway, is removed with its last one.
+ * Must be called with sensorListMutex held.
+ */
+static void commandExpired(struct wheelTimer *timer, void *arg) {
+
+    struct entry *command = entryFromExpiry(timer);
+    struct sensor *sensor = lookupSensor(command->sensorId);
+    struct report report;
+
+    log4c_category_warn(clientlog, "Command %d:%x:%d expired after %us", 
+                        command->sensorId, command->command, command->data, command->ttl);
+
+    memset(&report, 0, sizeof(report));
+    clock_gettime(CLOCK_REALTIME, &report.receivedTime);
+    report.sensorId = command->sensorId;
+    addResult(&report, command, OUTCOME_EXPIRED);
+    if (sensor == NULL || !sensor->remote.owner) {
+        queueReport(&report);
+    }
+
+    removeCommand(command);
+    if (sensor == NULL) {
+        return;
+    }
+    if (sensor->link.frames == 0 && sensor->link.crcFailures == 0 
+        && sensor->remote.gatewayId[0] == '\0' && !hasCommands(sensor->sensorId)) {
+        log4c_category_debug(clientlog, "Removing unheard sensorId %d from sensor table", 
+                             sensor->sensorId);
+        TAILQ_REMOVE(&sensorTableHead, sensor, sensors);
+        free(sensor);
+    } else {
+        stageReply(sensor);
+    }
+}
+
+/* Expires the commands whose ttl has passed */
+static void expireCommands(void) {
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&sensorListMutex);
+    wheelAdvance(&commandWheel, now.tv_sec, commandExpired, NULL);
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Queues the window for publishing, if it had any samples, and starts
+ * it again at start.
+ * Must be called with sensorListMutex held.
+ */
+static void closeWindow(int sensorId, struct aggregateWindow *window, time_t start) {
+
+    struct report report;
+    int i;
+
+    for (i = 0; i < AGGREGATE_QUANTITIES; ++i) {
+        if (window->stats[i].count > 0) {
+            break;
+        }
+    }
+
+    if (i < AGGREGATE_QUANTITIES) {
+        memset(&report, 0, sizeof(report));
+        clock_gettime(CLOCK_REALTIME, &report.receivedTime);
+        report.sensorId = sensorId;
+        report.flags = REPORT_AGGREGATE;
+        report.aggregate = *window;
+        queueReport(&report);
+    }
+
+    memset(window->stats, 0, sizeof(window->stats));
+    window->start = start;
+}
+
+/* Moves each of a sensor's windows on to the one holding now, closing
+ * those that have ended.  A window whose length has been reconfigured
+ * starts again, losing what it held.
+ * Must be called with sensorListMutex held.
+ */
+static void advanceWindows(struct sensor *sensor, const struct config *config, time_t now) {
+
+    int i;
+
+    for (i = 0; i < MAX_AGGREGATE_WINDOWS; ++i) {
+        struct aggregateWindow *window = &sensor->aggregates[i];
+        int seconds = i < config->aggregateWindowCount ? config->aggregateWindows[i] : 0;
+        time_t start = seconds > 0 ? now - now % seconds : 0;
+
+        if (window->seconds != seconds) {
+            memset(window, 0, sizeof(*window));
+            window->seconds = seconds;
+            window->start = start;
+        } else if (start != window->start) {
+            closeWindow(sensor->sensorId, window, start);
+        }
+    }
+}
+
+static void addSample(struct windowStats *stats, double value) {
+
+    if (stats->count == 0 || value < stats->min) {
+        stats->min = value;
+    }
+    if (stats->count == 0 || value > stats->max) {
+        stats->max = value;
+    }
+    stats->sum += value;
+    stats->last = value;
+    stats->count++;
+}
+
+/* Adds the temperature, voltage and power records of a frame to the
+ * sensor's windows
+ */
+static void aggregateRecords(const struct ReceivedMsgData *msgData, const struct config *config,
+                             time_t now) {
+
+    struct sensor *sensor;
+    double value;
+    int i;
+    int quantity;
+    int window;
+
+    if (config->aggregateWindowCount == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&sensorListMutex);
+    sensor = lookupSensor(msgData->sensorId);
+    if (sensor != NULL) {
+        advanceWindows(sensor, config, now);
+
+        for (i = 0; i < msgData->recordCount; ++i) {
+            const struct otRecord *record = &msgData->records[i];
+
+            for (quantity = 0; quantity < AGGREGATE_QUANTITIES; ++quantity) {
+                if (record->paramId == aggregateParams[quantity] 
+                    && otRecordValue(record, &value)) {
+                    for (window = 0; window < config->aggregateWindowCount; ++window) {
+                        addSample(&sensor->aggregates[window].stats[quantity], value);
+                    }
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Closes the windows that have ended without a sample to close them */
+static void sweepAggregates(void) {
+
+    const struct config *config = configGet();
+    time_t now = time(NULL);
+    struct sensor *sensor;
+
+    pthread_mutex_lock(&sensorListMutex);
+    for (sensor = sensorTableHead.tqh_first; sensor != NULL; sensor = sensor->sensors.tqe_next) {
+        advanceWindows(sensor, config, now);
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Returns the command topic name for an OpenThings command */
+static const char *commandTopicName(uint8_t command) {
+
+    switch (command) {
+        case OT_TEMP_SET:
+            return MQTT_TOPIC_TEMPERATURE;
+        case OT_IDENTIFY:
+            return MQTT_TOPIC_IDENTIFY;
+        case OT_EXERCISE_VALVE:
+            return MQTT_TOPIC_EXERCISE_VALVE;
+        case OT_REQUEST_VOLTAGE:
+            return MQTT_TOPIC_VOLTAGE;
+        case OT_REQUEST_DIAGNOTICS:
+            return MQTT_TOPIC_DIAGNOSTICS;
+        case OT_SET_VALVE_STATE:
+            return MQTT_TOPIC_VALVE_STATE;
+        case OT_SET_LOW_POWER_MODE:
+            return MQTT_TOPIC_POWER_MODE;
+        case OT_SET_REPORTING_INTERVAL:
+            return MQTT_TOPIC_REPORTING_INTERVAL;
+        default:
+            return "Unknown";
+    }
+}
+
+/* Finds the OpenThings command for a command topic name.
+ * Returns false if there is none.
+ */
+static bool commandFromTopicName(const char *name, uint8_t *command) {
+
+    static const uint8_t commands[] = {
+        OT_TEMP_SET, OT_IDENTIFY, OT_EXERCISE_VALVE, OT_REQUEST_VOLTAGE,
+        OT_REQUEST_DIAGNOTICS, OT_SET_VALVE_STATE, OT_SET_LOW_POWER_MODE,
+        OT_SET_REPORTING_INTERVAL
+    };
+    unsigned i;
+
+    for (i = 0; i < sizeof(commands); ++i) {
+        if (strcmp(commandTopicName(commands[i]), name) == 0) {
+            *command = commands[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns true if an eTRV command is sent with a value */
+static bool commandTakesValue(uint8_t command) {
+
+    switch (command) {
+        case OT_TEMP_SET:
+        case OT_SET_VALVE_STATE:
+        case OT_SET_LOW_POWER_MODE:
+        case OT_SET_REPORTING_INTERVAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Checks the value for an eTRV command, the same whichever topic it came
+ * in on.  Returns NULL if it is valid, or why not.
+ */
+static const char *checkCommandValue(uint8_t command, uint32_t value) {
+
+    switch (command) {
+        case OT_TEMP_SET:
+            if (value < 4 || value > 30) {
+                return "Temperature must be between 4 and 30";
+            }
+            break;
+        case OT_SET_VALVE_STATE:
+            if (value > 2) {
+                return "Valve state must be between 0 and 2";
+            }
+            break;
+        case OT_SET_LOW_POWER_MODE:
+            if (value > 1) {
+                return "Power mode must be 0 or 1";
+            }
+            break;
+        case OT_SET_REPORTING_INTERVAL:
+            if (value < 300 || value > 3600) {
+                return "Reporting interval must be between 300 and 3600";
+            }
+            break;
+    }
+    return NULL;
+}
+
+/* Drops the queued command, with the same value, that the gateway owning
+ * sensorId has published a Result for, as every gateway queues every
+ * command but only the owner sends it.  Only confirmed, failed or expired
+ * commands are dropped.  The Results this gateway publishes itself arrive
+ * here too, and are ignored.
+ */
+static void dropRemoteCommand(int sensorId, const char *payload, int payloadLen) {
+
+    const struct config *config = configGet();
+    char json[MQTT_MAX_JSON_PAYLOAD + 1];
+    cJSON *root;
+    cJSON *gateway;
+    cJSON *commandName;
+    cJSON *value;
+    cJSON *result;
+    struct sensor *sensor;
+    struct entry *p;
+    uint8_t command;
+
+    if (payloadLen > MQTT_MAX_JSON_PAYLOAD) {
+        log4c_category_error(clientlog, "Result message for sensorId %d too long", sensorId);
+        return;
+    }
+    memcpy(json, payload, payloadLen);
+    json[payloadLen] = '\0';
+    root = cJSON_Parse(json);
+    if (root == NULL || root->type != cJSON_Object) {
+        log4c_category_error(clientlog, "Result message for sensorId %d is not a JSON object",
+                             sensorId);
+        cJSON_Delete(root);
+        return;
+    }
+
+    gateway = cJSON_GetObjectItem(root, "gateway");
+    commandName = cJSON_GetObjectItem(root, "command");
+    value = cJSON_GetObjectItem(root, "value");
+    result = cJSON_GetObjectItem(root, "result");
+    if (gateway == NULL || gateway->type != cJSON_String
+        || commandName == NULL || commandName->type != cJSON_String
+        || value == NULL || value->type != cJSON_Number
+        || result == NULL || result->type != cJSON_String
+        || !commandFromTopicName(commandName->valuestring, &command)) {
+        log4c_category_error(clientlog, "Result message for sensorId %d needs gateway, "
+                             "command, value and result", sensorId);
+        cJSON_Delete(root);
+        return;
+    }
+
+    // Commands only sent, or published by this gateway, stay queued
+    if (strcmp(gateway->valuestring, config->gatewayId) == 0
+        || (strcmp(result->valuestring, outcomeNames[OUTCOME_CONFIRMED]) != 0
+            && strcmp(result->valuestring, outcomeNames[OUTCOME_FAILED]) != 0
+            && strcmp(result->valuestring, outcomeNames[OUTCOME_EXPIRED]) != 0)) {
+        cJSON_Delete(root);
+        return;
+    }
+
+    pthread_mutex_lock(&sensorListMutex);
+    sensor = lookupSensor(sensorId);
+    if (sensor != NULL && !sensor->owned) {
+        for (p = sensorListHead.tqh_first; p != NULL; p = p->entries.tqe_next) {
+            if (p->sensorId == sensorId && p->command == command 
+                && p->data == (uint32_t)value->valuedouble) {
+                log4c_category_debug(clientlog, "Command %d:%x:%d %s by %s", 
+                                     p->sensorId, p->command, p->data, 
+                                     result->valuestring, gateway->valuestring);
+                removeCommand(p);
+                gatewayStats.commandsDropped++;
+                stageReply(sensor);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+    cJSON_Delete(root);
+}
+
+/* Bytes taken by value as an MQTT variable byte integer */
+static size_t varIntSize(size_t value) {
+
+    return value < 128 ? 1 : value < 16384 ? 2 : value < 2097152 ? 3 : 4;
+}
+
+/* Size of an MQTT packet with remainingLen bytes after its fixed header */
+static size_t packetSize(size_t remainingLen) {
+
+    return 1 + varIntSize(remainingLen) + remainingLen;
+}
+
+static void countPublish(size_t bytes, size_t v311Bytes, bool aliased) {
+
+    pthread_mutex_lock(&publishStats.mutex);
+    publishStats.publishes++;
+    publishStats.bytes += bytes;
+    publishStats.v311Bytes += v311Bytes;
+    if (aliased) {
+        publishStats.aliased++;
+    }
+    pthread_mutex_unlock(&publishStats.mutex);
+}
+
+/* Returns the topic alias for topic, or 0 if the broker won't take any
+ * more.  known is set if the broker already has the alias, so the topic
+ * needn't be sent.  Must be called with topicAliases.mutex held.
+ */
+static uint16_t topicAlias(const char *topic, bool *known) {
+
+    uint32_t hash = 2166136261u;
+    const char *p;
+    unsigned slot;
+
+    for (p = topic; *p != '\0'; ++p) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+
+    for (slot = hash % TOPIC_ALIAS_TABLE_SIZE; 
+         topicAliases.slots[slot].alias != 0; 
+         slot = (slot + 1) % TOPIC_ALIAS_TABLE_SIZE) {
+        if (strcmp(topicAliases.slots[slot].topic, topic) == 0) {
+            *known = true;
+            return topicAliases.slots[slot].alias;
+        }
+    }
+
+    if (topicAliases.count >= topicAliases.maximum) {
+        return 0;
+    }
+    topicAliases.count++;
+    topicAliases.slots[slot].alias = topicAliases.count;
+    strncpy(topicAliases.slots[slot].topic, topic, MQTT_TOPIC_MAX_LENGTH - 1);
+    *known = false;
+    return topicAliases.count;
+}
+
+/* Forgets the topic aliases, which only last as long as a connection, 
+ * allowing up to maximum on the next one.
+ */
+static void resetTopicAliases(uint16_t maximum) {
+
+    pthread_mutex_lock(&topicAliases.mutex);
+    memset(topicAliases.slots, 0, sizeof(topicAliases.slots));
+    topicAliases.count = 0;
+    topicAliases.maximum = maximum < TOPIC_ALIAS_MAX ? maximum : TOPIC_ALIAS_MAX;
+    pthread_mutex_unlock(&topicAliases.mutex);
+}
+
+/* Publishes payload to topicName with the settings for topic.  With MQTT
+ * v5 it carries a topic alias at QoS 0, the expiry for topic and when the report
+ * was received as a user property.
+ */
+static void publishPayload(struct mosquitto *mosq, const struct config *config,
+                           const struct report *report, enum publishTopic topic, 
+                           const char *topicName, const void *payload, size_t payloadLen) {
+
+    const struct publishSettings *settings = &config->publish[topic];
+    size_t topicLen = strlen(topicName);
+    size_t idLen = settings->qos > 0 ? 2 : 0;
+    mosquitto_property *properties = NULL;
+    size_t propertiesLen = 0;
+    char received[32];
+    struct tm tm;
+    uint16_t alias;
+    bool known = false;
+
+    pthread_mutex_lock(&publishStats.mutex);
+    formatStats.bytes[topic] += topicLen + payloadLen;
+    pthread_mutex_unlock(&publishStats.mutex);
+
+    if (!config->mqtt5) {
+        mosquitto_publish(mosq, NULL, topicName, payloadLen, payload,
+                          settings->qos, settings->retain);
+        countPublish(packetSize(2 + topicLen + idLen + payloadLen), 
+                     packetSize(2 + topicLen + idLen + payloadLen), false);
+        return;
+    }
+
+    if (settings->expiry > 0) {
+        mosquitto_property_add_int32(&properties, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, 
+                                     settings->expiry);
+        propertiesLen += 1 + 4;
+    }
+
+    gmtime_r(&report->receivedTime.tv_sec, &tm);
+    strftime(received, sizeof(received), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(received + strlen(received), sizeof(received) - strlen(received), ".%03ldZ", 
+             report->receivedTime.tv_nsec / 1000000);
+    mosquitto_property_add_string_pair(&properties, MQTT_PROP_USER_PROPERTY, 
+                                       MQTT_PROPERTY_RECEIVED, received);
+    propertiesLen += 1 + 2 + strlen(MQTT_PROPERTY_RECEIVED) + 2 + strlen(received);
+
+    /* Held until published, so a reconnection can't clear the alias in between.
+     * Only QoS 0 publishes use aliases, as the others are resent after a 
+     * reconnection, when the alias would no longer be known.
+     */
+    pthread_mutex_lock(&topicAliases.mutex);
+    alias = (settings->qos == 0) ? topicAlias(topicName, &known) : 0;
+    if (alias != 0) {
+        mosquitto_property_add_int16(&properties, MQTT_PROP_TOPIC_ALIAS, alias);
+        propertiesLen += 1 + 2;
+    }
+    mosquitto_publish_v5(mosq, NULL, known ? NULL : topicName, payloadLen, payload,
+                         settings->qos, settings->retain, properties);
+    pthread_mutex_unlock(&topicAliases.mutex);
+    mosquitto_property_free_all(&properties);
+
+    countPublish(packetSize(2 + (known ? 0 : topicLen) + idLen 
+                            + varIntSize(propertiesLen) + propertiesLen + payloadLen), 
+                 packetSize(2 + topicLen + idLen + payloadLen), known);
+}
+
+/* Publishes a string payload */
+static void publishTopic(struct mosquitto *mosq, const struct config *config,
+                         const struct report *report, enum publishTopic topic, 
+                         const char *topicName, const char *payload) {
+
+    publishPayload(mosq, config, report, topic, topicName, payload, strlen(payload));
+}
+
+/* Returns the CPU time used by this thread, in nanoseconds */
+static long long threadCpuNs(void) {
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Publishes the batch, if it is full, its oldest report has waited
+ * long enough or force is set.  With a gatewayId the topic ends with it,
+ * so each gateway's batches can be told apart.
+ */
+static void flushBatch(struct mosquitto *mosq, bool force) {
+
+    static uint8_t payload[MAX_BATCH_ENTRIES * CBOR_FRAME_SIZE];
+    const struct config *config = configGet();
+    char mqttTopic[MQTT_TOPIC_MAX_LENGTH];
+    struct timespec now;
+    struct timespec wallNow;
+    int topicLength;
+    int i;
+
+    if (batch.count == 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!force && batch.count < config->batchEntries
+        && elapsedMicroseconds(&batch.added[0], &now) < config->batchMaxDelayMs * 1000L) {
+        return;
+    }
+
+    if (config->gatewayId[0] != '\0') {
+        topicLength = snprintf(mqttTopic, sizeof(mqttTopic), "/%s/%s/%s/%s", config->topicBase,
+                               MQTT_TOPIC_ETRV, MQTT_TOPIC_BATCH, config->gatewayId);
+    } else {
+        topicLength = snprintf(mqttTopic, sizeof(mqttTopic), "/%s/%s/%s", 
+                               config->topicBase, MQTT_TOPIC_ETRV, MQTT_TOPIC_BATCH);
+    }
+
+    if (topicLength >= (int)sizeof(mqttTopic)) {
+        log4c_category_error(clientlog, "Batch topic too long with gateway %s, %d reports dropped",
+                             config->gatewayId, batch.count);
+    } else if (config->batchFormat == BATCH_CBOR) {
+        struct cborWriter writer;
+
+        cborInit(&writer, payload, sizeof(payload));
+        cborArray(&writer, batch.count);
+        for (i = 0; i < batch.count; ++i) {
+            writeFrame(&writer, &batch.reports[i].frame, config);
+        }
+        if (cborLength(&writer) == 0) {
+            log4c_category_error(clientlog, "Batch of %d reports too big for CBOR", batch.count);
+            batchStats.overflows++;
+        } else {
+            publishPayload(mosq, config, &batch.reports[0], PUBLISH_BATCH, mqttTopic,
+                           payload, cborLength(&writer));
+        }
+    } else {
+        cJSON *root = cJSON_CreateArray();
+        char *jsonString;
+
+        if (root == NULL) {
+            log4c_category_error(clientlog, "Unable to create Batch JSON array");
+        } else {
+            for (i = 0; i < batch.count; ++i) {
+                cJSON *entry = frameToJSON(&batch.reports[i].frame, config);
+
+                if (entry != NULL) {
+                    cJSON_AddItemToArray(root, entry);
+                }
+            }
+            jsonString = cJSON_PrintUnformatted(root);
+            publishTopic(mosq, config, &batch.reports[0], PUBLISH_BATCH, mqttTopic, jsonString);
+            free(jsonString);
+            cJSON_Delete(root);
+        }
+    }
+
+    // Includes the time spent in the report queue before being batched
+    clock_gettime(CLOCK_REALTIME, &wallNow);
+    for (i = 0; i < batch.count; ++i) {
+        int64_t latencyUs = elapsedMicroseconds(&batch.reports[i].receivedTime, &wallNow);
+
+        if (latencyUs < 0) {
+            latencyUs = 0;              // The wall clock was set back
+        }
+        batchStats.latencyUs += latencyUs;
+        if (latencyUs > batchStats.maxLatencyUs) {
+            batchStats.maxLatencyUs = latencyUs;
+        }
+        batchStats.replaced += batch.reports[i].batchedTopics;
+    }
+    batchStats.batches++;
+    batchStats.entries += batch.count;
+    batch.count = 0;
+}
+
+/* Adds a report's frame to the batch, publishing the batch if it is
+ * then full
+ */
+static void addToBatch(struct mosquitto *mosq, const struct report *report) {
+
+    batch.reports[batch.count] = *report;
+    clock_gettime(CLOCK_MONOTONIC, &batch.added[batch.count]);
+    batch.count++;
+
+    if (batch.count >= configGet()->batchEntries || batch.count == MAX_BATCH_ENTRIES) {
+        batchStats.full++;
+        flushBatch(mosq, true);
+    }
+}
+
+/* Tells the other gateways sharing the sensor that a command has been
+ * dealt with, on /<topicBase>/Gateway/Result/<sensorId>, as
+ * {"gateway": "hall", "command": "Temperature", "value": 21, "result": "Confirmed"}
+ */
+static void publishGatewayResult(struct mosquitto *mosq, const struct config *config,
+                                 const struct report *report, 
+                                 const struct commandResult *result) {
+
+    char mqttTopic[MQTT_TOPIC_MAX_LENGTH];
+    cJSON *root = cJSON_CreateObject();
+    char *jsonString;
+
+    if (root == NULL) {
+        log4c_category_error(clientlog, "Unable to create Result JSON object");
+        return;
+    }
+    cJSON_AddStringToObject(root, "gateway", config->gatewayId);
+    cJSON_AddStringToObject(root, "command", commandTopicName(result->command));
+    cJSON_AddNumberToObject(root, "value", result->data);
+    cJSON_AddStringToObject(root, "result", outcomeNames[result->outcome]);
+
+    sensorTopicName(mqttTopic, config, MQTT_TOPIC_GATEWAY, MQTT_TOPIC_RESULT, report->sensorId);
+    jsonString = cJSON_PrintUnformatted(root);
+    publishTopic(mosq, config, report, PUBLISH_RESULT, mqttTopic, jsonString);
+    free(jsonString);
+    cJSON_Delete(root);
+}
+
+/* Formats and publishes everything in a decoded report */
+static void publishReport(struct mosquitto *mosq, const struct report *report) {
+
+    const struct config *config = configGet();
+    char mqttTopic[MQTT_TOPIC_MAX_LENGTH];
+    long long startNs;
+    int i;
+
+    for (i = 0; i < report->commandCount; ++i) {
+        const struct sentCommand *commandToSend = &report->commands[i];
+
+        switch (commandToSend->command) {
+            case OT_IDENTIFY:
+                log4c_category_debug(clientlog, "Sent Identify to device %d", 
+                                     report->sensorId);
+                break;
+
+            case OT_TEMP_SET:
+                log4c_category_debug(clientlog, "Sent Set Temperature %d to device %d",
+                                     commandToSend->data, report->sensorId);
+
+                {
+                    // Report temperature set to MQTT broker
+                    sensorTopicName(mqttTopic, config, MQTT_TOPIC_ETRV_REPORT, 
+                                    MQTT_TOPIC_TARGET_TEMPERATURE, report->sensorId);
+
+                    // Should only be 1 or 2 digits for temperature
+                    char temperature[5];
+                    snprintf(temperature, 4, "%d", commandToSend->data);
+
+                    publishTopic(mosq, config, report, PUBLISH_TARGET_TEMPERATURE, 
+                                 mqttTopic, temperature);
+                }
+                break;
+
+            case OT_EXERCISE_VALVE:
+                log4c_category_notice(clientlog, "Excercise Valve for sensorId %d", report->sensorId);
+                break;
+
+            case OT_REQUEST_VOLTAGE:
+                log4c_category_notice(clientlog, "Request Voltage for sensorId %d", report->sensorId);
+                break;
+
+            case OT_REQUEST_DIAGNOTICS:
+                log4c_category_notice(clientlog, "Request Diagnostics from device %d",
+                                      report->sensorId);
+                break;
+
+            case OT_SET_VALVE_STATE:
+                log4c_category_notice(clientlog, "Set Valve State %d to sensorId %d",
+                                      commandToSend->data, report->sensorId);
+                break;
+
+            case OT_SET_LOW_POWER_MODE:
+                log4c_category_notice(clientlog, "Set Low Power Mode %d to sensorId %d",
+                                      commandToSend->data, report->sensorId);
+                break;
+
+            case OT_SET_REPORTING_INTERVAL:
+                log4c_category_notice(clientlog, "Set Reporting Interval %d to sensorId %d",
+                                      commandToSend->data, report->sensorId);
+                break;
+        }
+    }
+
+    if (report->flags & REPORT_RESULTS) {
+        for (i = 0; i < report->resultCount; ++i) {
+            const struct commandResult *result = &report->results[i];
+            const char *outcome = outcomeNames[result->outcome];
+
+            log4c_category_info(clientlog, "SensorId=%d Command %s %d %s", 
+                                report->sensorId, commandTopicName(result->command), 
+                                result->data, outcome);
+
+            sensorTopicName(mqttTopic, config, MQTT_TOPIC_ETRV_RESULT, 
+                            commandTopicName(result->command), report->sensorId);
+            publishTopic(mosq, config, report, PUBLISH_RESULT, mqttTopic, outcome);
+            if (config->gatewayId[0] != '\0') {
+                publishGatewayResult(mosq, config, report, result);
+            }
+        }
+    }
+
+    startNs = threadCpuNs();
+
+    if (report->flags & REPORT_TEMPERATURE) {
+        log4c_category_info(clientlog, "SensorId=%d Temperature=%s", 
+                            report->sensorId, report->temperature);
+
+        sensorTopicName(mqttTopic, config, MQTT_TOPIC_ETRV_REPORT, 
+                        MQTT_TOPIC_TEMPERATURE, report->sensorId);
+        publishTopic(mosq, config, report, PUBLISH_TEMPERATURE, mqttTopic, 
+                     report->temperature);
+    }
+
+    if (report->flags & REPORT_DIAGNOSTICS) {
+        cJSON *root;
+        char *jsonString;
+
+        log4c_category_notice(clientlog, "SensorId=%d Diagnostics 0:%x 1:%x", 
+                              report->sensorId, 
+                              report->diagnosticData[0], 
+                              report->diagnosticData[1]);
+
+        root = createDiagnosticDataJson((uint8_t *)report->diagnosticData);
+        if (root == NULL) {
+            log4c_category_error(clientlog, "Unable to create Diagnostic Data JSON object");
+        } else {
+            sensorTopicName(mqttTopic, config, MQTT_TOPIC_ETRV_REPORT, 
+                            MQTT_TOPIC_DIAGNOSTICS, report->sensorId);
+            jsonString = cJSON_Print(root);
+            log4c_category_debug(clientlog, "Diagnostics %s", jsonString);
+            publishTopic(mosq, config, report, PUBLISH_DIAGNOSTICS, mqttTopic, jsonString);
+            free(jsonString);
+            cJSON_Delete(root);
+        }
+    }
+
+    if (report->flags & REPORT_VOLTAGE) {
+        log4c_category_notice(clientlog, "SensorId=%d Battery Voltage %s", 
+                              report->sensorId, 
+                              report->voltage);
+
+        sensorTopicName(mqttTopic, config, MQTT_TOPIC_ETRV_REPORT, 
+                        MQTT_TOPIC_VOLTAGE, report->sensorId);
+        publishTopic(mosq, config, report, PUBLISH_VOLTAGE, mqttTopic, report->voltage);
+    }
+
+    if (report->flags & REPORT_LINK_QUALITY) {
+        const struct linkQuality *link = &report->link;
+        cJSON *root = linkQualityToJSON(link);
+        char *jsonString;
+
+        log4c_category_info(clientlog, "SensorId=%d RSSI=%.1fdBm mean=%.1fdBm min=%.1fdBm "
+                            "FEI=%dHz CRC failures=%lu missed=%lu",
+                            report->sensorId, link->rssi, link->meanRssi, link->minRssi,
+                            link->fei, link->crcFailures, link->missedReports);
+
+        if (root == NULL) {
+            log4c_category_error(clientlog, "Unable to create Link Quality JSON object");
+        } else {
+            sensorTopicName(mqttTopic, config, MQTT_TOPIC_ETRV_REPORT, 
+                            MQTT_TOPIC_LINK_QUALITY, report->sensorId);
+            jsonString = cJSON_PrintUnformatted(root);
+            publishTopic(mosq, config, report, PUBLISH_LINK_QUALITY, mqttTopic, jsonString);
+            free(jsonString);
+            cJSON_Delete(root);
+        }
+    }
+
+    if (report->flags & REPORT_FRAME) {
+        uint8_t payload[CBOR_FRAME_SIZE];
+        size_t payloadLen;
+        long long cborStartNs = threadCpuNs();
+
+        formatStats.textCpuNs += cborStartNs - startNs;
+
+        payloadLen = encodeFrame(&report->frame, config, payload, sizeof(payload));
+        if (payloadLen == 0) {
+            log4c_category_error(clientlog, "Frame from sensorId %d too big for CBOR",
+                                 report->sensorId);
+            formatStats.overflows++;
+        } else {
+            if (config->cborReports == CBOR_PER_SENSOR) {
+                sensorTopicName(mqttTopic, config, MQTT_TOPIC_ETRV, 
+                                MQTT_TOPIC_FRAME, report->sensorId);
+            } else {
+                snprintf(mqttTopic, sizeof(mqttTopic), "/%s/%s/%s", 
+                         config->topicBase, MQTT_TOPIC_ETRV, MQTT_TOPIC_FRAME);
+            }
+            publishPayload(mosq, config, report, PUBLISH_FRAME, mqttTopic, 
+                           payload, payloadLen);
+            formatStats.frames++;
+        }
+        formatStats.cborCpuNs += threadCpuNs() - cborStartNs;
+    }
+
+    if (report->flags & REPORT_BATCH) {
+        addToBatch(mosq, report);
+    }
+
+    if (report->flags & REPORT_AGGREGATE) {
+        const struct aggregateWindow *window = &report->aggregate;
+        cJSON *root = cJSON_CreateObject();
+        char windowName[12];
+        char *jsonString;
+
+        if (root == NULL) {
+            log4c_category_error(clientlog, "Unable to create Aggregate JSON object");
+        } else {
+            cJSON_AddNumberToObject(root, "window", window->seconds);
+            cJSON_AddNumberToObject(root, "start", window->start);
+
+            for (i = 0; i < AGGREGATE_QUANTITIES; ++i) {
+                const struct windowStats *stats = &window->stats[i];
+                cJSON *quantity;
+
+                if (stats->count > 0 && (quantity = cJSON_CreateObject()) != NULL) {
+                    cJSON_AddNumberToObject(quantity, "min", stats->min);
+                    cJSON_AddNumberToObject(quantity, "max", stats->max);
+                    cJSON_AddNumberToObject(quantity, "mean", stats->sum / stats->count);
+                    cJSON_AddNumberToObject(quantity, "last", stats->last);
+                    cJSON_AddNumberToObject(quantity, "count", stats->count);
+                    cJSON_AddItemToObject(root, aggregateNames[i], quantity);
+                }
+            }
+
+            // /<topicBase>/eTRV/Report/Aggregate/<window>/<sensorId>
+            snprintf(windowName, sizeof(windowName), "%d", window->seconds);
+            sensorTopicName(mqttTopic, config, MQTT_TOPIC_ETRV_REPORT "/" MQTT_TOPIC_AGGREGATE,
+                            windowName, report->sensorId);
+            jsonString = cJSON_PrintUnformatted(root);
+            publishTopic(mosq, config, report, PUBLISH_AGGREGATE, mqttTopic, jsonString);
+            free(jsonString);
+            cJSON_Delete(root);
+        }
+    }
+
+    if (report->flags & REPORT_HEARD) {
+        cJSON *root = cJSON_CreateObject();
+        char *jsonString;
+
+        if (root == NULL) {
+            log4c_category_error(clientlog, "Unable to create Heard JSON object");
+        } else {
+            cJSON_AddStringToObject(root, "gateway", config->gatewayId);
+            cJSON_AddNumberToObject(root, "rssi", report->heardRssi);
+            cJSON_AddBoolToObject(root, "owner", report->owned);
+            cJSON_AddNumberToObject(root, "time", report->receivedTime.tv_sec);
+
+            sensorTopicName(mqttTopic, config, MQTT_TOPIC_GATEWAY, 
+                            MQTT_TOPIC_HEARD, report->sensorId);
+            jsonString = cJSON_PrintUnformatted(root);
+            publishTopic(mosq, config, report, PUBLISH_HEARD, mqttTopic, jsonString);
+            free(jsonString);
+            cJSON_Delete(root);
+        }
+    }
+}
+
+#define REPORT_WAIT_FOREVER -1
+
+/* Takes the next report from the queue into report, waiting up to
+ * waitMs for one, or for as long as it takes with REPORT_WAIT_FOREVER.
+ * Returns false if there is none.
+ */
+static bool takeReport(struct report *report, long waitMs) {
+
+    struct timespec until;
+
+    if (waitMs > 0) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += waitMs / 1000;
+        until.tv_nsec += (waitMs % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&reportQueue.mutex);
+    while (reportQueue.count == 0) {
+        if (waitMs == 0 
+            || (waitMs > 0 && pthread_cond_timedwait(&reportQueue.notEmpty, &reportQueue.mutex,
+                                                     &until) == ETIMEDOUT)) {
+            pthread_mutex_unlock(&reportQueue.mutex);
+            return false;
+        }
+        if (waitMs < 0) {
+            pthread_cond_wait(&reportQueue.notEmpty, &reportQueue.mutex);
+        }
+    }
+    *report = reportQueue.reports[reportQueue.head];
+    reportQueue.head = (reportQueue.head + 1) % REPORT_QUEUE_SIZE;
+    reportQueue.count--;
+    pthread_mutex_unlock(&reportQueue.mutex);
+    return true;
+}
+
+/* Publishes the reports queued by the radio loop, so that formatting,
+ * JSON and the broker never hold up the radio.
+ */
+static void *publisherThread(void *arg) {
+
+    struct mosquitto *mosq = arg;
+    struct report report;
+
+    while (1) {
+        // Only wakes without a report to publish a batch that has waited long enough
+        if (takeReport(&report, batch.count > 0 ? BATCH_POLL_MS : REPORT_WAIT_FOREVER)) {
+            publishReport(mosq, &report);
+        }
+        flushBatch(mosq, false);
+    }
+    return NULL;
+}
+
+/* Reads the name=value options that can follow the sensorId in an eTRV
+ * command topic, for example /energenie/eTRV/Command/Voltage/329/priority=interactive
+ * Returns false, having logged why, if any are invalid.
+ */
+static bool parseCommandOptions(char **optionTopics, int optionCount, 
+                                struct commandOptions *options) {
+
+    int i;
+    int p;
+
+    options->priority = PRIORITY_DEFAULT;
+    options->ttl = 0;
+
+    for (i = 0; i < optionCount; ++i) {
+        char *value = strchr(optionTopics[i], '=');
+
+        if (value == NULL) {
+            log4c_category_error(clientlog, "Command option must be name=value: %s", 
+                                 optionTopics[i]);
+            return false;
+        }
+        value++;
+
+        if (strncmp(optionTopics[i], "priority=", value - optionTopics[i]) == 0) {
+            for (p = 0; p < PRIORITY_COUNT; ++p) {
+                if (strcasecmp(priorityNames[p], value) == 0) {
+                    options->priority = p;
+                    break;
+                }
+            }
+            if (p == PRIORITY_COUNT) {
+                log4c_category_error(clientlog, "Unknown priority %s", value);
+                return false;
+            }
+        } else if (strncmp(optionTopics[i], "ttl=", value - optionTopics[i]) == 0) {
+            char *end;
+            long ttl = strtol(value, &end, 10);
+
+            if (*value == '\0' || *end != '\0' || ttl < 1 || ttl > MAX_COMMAND_TTL) {
+                log4c_category_error(clientlog, "ttl must be seconds from 1 to %d, got %s",
+                                     MAX_COMMAND_TTL, value);
+                return false;
+            }
+            options->ttl = ttl;
+        } else {
+            log4c_category_error(clientlog, "Unknown command option %s", optionTopics[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* One command from a bulk message, and why it was rejected if it was */
+struct bulkCommand {
+    int sensorId;
+    uint8_t command;
+    uint32_t value;
+    enum commandPriority priority;
+    int ttl;
+    const char *error;
+};
+
+/* Reads one {"sensorId": 329, "command": "Temperature", "value": 21} entry
+ * of a bulk message, with an optional "priority", checking it as the 
+ * command's own topic would.  Sets command->error if it is invalid.
+ */
+static void parseBulkCommand(cJSON *item, struct bulkCommand *command) {
+
+    cJSON *field;
+    int p;
+
+    memset(command, 0, sizeof(*command));
+    command->priority = PRIORITY_DEFAULT;
+    command->ttl = 0;
+
+    if (item->type != cJSON_Object) {
+        command->error = "Command must be a JSON object";
+        return;
+    }
+
+    field = cJSON_GetObjectItem(item, "sensorId");
+    if (field == NULL || field->type != cJSON_Number 
+        || field->valuedouble != field->valueint
+        || field->valueint < 1 || field->valueint > 0xffffff) {
+        command->error = "sensorId must be an integer from 1 to 16777215";
+        return;
+    }
+    command->sensorId = field->valueint;
+
+    field = cJSON_GetObjectItem(item, "command");
+    if (field == NULL || field->type != cJSON_String
+        || !commandFromTopicName(field->valuestring, &command->command)) {
+        command->error = "Unknown command";
+        return;
+    }
+
+    if (commandTakesValue(command->command)) {
+        field = cJSON_GetObjectItem(item, "value");
+        if (field == NULL || field->type != cJSON_Number 
+            || field->valuedouble != field->valueint || field->valueint < 0) {
+            command->error = "value must be a whole number";
+            return;
+        }
+        command->value = field->valueint;
+    }
+
+    field = cJSON_GetObjectItem(item, "priority");
+    if (field != NULL) {
+        for (p = 0; p < PRIORITY_COUNT; ++p) {
+            if (field->type == cJSON_String 
+                && strcasecmp(priorityNames[p], field->valuestring) == 0) {
+                command->priority = p;
+                break;
+            }
+        }
+        if (p == PRIORITY_COUNT) {
+            command->error = "Unknown priority";
+            return;
+        }
+    }
+
+    field = cJSON_GetObjectItem(item, "ttl");
+    if (field != NULL) {
+        if (field->type != cJSON_Number || field->valuedouble != field->valueint
+            || field->valueint < 1 || field->valueint > MAX_COMMAND_TTL) {
+            command->error = "ttl must be whole seconds from 1 to " 
+                COMMAND_TTL_TEXT(MAX_COMMAND_TTL);
+            return;
+        }
+        command->ttl = field->valueint;
+    }
+
+    command->error = checkCommandValue(command->command, command->value);
+}
+
+/* Queues the commands in a bulk message, a JSON array of up to 
+ * MAX_BULK_COMMANDS, all under one lock.  Each is checked first, and
+ * those that are invalid are left out.  Whether each was queued, and if
+ * not why, is published on the bulk reply topic, in the same order.
+ */
+static void addBulkCommands(struct mosquitto *mosq, const char *payload, int payloadLen) {
+
+    const struct config *config = configGet();
+    struct bulkCommand commands[MAX_BULK_COMMANDS];
+    struct report report;
+    char mqttTopic[MQTT_TOPIC_MAX_LENGTH];
+    char *text;
+    char *jsonString;
+    cJSON *root;
+    cJSON *item;
+    cJSON *results;
+    int count = 0;
+    int queued = 0;
+    int i;
+    int j;
+
+    if (payloadLen > MAX_BULK_PAYLOAD) {
+        log4c_category_error(clientlog, "Bulk command message must be less than %d bytes",
+                             MAX_BULK_PAYLOAD);
+        return;
+    }
+
+    text = malloc(payloadLen + 1);
+    memcpy(text, payload, payloadLen);
+    text[payloadLen] = '\0';
+    root = cJSON_Parse(text);
+    free(text);
+    if (root == NULL || root->type != cJSON_Array) {
+        log4c_category_error(clientlog, "Bulk command message must be a JSON array");
+        cJSON_Delete(root);
+        return;
+    }
+
+    for (item = root->child; item != NULL; item = item->next) {
+        if (count == MAX_BULK_COMMANDS) {
+            log4c_category_error(clientlog, "Bulk command message must have at most %d commands",
+                                 MAX_BULK_COMMANDS);
+            cJSON_Delete(root);
+            return;
+        }
+        parseBulkCommand(item, &commands[count++]);
+    }
+    cJSON_Delete(root);
+
+    pthread_mutex_lock(&sensorListMutex);
+    for (i = 0; i < count; ++i) {
+        if (commands[i].error == NULL) {
+            queueCommand(commands[i].sensorId, commands[i].command, commands[i].value,
+                         commands[i].priority, commands[i].ttl);
+            queued++;
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        // Each sensor's reply is restaged once, for all its commands
+        for (j = 0; j < i; ++j) {
+            if (commands[j].error == NULL && commands[j].sensorId == commands[i].sensorId) {
+                break;
+            }
+        }
+        if (commands[i].error == NULL && j == i) {
+            stageSensorReply(commands[i].sensorId);
+        }
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+
+    log4c_category_notice(clientlog, "Bulk message queued %d of %d commands", queued, count);
+
+    results = cJSON_CreateArray();
+    for (i = 0; i < count; ++i) {
+        item = cJSON_CreateObject();
+        if (commands[i].sensorId != 0) {
+            cJSON_AddNumberToObject(item, "sensorId", commands[i].sensorId);
+        }
+        if (commands[i].command != 0) {
+            cJSON_AddStringToObject(item, "command", commandTopicName(commands[i].command));
+        }
+        if (commands[i].error == NULL) {
+            cJSON_AddStringToObject(item, "result", "Queued");
+        } else {
+            log4c_category_error(clientlog, "Bulk command %d rejected: %s", i, commands[i].error);
+            cJSON_AddStringToObject(item, "result", "Rejected");
+            cJSON_AddStringToObject(item, "error", commands[i].error);
+        }
+        cJSON_AddItemToArray(results, item);
+    }
+
+    memset(&report, 0, sizeof(report));
+    clock_gettime(CLOCK_REALTIME, &report.receivedTime);
+    snprintf(mqttTopic, sizeof(mqttTopic), "/%s/%s", config->topicBase, 
+             MQTT_TOPIC_SENT_BULK_REPLY);
+    jsonString = cJSON_PrintUnformatted(results);
+    publishTopic(mosq, config, &report, PUBLISH_RESULT, mqttTopic, jsonString);
+    free(jsonString);
+    cJSON_Delete(results);
+}
+
+/* Sends a command to every device in a group.  Sockets are switched
+ * with On or Off on /<topicBase>/group/<name>/ENER002, and eTRVs sent
+ * /<topicBase>/group/<name>/eTRV/<command>[/options] with the value, for 
+ * a command that takes one, as the payload.  The commands for all the 
+ * group's eTRVs are queued under one lock, as are its bursts.
+ */
+static void groupCommand(char **topics, int topic_count, 
+                         const struct mosquitto_message *message) {
+
+    const struct group *group = configFindGroup(configGet(), topics[MQTT_TOPIC_GROUP_NAME_INDEX]);
+    const char *payload = message->payload;
+    struct commandOptions options;
+    struct timespec start;
+    struct timespec end;
+    const char *error;
+    uint8_t command;
+    uint32_t value = 0;
+    int i;
+
+    if (group == NULL) {
+        log4c_category_error(clientlog, "No group called %s", topics[MQTT_TOPIC_GROUP_NAME_INDEX]);
+        return;
+    }
+    if (topic_count <= MQTT_TOPIC_GROUP_DEVICE_INDEX) {
+        log4c_category_error(clientlog, "Invalid topic count(%d) for %s", topic_count, 
+                             MQTT_TOPIC_GROUP);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (strcmp(MQTT_TOPIC_ENER002, topics[MQTT_TOPIC_GROUP_DEVICE_INDEX]) == 0
+        && topic_count == MQTT_TOPIC_GROUP_ENER002_COUNT) {
+        int onOff;
+
+        if (message->payloadlen == 0) {
+            log4c_category_error(clientlog, "No Payload for group %s", group->name);
+            return;
+        } else if (strcasecmp("On", payload) == 0) {
+            onOff = 1;
+        } else if (strcasecmp("Off", payload) == 0) {
+            onOff = 0;
+        } else {
+            log4c_category_error(clientlog, "Invalid Payload for group %s", group->name);
+            return;
+        }
+
+        addGroupOOKToSend(group, onOff);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        log4c_category_notice(clientlog, "Group %s switched %s in %d bursts, queued in %lldus", 
+                              group->name, onOff ? "On" : "Off", group->burstCount,
+                              (long long)elapsedMicroseconds(&start, &end));
+
+    } else if (strcmp(MQTT_TOPIC_ETRV, topics[MQTT_TOPIC_GROUP_DEVICE_INDEX]) == 0
+               && topic_count >= MQTT_TOPIC_GROUP_ETRV_COUNT
+               && topic_count <= MQTT_TOPIC_GROUP_ETRV_COUNT + MAX_COMMAND_OPTIONS) {
+
+        if (!commandFromTopicName(topics[MQTT_TOPIC_GROUP_TYPE_INDEX], &command)) {
+            log4c_category_error(clientlog, "Can't handle %s commands for group %s", 
+                                 topics[MQTT_TOPIC_GROUP_TYPE_INDEX], group->name);
+            return;
+        }
+        if (!parseCommandOptions(&topics[MQTT_TOPIC_GROUP_ETRV_COUNT], 
+                                 topic_count - MQTT_TOPIC_GROUP_ETRV_COUNT, &options)) {
+            return;
+        }
+
+        if (commandTakesValue(command)) {
+            char valueString[6];
+            char *valueEnd;
+
+            if (message->payloadlen < 1 || message->payloadlen >= sizeof(valueString)) {
+                log4c_category_error(clientlog, "Payload for group %s must be 1 to 5 digits",
+                                     group->name);
+                return;
+            }
+            memcpy(valueString, payload, message->payloadlen);
+            valueString[message->payloadlen] = '\0';
+            value = strtoul(valueString, &valueEnd, 0);
+            if (*valueEnd != '\0') {
+                log4c_category_error(clientlog, "Payload for group %s must be a number",
+                                     group->name);
+                return;
+            }
+            if ((error = checkCommandValue(command, value)) != NULL) {
+                log4c_category_error(clientlog, "%s, got %d", error, value);
+                return;
+            }
+        }
+
+        pthread_mutex_lock(&sensorListMutex);
+        for (i = 0; i < group->sensorCount; ++i) {
+            queueCommand(group->sensorIds[i], command, value, options.priority, options.ttl);
+            stageSensorReply(group->sensorIds[i]);
+        }
+        pthread_mutex_unlock(&sensorListMutex);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        log4c_category_notice(clientlog, "Group %s sent %s to %d eTRVs, queued in %lldus", 
+                              group->name, commandTopicName(command), group->sensorCount,
+                              (long long)elapsedMicroseconds(&start, &end));
+    } else {
+        log4c_category_error(clientlog, "Invalid topic for group %s", group->name);
+    }
+}
+
+/* Injects a temperature report from sensorId into the simulated radio,
+ * from a payload such as {"temperature": 19.5, "rssi": -70, "gateway": "hall"}.
+ * With a gateway the report is only heard by that gateway, so that several
+ * simulated gateways on one broker can each hear a sensor differently.
+ */
+static void simulateReport(int sensorId, const char *payload, int payloadLen) {
+
+    const struct config *config = configGet();
+    char json[MQTT_MAX_JSON_PAYLOAD + 1];
+    cJSON *root;
+    cJSON *item;
+    double temperature = 20;
+    double rssi = -60;
+    int32_t value;
+    uint8_t records[4];
+    uint8_t frame[MAX_FIFO_SIZE];
+
+    if (payloadLen > MQTT_MAX_JSON_PAYLOAD) {
+        log4c_category_error(clientlog, "Simulated report for sensorId %d too long", sensorId);
+        return;
+    }
+    memcpy(json, payload, payloadLen);
+    json[payloadLen] = '\0';
+    root = cJSON_Parse(json);
+    if (root == NULL || root->type != cJSON_Object) {
+        log4c_category_error(clientlog, "Simulated report for sensorId %d is not a JSON object",
+                             sensorId);
+        cJSON_Delete(root);
+        return;
+    }
+
+    item = cJSON_GetObjectItem(root, "gateway");
+    if (item != NULL && (item->type != cJSON_String 
+                         || strcmp(item->valuestring, config->gatewayId) != 0)) {
+        cJSON_Delete(root);
+        return;
+    }
+    if ((item = cJSON_GetObjectItem(root, "temperature")) != NULL && item->type == cJSON_Number) {
+        temperature = item->valuedouble;
+    }
+    if ((item = cJSON_GetObjectItem(root, "rssi")) != NULL && item->type == cJSON_Number) {
+        rssi = item->valuedouble;
+    }
+    cJSON_Delete(root);
+
+    // Signed, 8 binary places, 2 bytes
+    value = (int32_t)(temperature * 256);
+    records[0] = OT_TEMP_REPORT;
+    records[1] = 0x92;
+    records[2] = (value >> 8) & 0xff;
+    records[3] = value & 0xff;
+    HRF_build_FSK_records_msg(frame, config->manufacturerId, config->eTRVEncryptId,
+                              config->eTRVProductId, sensorId, records, sizeof(records));
+
+    if (!hrfSimInject(&fskRadio, frame + 1, frame[MSG_REMAINING_LEN+1] + 1, rssi)) {
+        log4c_category_warn(clientlog, "Simulated radio busy, report for sensorId %d lost", 
+                            sensorId);
+    }
+}
+
+void my_message_callback(struct mosquitto *mosq, void *userdata, 
+                         const struct mosquitto_message *message)
+{
+    char **topics;
+    int topic_count;
+    int i;
+
+    log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "%s", __FUNCTION__);
+
+    if (mosquitto_sub_topic_tokenise(message->topic, &topics, &topic_count) 
+        != 
+        MOSQ_ERR_SUCCESS) {
+        log4c_category_error(clientlog, "Unable to tokenise topic");
+        return;
+    }
+
+    if (log4c_category_is_trace_enabled(clientlog)) {
+        for (i=0; i<topic_count; i++) {
+            log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE,
+                               "%d: %s", i, topics[i]);
+        }
+    }
+
+    if (topic_count < 2) {
+        log4c_category_error(clientlog, "Invalid Topic count %d", topic_count);
+        mosquitto_sub_topic_tokens_free(&topics, topic_count);
+        return;
+    }
+
+    if (strcmp(configGet()->topicBase, topics[MQTT_TOPIC_BASE_INDEX]) != 0) {
+        log4c_category_error(clientlog, "Received base topic %s", topics[MQTT_TOPIC_BASE_INDEX]);
+        mosquitto_sub_topic_tokens_free(&topics, topic_count);
+        return;
+    }
+
+    if (strcmp(MQTT_TOPIC_ENER002, topics[MQTT_TOPIC_DEVICE_INDEX]) == 0) {
+        // Message for plug in socket type ENER002
+
+        if (topic_count != MQTT_TOPIC_ENER002_COUNT) {
+            log4c_category_error(clientlog, "Invalid topic count(%d) for %s", 
+                                 topic_count,
+                                 MQTT_TOPIC_ENER002);
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+            return;
+        }
+
+#define MAX_OOK_ADDRESS_TOPIC_LENGTH (OOK_MSG_ADDRESS_LENGTH * 2)
+#define MAX_OOK_SOCKET_TOPIC_LENGTH  1
+
+        char address[MAX_OOK_ADDRESS_TOPIC_LENGTH + 1];
+        char device[MAX_OOK_SOCKET_TOPIC_LENGTH + 1];
+
+        strncpy(address, topics[MQTT_TOPIC_OOK_ADDRESS_INDEX], MAX_OOK_ADDRESS_TOPIC_LENGTH);
+        address[MAX_OOK_ADDRESS_TOPIC_LENGTH] = '\0';
+        strncpy(device, topics[MQTT_TOPIC_OOK_SOCKET_INDEX], MAX_OOK_SOCKET_TOPIC_LENGTH);
+        device[MAX_OOK_SOCKET_TOPIC_LENGTH] = '\0';
+
+        log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "Freeing tokens");
+
+        mosquitto_sub_topic_tokens_free(&topics, topic_count);
+
+        log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "Tokens Freed");
+
+
+        if(message->payloadlen == 0) {
+            log4c_category_error(clientlog, "No Payload for %s", 
+                                 MQTT_TOPIC_ENER002);
+            return;
+        }
+
+        int onOff;
+        int socketNum;
+
+        if (strcasecmp("On", message->payload) == 0) {
+            onOff = 1;
+        } else if (strcasecmp("Off", message->payload) == 0) {
+            onOff = 0;
         } else {
             log4c_category_error(clientlog, "Invalid Payload for %s", 
                                  MQTT_TOPIC_ENER002);
@@ -370,27 +3325,37 @@ void my_message_callback(struct mosquitto *mosq, void *userdata,
         }
 
         uint8_t addressBytes[OOK_MSG_ADDRESS_LENGTH];
-        int i;
 
-        for (i = OOK_MSG_ADDRESS_LENGTH - 1; i>=0; --i) {
-            int lownibble = (addressNumber & 0x01) ? 0x0E : 0x08;
-            int highnibble = (addressNumber & 0x02) ? 0xE0 : 0x80;
-            addressBytes[i] = highnibble | lownibble;
-            addressNumber = addressNumber >> 2;
-        }
-
-        HRF_send_OOK_msg(addressBytes, socketNum, onOff, repeat_send);
+        ookAddressBytes(addressNumber, addressBytes);
+        addOOKToSend(addressBytes, socketNum, onOff);
 
     } else if (strcmp(MQTT_TOPIC_ETRV, topics[MQTT_TOPIC_DEVICE_INDEX]) == 0) {
         // Message for eTRV Radiator Valve
+        struct commandOptions options;
+        const char *error;
         
-        if (topic_count != MQTT_TOPIC_ETRV_COUNT) {
+        if (topic_count == MQTT_TOPIC_BULK_COUNT
+            && strcmp(MQTT_TOPIC_COMMAND, topics[MQTT_TOPIC_COMMAND_INDEX]) == 0
+            && strcmp(MQTT_TOPIC_BULK, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+            addBulkCommands(mosq, message->payload, message->payloadlen);
+            return;
+        }
+
+        if (topic_count < MQTT_TOPIC_ETRV_COUNT 
+            || topic_count > MQTT_TOPIC_ETRV_COUNT + MAX_COMMAND_OPTIONS) {
             log4c_category_error(clientlog, "Invalid topic count(%d) for %s", 
                                  topic_count,
                                  MQTT_TOPIC_ETRV);
             mosquitto_sub_topic_tokens_free(&topics, topic_count);
             return;
         }
+
+        if (!parseCommandOptions(&topics[MQTT_TOPIC_ETRV_COUNT], 
+                                 topic_count - MQTT_TOPIC_ETRV_COUNT, &options)) {
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+            return;
+        }
         
 
         if (strcmp(MQTT_TOPIC_COMMAND, topics[MQTT_TOPIC_COMMAND_INDEX]) != 0) {
@@ -400,45 +3365,142 @@ void my_message_callback(struct mosquitto *mosq, void *userdata,
         }
 
 
-        if (strcmp(MQTT_TOPIC_IDENTIFY, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
-            // Send Identify command to eTRV
-            //
-            char sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH + 1];
-            strncpy(sensorId, topics[MQTT_TOPIC_SENSORID_INDEX], MQTT_TOPIC_MAX_SENSOR_LENGTH);
-            sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH] = '\0';
+        if (strcmp(MQTT_TOPIC_IDENTIFY, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+            // Send Identify command to eTRV
+            //
+            char sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH + 1];
+            strncpy(sensorId, topics[MQTT_TOPIC_SENSORID_INDEX], MQTT_TOPIC_MAX_SENSOR_LENGTH);
+            sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH] = '\0';
+
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+
+            int intSensorId = atoi(sensorId);
+
+            if (intSensorId == 0) {
+                // Assume 0 isn't valid sensor id
+                log4c_category_error(clientlog, "SensorId must be an integer: %s", sensorId);
+                return;
+            }
+
+
+            addCommandToSend(intSensorId, OT_IDENTIFY, 0, &options);
+
+        } else if (strcmp(MQTT_TOPIC_TEMPERATURE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+            // Send set temperature command to eTRV
+            char sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH + 1];
+            strncpy(sensorId, topics[MQTT_TOPIC_SENSORID_INDEX], MQTT_TOPIC_MAX_SENSOR_LENGTH);
+            sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH] = '\0';
+
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+
+            int intSensorId = atoi(sensorId);
+
+            if (intSensorId == 0) {
+                // Assume 0 isn't valid sensor id
+                log4c_category_error(clientlog, "SensorId must be an integer: %s", sensorId);
+                return;
+            }
+
+            if (message->payloadlen > 6) {
+                log4c_category_error(clientlog, "Payload for set temperature must be less than "
+                                                "7 bytes in length");
+                return;
+            }
+
+            char tempString[message->payloadlen+1];
+            strncpy(tempString, message->payload, message->payloadlen);
+            tempString[message->payloadlen] = '\0';
+
+            uint32_t temperature = strtoul(tempString, NULL, 0);
+
+            if ((error = checkCommandValue(OT_TEMP_SET, temperature)) != NULL) {
+                log4c_category_error(clientlog, "%s, got %d", error, temperature);
+                return;
+            }
+
+            addCommandToSend(intSensorId, OT_TEMP_SET, temperature, &options);
+        } else if (strcmp(MQTT_TOPIC_VALVE_STATE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+            // Send set valve state command to eTRV
+            char sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH + 1];
+            strncpy(sensorId, topics[MQTT_TOPIC_SENSORID_INDEX], MQTT_TOPIC_MAX_SENSOR_LENGTH);
+            sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH] = '\0';
+
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+
+            int intSensorId = atoi(sensorId);
+
+            if (intSensorId == 0) {
+                // Assume 0 isn't valid sensor id
+                log4c_category_error(clientlog, "SensorId must be an integer: %s", sensorId);
+                return;
+            }
+
+            if (message->payloadlen != 1) {
+                log4c_category_error(clientlog, "Payload for set valve state must be 1"
+                                                "digit in length");
+                return;
+            }
+
+            char tempString[message->payloadlen+1];
+            strncpy(tempString, message->payload, message->payloadlen);
+            tempString[message->payloadlen] = '\0';
+
+            uint32_t state = strtoul(tempString, NULL, 0);
+
+            if ((error = checkCommandValue(OT_SET_VALVE_STATE, state)) != NULL) {
+                log4c_category_error(clientlog, "%s, got %d", error, state);
+                return;
+            }
+
+            addCommandToSend(intSensorId, OT_SET_VALVE_STATE, state, &options);
+
 
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+        } else if (strcmp(MQTT_TOPIC_POWER_MODE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+            // Send set valve state command to eTRV
+            int sensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
 
-            int intSensorId = atoi(sensorId);
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
 
-            if (intSensorId == 0) {
+            if (sensorId == 0) {
                 // Assume 0 isn't valid sensor id
-                log4c_category_error(clientlog, "SensorId must be an integer: %s", sensorId);
+                log4c_category_error(clientlog, "SensorId must be an integer: %d", sensorId);
                 return;
             }
 
+            if (message->payloadlen != 1) {
+                log4c_category_error(clientlog, "Payload for set valve state must be 1"
+                                                "digit in length");
+                return;
+            }
 
-            addCommandToSend(intSensorId, OT_IDENTIFY, 0);
+            char tempString[message->payloadlen+1];
+            strncpy(tempString, message->payload, message->payloadlen);
+            tempString[message->payloadlen] = '\0';
 
-        } else if (strcmp(MQTT_TOPIC_TEMPERATURE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
-            // Send set temperature command to eTRV
-            char sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH + 1];
-            strncpy(sensorId, topics[MQTT_TOPIC_SENSORID_INDEX], MQTT_TOPIC_MAX_SENSOR_LENGTH);
-            sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH] = '\0';
+            uint32_t powerMode = strtoul(tempString, NULL, 0);
 
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+            if ((error = checkCommandValue(OT_SET_LOW_POWER_MODE, powerMode)) != NULL) {
+                log4c_category_error(clientlog, "%s, got %d", error, powerMode);
+                return;
+            }
 
-            int intSensorId = atoi(sensorId);
+            addCommandToSend(sensorId, OT_SET_LOW_POWER_MODE, powerMode, &options);
 
-            if (intSensorId == 0) {
+        } else if (strcmp(MQTT_TOPIC_REPORTING_INTERVAL, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+            // Send set valve state command to eTRV
+            int sensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
+
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+
+            if (sensorId == 0) {
                 // Assume 0 isn't valid sensor id
-                log4c_category_error(clientlog, "SensorId must be an integer: %s", sensorId);
+                log4c_category_error(clientlog, "SensorId must be an integer: %d", sensorId);
                 return;
             }
 
-            if (message->payloadlen > 6) {
-                log4c_category_error(clientlog, "Payload for set temperature must be less than "
-                                                "7 bytes in length");
+            if (message->payloadlen > 5 || message->payloadlen < 1) {
+                log4c_category_error(clientlog, "Payload for set reporting interval must be 1 and 5"
+                                                "digits in length");
                 return;
             }
 
@@ -446,242 +3508,894 @@ void my_message_callback(struct mosquitto *mosq, void *userdata,
             strncpy(tempString, message->payload, message->payloadlen);
             tempString[message->payloadlen] = '\0';
 
-            uint32_t temperature = strtoul(tempString, NULL, 0);
+            uint32_t reportingInterval = strtoul(tempString, NULL, 0);
 
-            if (temperature < 4 || temperature > 30) {
-                log4c_category_error(clientlog, "Temperature must be between 4 and 30, got %d",
-                                     temperature);
+            if ((error = checkCommandValue(OT_SET_REPORTING_INTERVAL, reportingInterval)) 
+                != NULL) {
+                log4c_category_error(clientlog, "%s, got %d", error, reportingInterval);
                 return;
             }
 
-            addCommandToSend(intSensorId, OT_TEMP_SET, temperature);
-        } else if (strcmp(MQTT_TOPIC_VALVE_STATE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
-            // Send set valve state command to eTRV
-            char sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH + 1];
-            strncpy(sensorId, topics[MQTT_TOPIC_SENSORID_INDEX], MQTT_TOPIC_MAX_SENSOR_LENGTH);
-            sensorId[MQTT_TOPIC_MAX_SENSOR_LENGTH] = '\0';
+            addCommandToSend(sensorId, OT_SET_REPORTING_INTERVAL, reportingInterval, &options);
+
+
+        } else if (strcmp(MQTT_TOPIC_DIAGNOSTICS, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+
+            int sensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
+
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+
+
+            if (sensorId == 0) {
+                // Assume 0 isn't valid sensor id
+                log4c_category_error(clientlog, "SensorId must be an integer: %s", 
+                                     topics[MQTT_TOPIC_SENSORID_INDEX]);
+                return;
+            }
+
+            addCommandToSend(sensorId, OT_REQUEST_DIAGNOTICS, 0, &options);
+            
+        } else if (strcmp(MQTT_TOPIC_EXERCISE_VALVE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+
+            int intSensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
 
             mosquitto_sub_topic_tokens_free(&topics, topic_count);
 
-            int intSensorId = atoi(sensorId);
 
             if (intSensorId == 0) {
                 // Assume 0 isn't valid sensor id
-                log4c_category_error(clientlog, "SensorId must be an integer: %s", sensorId);
+                log4c_category_error(clientlog, "SensorId must be an integer: %s", 
+                                     topics[MQTT_TOPIC_SENSORID_INDEX]);
                 return;
             }
 
-            if (message->payloadlen != 1) {
-                log4c_category_error(clientlog, "Payload for set valve state must be 1"
-                                                "digit in length");
+            addCommandToSend(intSensorId, OT_EXERCISE_VALVE, 0, &options);
+            
+        } else if (strcmp(MQTT_TOPIC_VOLTAGE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+
+            int intSensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
+
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+
+
+            if (intSensorId == 0) {
+                // Assume 0 isn't valid sensor id
+                log4c_category_error(clientlog, "SensorId must be an integer: %s", 
+                                     topics[MQTT_TOPIC_SENSORID_INDEX]);
                 return;
             }
 
-            char tempString[message->payloadlen+1];
-            strncpy(tempString, message->payload, message->payloadlen);
-            tempString[message->payloadlen] = '\0';
+            addCommandToSend(intSensorId, OT_REQUEST_VOLTAGE, 0, &options);
+            
+        } else {
+            log4c_category_warn(clientlog, 
+                           "Can't handle %s commands for %s yet", topics[4], topics[2]);
+            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+        }
 
-            uint32_t state = strtoul(tempString, NULL, 0);
 
-            if ( state > 2) {
-                log4c_category_error(clientlog, "state must be between 0 and 2, got %d",
-                                     state);
-                return;
-            }
+    } else if (strcmp(MQTT_TOPIC_GROUP, topics[MQTT_TOPIC_DEVICE_INDEX]) == 0
+               && topic_count > MQTT_TOPIC_GROUP_NAME_INDEX) {
+
+        groupCommand(topics, topic_count, message);
+        mosquitto_sub_topic_tokens_free(&topics, topic_count);
+
+    } else if (strcmp(MQTT_TOPIC_GATEWAY, topics[MQTT_TOPIC_DEVICE_INDEX]) == 0
+               && topic_count == MQTT_TOPIC_GATEWAY_COUNT
+               && strcmp(MQTT_TOPIC_HEARD, topics[MQTT_TOPIC_COMMAND_INDEX]) == 0) {
+
+        int sensorId = atoi(topics[MQTT_TOPIC_GATEWAY_SENSORID_INDEX]);
+
+        mosquitto_sub_topic_tokens_free(&topics, topic_count);
+        if (sensorId != 0) {
+            recordHeard(sensorId, message->payload, message->payloadlen);
+        }
+
+    } else if (strcmp(MQTT_TOPIC_GATEWAY, topics[MQTT_TOPIC_DEVICE_INDEX]) == 0
+               && topic_count == MQTT_TOPIC_GATEWAY_COUNT
+               && strcmp(MQTT_TOPIC_RESULT, topics[MQTT_TOPIC_COMMAND_INDEX]) == 0) {
+
+        int sensorId = atoi(topics[MQTT_TOPIC_GATEWAY_SENSORID_INDEX]);
+
+        mosquitto_sub_topic_tokens_free(&topics, topic_count);
+        if (sensorId != 0) {
+            dropRemoteCommand(sensorId, message->payload, message->payloadlen);
+        }
+
+    } else if (strcmp(MQTT_TOPIC_SIMULATE, topics[MQTT_TOPIC_DEVICE_INDEX]) == 0
+               && topic_count == MQTT_TOPIC_SIMULATE_COUNT
+               && strcmp(MQTT_TOPIC_ETRV, topics[MQTT_TOPIC_COMMAND_INDEX]) == 0) {
+
+        int sensorId = atoi(topics[MQTT_TOPIC_SIMULATE_SENSORID_INDEX]);
+
+        mosquitto_sub_topic_tokens_free(&topics, topic_count);
+        if (sensorId <= 0 || sensorId > 0xffffff) {
+            log4c_category_error(clientlog, "Simulated sensorId must be from 1 to %d", 0xffffff);
+            return;
+        }
+        simulateReport(sensorId, message->payload, message->payloadlen);
+
+    }else{
+        log4c_category_warn(clientlog, 
+                           "Can't handle messages for %s yet", topics[2]);
+    }
+
+}
+
+void my_connect_callback(struct mosquitto *mosq, void *userdata, int result)
+{
+    const struct config *config = configGet();
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+
+    log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "%s", __FUNCTION__);
+
+    if(!result){
+        ledBrokerConnected(true);
+        if (brokerConnected) {
+            log4c_category_log(clientlog, LOG4C_PRIORITY_NOTICE, 
+                               "Reconnected to broker at %s", config->brokerHost);
+        } else {
+            struct timespec now;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            log4c_category_log(clientlog, LOG4C_PRIORITY_NOTICE, 
+                               "Connected to broker at %s after %lldms", config->brokerHost,
+                               (long long)elapsedMicroseconds(&startTime, &now) / 1000);
+            brokerConnected = true;
+        }
+        /* Subscribe to broker information topics on successful connect. */
+        snprintf(topic, sizeof(topic), "/%s/%s/#", config->topicBase, MQTT_TOPIC_ENER002_COMMAND);
+        mosquitto_subscribe(mosq, NULL, topic, 2);
+
+        snprintf(topic, sizeof(topic), "/%s/%s/#", config->topicBase, MQTT_TOPIC_ETRV_COMMAND);
+        mosquitto_subscribe(mosq, NULL, topic, 2);
+
+        snprintf(topic, sizeof(topic), "/%s/%s/#", config->topicBase, MQTT_TOPIC_GROUP);
+        mosquitto_subscribe(mosq, NULL, topic, 2);
+
+        if (config->gatewayId[0] != '\0') {
+            snprintf(topic, sizeof(topic), "/%s/%s/#", config->topicBase, 
+                     MQTT_TOPIC_GATEWAY_HEARD);
+            mosquitto_subscribe(mosq, NULL, topic, 0);
+
+            snprintf(topic, sizeof(topic), "/%s/%s/#", config->topicBase, 
+                     MQTT_TOPIC_GATEWAY_RESULT);
+            mosquitto_subscribe(mosq, NULL, topic, 1);
+        }
+
+        if (simulate_radio) {
+            snprintf(topic, sizeof(topic), "/%s/%s/#", config->topicBase, 
+                     MQTT_TOPIC_SIMULATE_ETRV);
+            mosquitto_subscribe(mosq, NULL, topic, 0);
+        }
+    }else{
+        log4c_category_log(clientlog, LOG4C_PRIORITY_WARN, 
+                           "Connect Failed with error %d", result);
+    }
+}
+
+/* With MQTT v5, finds how many topic aliases the broker allows on this
+ * connection, before anything is published on it.
+ */
+void my_connect_v5_callback(struct mosquitto *mosq, void *userdata, int result, int flags,
+                            const mosquitto_property *properties)
+{
+    uint16_t maximum = 0;
+
+    if (!result) {
+        mosquitto_property_read_int16(properties, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &maximum, false);
+        log4c_category_info(clientlog, "Broker allows %d topic aliases", maximum);
+        resetTopicAliases(maximum);
+    }
+    my_connect_callback(mosq, userdata, result);
+}
+
+void my_disconnect_callback(struct mosquitto *mosq, void *userdata, int result)
+{
+    ledBrokerConnected(false);
+    resetTopicAliases(0);
+}
+
+void my_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid,
+                           int qos_count, const int *granted_qos)
+{
+    log4c_category_log(clientlog, LOG4C_PRIORITY_NOTICE, 
+                       "Subscribed (mid: %d): %d", mid, granted_qos[0]);
+}
+
+void my_log_callback(struct mosquitto *mosq, void *userdata, int level, 
+                     const char *str)
+{
+    log4c_priority_level_t priority;
+
+    switch (level) {
+        case  MOSQ_LOG_INFO:
+            priority = LOG4C_PRIORITY_INFO;
+            break;
+
+        case	MOSQ_LOG_NOTICE:
+            priority = LOG4C_PRIORITY_NOTICE;
+            break;
+        case	MOSQ_LOG_WARNING:
+            priority = LOG4C_PRIORITY_WARN;
+            break;
+
+        case	MOSQ_LOG_ERR:
+            priority = LOG4C_PRIORITY_ERROR;
+            break;
+
+        case	MOSQ_LOG_DEBUG:
+            priority = LOG4C_PRIORITY_DEBUG;
+            break;
+
+        default:
+            priority = LOG4C_PRIORITY_WARN;
+            break;
+    }
+
+    log4c_category_log(stacklog, priority, "%s", str);
+}
+
+/* Copies a string option into a config string */
+static bool setStringOption(char *value, const char *arg, const char *name) {
+
+    if (strlen(arg) >= CONFIG_STRING_LENGTH) {
+        log4c_category_crit(clientlog, "%s must be less than %d characters", 
+                            name, CONFIG_STRING_LENGTH);
+        return false;
+    }
+    strcpy(value, arg);
+    return true;
+}
+
+/* Applies a command line option to config */
+static bool applyOption(int c, const char *arg, struct config *config) {
+
+    switch (c) {
+        case 'r':
+            config->repeatSend = atoi(arg);
+            if (config->repeatSend == 0) {
+                log4c_category_crit(clientlog, "repeat_send must be an integer");
+                return false;
+            }
+            break;
+        case 'R':
+            config->retryLimit = atoi(arg);
+            if (config->retryLimit < 0) {
+                log4c_category_crit(clientlog, "retry_limit must not be negative");
+                return false;
+            }
+            break;
+        case 'm':
+            config->maxCommands = atoi(arg);
+            if (config->maxCommands < 0) {
+                log4c_category_crit(clientlog, "max_commands must not be negative");
+                return false;
+            }
+            break;
+        case 'd':
+            config->dutyCycle = atof(arg);
+            if (config->dutyCycle <= 0 || config->dutyCycle > 100) {
+                log4c_category_crit(clientlog, "duty cycle must be a percentage");
+                return false;
+            }
+            break;
+        case 'h':
+            return setStringOption(config->brokerHost, arg, "host");
+        case 'p':
+            config->brokerPort = atoi(arg);
+            break;
+        case 'u':
+            return setStringOption(config->brokerUser, arg, "username");
+        case 'P':
+            return setStringOption(config->brokerPass, arg, "password");
+        case 'g':
+            if (strpbrk(arg, "/+#") != NULL) {
+                log4c_category_crit(clientlog, "gateway must not contain / + or #");
+                return false;
+            }
+            return setStringOption(config->gatewayId, arg, "gateway");
+        default:
+            log4c_category_crit(clientlog, "Invalid parameter");
+            return false;
+    }
+    return true;
+}
+
+/* Builds the configuration from the defaults, the configuration file
+ * if there is one, then the command line options, which take precedence.
+ */
+static bool buildConfig(struct config *config) {
+
+    struct config defaults;
+    int i;
+
+    configDefaults(&defaults);
+    if (config_path == NULL) {
+        *config = defaults;
+    } else if (!configLoad(config_path, &defaults, config)) {
+        return false;
+    }
+
+    for (i = 0; i < optionCount; ++i) {
+        if (!applyOption(options[i].opt, options[i].arg, config)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Reloads the configuration file, on SIGHUP.  The radio loop picks up
+ * the new configuration between frames.
+ */
+static void reloadConfig(void) {
+
+    struct config config;
+
+    log4c_category_notice(clientlog, "Reloading configuration from %s", config_path);
+    if (!buildConfig(&config)) {
+        log4c_category_error(clientlog, "Configuration not reloaded");
+        return;
+    }
+
+    if (configKeepStartupSettings(configGet(), &config)) {
+        log4c_category_warn(clientlog, 
+                            "Broker and topic settings are only changed by a restart");
+    }
+    configPublish(&config);
+}
+
+/* Waits for SIGHUP, unless the reactor is handling it */
+static void *configThread(void *arg) {
+
+    sigset_t *signals = arg;
+    int signal;
+
+    while (sigwait(signals, &signal) == 0) {
+        reloadConfig();
+    }
+    return NULL;
+}
+
+/* Prepares the replies to every sensor again, when the configuration
+ * they were made with has changed.
+ */
+static void restageAllReplies(void) {
+
+    struct sensor *sensor;
+
+    pthread_mutex_lock(&sensorListMutex);
+    for (sensor = sensorTableHead.tqh_first; sensor != NULL; sensor = sensor->sensors.tqe_next) {
+        stageReply(sensor);
+    }
+    pthread_mutex_unlock(&sensorListMutex);
+}
+
+/* Converts a CLOCK_MONOTONIC time in the recent past to the wall clock */
+static void toWallClock(const struct timespec *monotonic, struct timespec *wall) {
 
-            addCommandToSend(intSensorId, OT_SET_VALVE_STATE, state);
+    struct timespec now;
+    int64_t agoUs;
 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    agoUs = elapsedMicroseconds(monotonic, &now);
+    clock_gettime(CLOCK_REALTIME, wall);
+    wall->tv_sec -= agoUs / 1000000;
+    wall->tv_nsec -= (agoUs % 1000000) * 1000;
+    if (wall->tv_nsec < 0) {
+        wall->tv_sec--;
+        wall->tv_nsec += 1000000000L;
+    }
+}
 
-        } else if (strcmp(MQTT_TOPIC_POWER_MODE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
-            // Send set valve state command to eTRV
-            int sensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
+/* Answers and reports a frame decoded from radio */
+static void handleMessage(struct hrfRadio *radio, const struct ReceivedMsgData *msgData,
+                          const struct config *config) {
+
+    static bool firstFrame = true;
+    struct report report;
+    bool owned;
+    bool eTRV = msgData->manufId == config->manufacturerId 
+        && msgData->prodId == config->eTRVProductId;
+
+    if (firstFrame) {
+        log4c_category_notice(clientlog, "%s start, first frame received after %lldms",
+                              warmStart ? "Warm" : "Cold",
+                              (long long)elapsedMicroseconds(&startTime, &msgData->receivedTime) / 1000);
+        firstFrame = false;
+    }
 
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+    memset(&report, 0, sizeof(report));
+    toWallClock(&msgData->receivedTime, &report.receivedTime);
 
-            if (sensorId == 0) {
-                // Assume 0 isn't valid sensor id
-                log4c_category_error(clientlog, "SensorId must be an integer: %d", sensorId);
-                return;
-            }
+    if (msgData->joinCommand) {
+        if (eTRV) {
 
-            if (message->payloadlen != 1) {
-                log4c_category_error(clientlog, "Payload for set valve state must be 1"
-                                                "digit in length");
-                return;
-            }
+            /* We got a join request for an eTRV */
+            log4c_category_debug(clientlog, "send Join response for sensorId %d", msgData->sensorId);
 
-            char tempString[message->payloadlen+1];
-            strncpy(tempString, message->payload, message->payloadlen);
-            tempString[message->payloadlen] = '\0';
+            uint8_t *joinResponse = HRF_make_FSK_msg(msgData->manufId, config->eTRVEncryptId, 
+                                                     msgData->prodId, msgData->sensorId,
+                                                     2, OT_JOIN_RESP, 0);
+            struct timespec now;
 
-            uint32_t powerMode = strtoul(tempString, NULL, 0);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            captureFrame(CAPTURE_SENT, &now, 0, joinResponse + 1, config->eTRVEncryptId);
+            HRF_send_FSK_msg(radio, joinResponse);
+            airtimeRequest(BAND_FSK_434, HRF_FSK_AIRTIME_US(MSG_OVERHEAD_LEN + 2), false);
+        } else {
+            log4c_category_notice(clientlog, 
+                                  "Received Join message for ManufacturerId:%d ProductId:%d SensorId:%d", 
+                                  msgData->manufId, msgData->prodId, msgData->sensorId);
+        }
+    }
 
-            if ( powerMode > 1) {
-                log4c_category_error(clientlog, "Power Mode must be between 0 or 1, got %d",
-                                     powerMode);
-                return;
+    recordLinkQuality(msgData, &report);
+    owned = claimSensor(msgData, &report, config);
+    confirmCommands(msgData, &report);
+
+    // Only eTRVs are replied to, other products' reports are just published
+    if (msgData->receivedTempReport && owned && eTRV) {
+        uint8_t replyFrame[MAX_FIFO_SIZE];
+        uint8_t recordsLen;
+        int commandCount;
+        struct timespec txStarted;
+
+        commandCount = takeReplyToSend(msgData->sensorId, replyFrame, 
+                                       &report, &recordsLen);
+        if (commandCount >= 0) {
+            HRF_send_FSK_frame(radio, replyFrame, &txStarted);
+            captureFrame(CAPTURE_SENT, &txStarted, 0, replyFrame + 1, config->eTRVEncryptId);
+            airtimeRequest(BAND_FSK_434, HRF_FSK_AIRTIME_US(replyFrame[MSG_REMAINING_LEN+1]),
+                           false);
+
+            if (commandCount > 0) {
+                log4c_category_debug(clientlog, "Sent %d commands in %d bytes to device %d",
+                                     commandCount, recordsLen, msgData->sensorId);
+            } else {
+                log4c_category_debug(clientlog, "sent NIL command for sensorId %d", msgData->sensorId);
             }
 
-            addCommandToSend(sensorId, OT_SET_LOW_POWER_MODE, powerMode);
+            recordReplyStatistics(commandCount, recordsLen, 
+                                  elapsedMicroseconds(&msgData->receivedTime, &txStarted));
+            restageReply(msgData->sensorId);
+        }
 
-        } else if (strcmp(MQTT_TOPIC_REPORTING_INTERVAL, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
-            // Send set valve state command to eTRV
-            int sensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
+        report.flags |= REPORT_TEMPERATURE;
+        strncpy(report.temperature, msgData->receivedTemperature, REPORT_VALUE_LENGTH - 1);
+    }
 
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+    if (msgData->receivedDiagnostics) {
+        report.flags |= REPORT_DIAGNOSTICS;
+        memcpy(report.diagnosticData, msgData->diagnosticData, sizeof(report.diagnosticData));
+    }
 
-            if (sensorId == 0) {
-                // Assume 0 isn't valid sensor id
-                log4c_category_error(clientlog, "SensorId must be an integer: %d", sensorId);
-                return;
-            }
+    if (msgData->receivedVoltage) {
+        report.flags |= REPORT_VOLTAGE;
+        strncpy(report.voltage, msgData->voltageData, REPORT_VALUE_LENGTH - 1);
+    }
 
-            if (message->payloadlen > 5 || message->payloadlen < 1) {
-                log4c_category_error(clientlog, "Payload for set reporting interval must be 1 and 5"
-                                                "digits in length");
-                return;
-            }
+    if (config->cborReports != CBOR_OFF || config->batchEntries > 0) {
+        if (config->cborReports != CBOR_OFF) {
+            report.flags |= REPORT_FRAME;
+        }
+        report.frame.sensorId = msgData->sensorId;
+        report.frame.time = report.receivedTime.tv_sec;
+        report.frame.manufId = msgData->manufId;
+        report.frame.prodId = msgData->prodId;
+        report.frame.rssi = msgData->rssi;
+        report.frame.fei = msgData->fei;
+        report.frame.recordCount = msgData->recordCount;
+        memcpy(report.frame.records, msgData->records, 
+               msgData->recordCount * sizeof(struct otRecord));
+    }
 
-            char tempString[message->payloadlen+1];
-            strncpy(tempString, message->payload, message->payloadlen);
-            tempString[message->payloadlen] = '\0';
+    if (!owned) {
+        // The owner replies and publishes, only say how well it was heard here
+        report.flags &= REPORT_HEARD;
+        gatewayStats.reportsSuppressed++;
+    } else {
+        aggregateRecords(msgData, config, report.receivedTime.tv_sec);
+        if (!config->rawReports && config->aggregateWindowCount > 0) {
+            report.flags &= ~(REPORT_TEMPERATURE | REPORT_VOLTAGE);
+        }
+        if (config->batchEntries > 0 && (report.flags & REPORT_BATCHED)) {
+            report.batchedTopics = __builtin_popcount(report.flags & REPORT_BATCHED);
+            report.flags = (report.flags & ~REPORT_BATCHED) | REPORT_BATCH;
+        }
+    }
 
-            uint32_t reportingInterval = strtoul(tempString, NULL, 0);
+    if (report.flags) {
+        report.sensorId = msgData->sensorId;
+        queueReport(&report);
+    }
+}
 
-            if ( reportingInterval > 3600 || reportingInterval < 300) {
-                log4c_category_error(clientlog, "Power Mode must be between 300 and 3600, got %d",
-                                     reportingInterval);
-                return;
-            }
+/* Reads a frame from radio into the ring, if there is one waiting.
+ * The FIFO is emptied even when the ring is full, losing the frame.
+ * Returns true if a frame was read.
+ */
+static bool readFrame(struct hrfRadio *radio) {
 
-            addCommandToSend(sensorId, OT_SET_REPORTING_INTERVAL, reportingInterval);
+    static struct hrfFrame overflow;
+    unsigned tail = frameRing.tail;
+    unsigned head = __atomic_load_n(&frameRing.head, __ATOMIC_ACQUIRE);
+    bool full = (tail - head == FRAME_RING_SIZE);
 
+    if (!HRF_read_FSK_frame(radio, full ? &overflow : &frameRing.frames[tail % FRAME_RING_SIZE])) {
+        return false;
+    }
 
-        } else if (strcmp(MQTT_TOPIC_DIAGNOSTICS, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+    if (full) {
+        frameRing.full++;
+        ledEvent(LED_ERROR);
+        return true;
+    }
+    if (tail + 1 - head > frameRing.maxDepth) {
+        frameRing.maxDepth = tail + 1 - head;
+    }
+    __atomic_store_n(&frameRing.tail, tail + 1, __ATOMIC_RELEASE);
+    if (!reactor_mode) {
+        sem_post(&frameRing.ready);
+    }
+    return true;
+}
 
-            int sensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
+/* Decodes the oldest frame in the ring, read from radio, and deals 
+ * with it.  There must be one.
+ */
+static void decodeFrame(struct hrfRadio *radio) {
 
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+    struct ReceivedMsgData msgData;
+    const struct config *config = configGet();
+    unsigned head = frameRing.head;
+    const struct hrfFrame *frame = &frameRing.frames[head % FRAME_RING_SIZE];
+    const struct otProduct *product = configFindProduct(config, 
+                                                        frame->data[1 + MSG_MANUF_ID],
+                                                        frame->data[1 + MSG_PRODUCT_ID]);
 
+    captureFrame(CAPTURE_RECEIVED, &frame->receivedTime, frame->rssi, frame->data + 1,
+                 product ? product->encryptId : config->eTRVEncryptId);
 
-            if (sensorId == 0) {
-                // Assume 0 isn't valid sensor id
-                log4c_category_error(clientlog, "SensorId must be an integer: %s", 
-                                     topics[MQTT_TOPIC_SENSORID_INDEX]);
-                return;
-            }
+    memset(&msgData, 0, sizeof(msgData));
+    HRF_decode_FSK_frame(radio, frame, config->products, config->productCount, &msgData);
+    __atomic_store_n(&frameRing.head, head + 1, __ATOMIC_RELEASE);
 
-            addCommandToSend(sensorId, OT_REQUEST_DIAGNOTICS, 0);
-            
-        } else if (strcmp(MQTT_TOPIC_EXERCISE_VALVE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+    if (msgData.msgAvailable) {
+        handleMessage(radio, &msgData, config);
+    } else if (msgData.crcFailed) {
+        recordLinkQuality(&msgData, NULL);
+    }
+}
 
-            int intSensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
+/* Decodes the frames read from radio and deals with them */
+static void *decoderThread(void *arg) {
 
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+    struct hrfRadio *radio = arg;
 
+    while (1) {
+        while (sem_wait(&frameRing.ready) != 0) {
+            // Interrupted, wait again
+        }
+        decodeFrame(radio);
+    }
+    return NULL;
+}
 
-            if (intSensorId == 0) {
-                // Assume 0 isn't valid sensor id
-                log4c_category_error(clientlog, "SensorId must be an integer: %s", 
-                                     topics[MQTT_TOPIC_SENSORID_INDEX]);
-                return;
-            }
+/* Puts a new configuration, published by a reload, into use */
+static void applyConfigChanges(void) {
 
-            addCommandToSend(intSensorId, OT_EXERCISE_VALVE, 0);
-            
-        } else if (strcmp(MQTT_TOPIC_VOLTAGE, topics[MQTT_TOPIC_TYPE_INDEX]) == 0) {
+    static unsigned configGeneration = 0;       // The first configuration is 0
+    const struct config *config = configGet();
 
-            int intSensorId = atoi(topics[MQTT_TOPIC_SENSORID_INDEX]);
+    if (config->generation != configGeneration) {
+        log4c_category_notice(clientlog, "Applying configuration %u", config->generation);
+        configGeneration = config->generation;
+        airtimeSetDutyCycle(config->dutyCycle);
+        restageAllReplies();
+    }
+}
 
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
+/* In reactor mode everything runs on the main thread from one epoll loop:
+ * the broker socket, the radio's DIO0 interrupt, SIGHUP and timers for 
+ * ENER002 bursts and statistics.  Without DIO0 the radio is polled from
+ * a timer instead, and with it the timer is a slower backstop in case an 
+ * edge is missed.  ENER002 bursts are sent in steps from the OOK timer,
+ * which must run well within HRF_OOK_FIFO_DRAIN_US, so the loop carries
+ * on while one is on the air.  The locks shared with threaded mode are
+ * still taken, but are never contended.
+ */
+#define REACTOR_RADIO_POLL_MS 5
+#define REACTOR_RADIO_BACKSTOP_MS 250
+#define REACTOR_OOK_POLL_MS 5
+#define REACTOR_RECONNECT_SECONDS 5
+#define REACTOR_MAX_EVENTS 8
+
+enum reactorSource {
+    SOURCE_BROKER,
+    SOURCE_RADIO_IRQ,
+    SOURCE_RADIO_TIMER,
+    SOURCE_OOK_TIMER,
+    SOURCE_STATISTICS_TIMER,
+    SOURCE_AGGREGATE_TIMER,
+    SOURCE_BATCH_TIMER,
+    SOURCE_LED_TIMER,
+    SOURCE_EXPIRY_TIMER,
+    SOURCE_SIGNAL
+};
 
+static int createTimer(long intervalMs) {
 
-            if (intSensorId == 0) {
-                // Assume 0 isn't valid sensor id
-                log4c_category_error(clientlog, "SensorId must be an integer: %s", 
-                                     topics[MQTT_TOPIC_SENSORID_INDEX]);
-                return;
-            }
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec spec;
 
-            addCommandToSend(intSensorId, OT_REQUEST_VOLTAGE, 0);
-            
-        } else {
-            log4c_category_warn(clientlog, 
-                           "Can't handle %s commands for %s yet", topics[4], topics[2]);
-            mosquitto_sub_topic_tokens_free(&topics, topic_count);
-        }
+    if (fd >= 0) {
+        spec.it_interval.tv_sec = intervalMs / 1000;
+        spec.it_interval.tv_nsec = (intervalMs % 1000) * 1000000L;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(fd, 0, &spec, NULL);
+    }
+    return fd;
+}
 
+static void setTimer(int fd, bool run, long intervalMs) {
 
-    }else{
-        log4c_category_warn(clientlog, 
-                           "Can't handle messages for %s yet", topics[2]);
-    }
+    struct itimerspec spec;
 
+    memset(&spec, 0, sizeof(spec));
+    if (run) {
+        spec.it_interval.tv_sec = intervalMs / 1000;
+        spec.it_interval.tv_nsec = (intervalMs % 1000) * 1000000L;
+        spec.it_value = spec.it_interval;
+    }
+    timerfd_settime(fd, 0, &spec, NULL);
 }
 
-void my_connect_callback(struct mosquitto *mosq, void *userdata, int result)
-{
-    log4c_category_log(clientlog, LOG4C_PRIORITY_TRACE, "%s", __FUNCTION__);
+static bool watch(int epoll, int fd, uint32_t events, enum reactorSource source) {
 
-    if(!result){
-        log4c_category_log(clientlog, LOG4C_PRIORITY_NOTICE, 
-                           "Connected to broker at %s", mqttBrokerHost);
-        /* Subscribe to broker information topics on successful connect. */
-        mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_ENER002_COMMAND "/#", 2);
+    struct epoll_event event;
 
-        mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_ETRV_COMMAND "/#", 2);
-    }else{
-        log4c_category_log(clientlog, LOG4C_PRIORITY_WARN, 
-                           "Connect Failed with error %d", result);
+    if (fd < 0) {
+        return false;
     }
+    event.events = events;
+    event.data.u32 = source;
+    return epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == 0;
 }
 
-void my_subscribe_callback(struct mosquitto *mosq, void *userdata, int mid,
-                           int qos_count, const int *granted_qos)
-{
-    log4c_category_log(clientlog, LOG4C_PRIORITY_NOTICE, 
-                       "Subscribed (mid: %d): %d", mid, granted_qos[0]);
+static void clearTimer(int fd) {
+
+    uint64_t expirations;
+
+    while (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        // Only the wakeup matters
+    }
 }
 
-void my_log_callback(struct mosquitto *mosq, void *userdata, int level, 
-                     const char *str)
-{
-    log4c_priority_level_t priority;
+static bool ookQueued(void) {
 
-    switch (level) {
-        case  MOSQ_LOG_INFO:
-            priority = LOG4C_PRIORITY_INFO;
-            break;
+    bool queued;
 
-        case	MOSQ_LOG_NOTICE:
-            priority = LOG4C_PRIORITY_NOTICE;
-            break;
-        case	MOSQ_LOG_WARNING:
-            priority = LOG4C_PRIORITY_WARN;
-            break;
+    pthread_mutex_lock(&ookListMutex);
+    queued = (ookListHead.tqh_first != NULL);
+    pthread_mutex_unlock(&ookListMutex);
+    return queued;
+}
 
-        case	MOSQ_LOG_ERR:
-            priority = LOG4C_PRIORITY_ERROR;
-            break;
+/* Runs the gateway from one epoll loop, never returning unless it can't
+ * be set up.  signals are those left for the loop to handle, or NULL.
+ */
+static int runReactor(struct mosquitto *mosq, const sigset_t *signals) {
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct report report;
+    int epoll;
+    int irq;
+    int radioTimer;
+    int ookTimer;
+    int statisticsTimer;
+    int aggregateTimer;
+    int batchTimer;
+    int ledTimer;
+    int expiryTimer;
+    int signals_fd = -1;
+    int brokerFd = -1;
+    uint32_t brokerEvents = 0;
+    struct ookRequest *ookSending = NULL;      // Burst on the air, if any
+    struct hrfOOKBurst ookBurst;
+    bool ookTimerRunning = false;
+    bool batchTimerRunning = false;
+    time_t lastReconnect = 0;
+    int count;
+    int i;
 
-        case	MOSQ_LOG_DEBUG:
-            priority = LOG4C_PRIORITY_DEBUG;
-            break;
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0) {
+        log4c_category_crit(clientlog, "epoll_create1 failed: %s", strerror(errno));
+        return ERROR_REACTOR_START;
+    }
 
-        default:
-            priority = LOG4C_PRIORITY_WARN;
-            break;
+    irq = HRF_open_irq(&fskRadio);
+    if (irq >= 0) {
+        watch(epoll, irq, EPOLLIN, SOURCE_RADIO_IRQ);
+        radioTimer = createTimer(REACTOR_RADIO_BACKSTOP_MS);
+    } else {
+        log4c_category_notice(clientlog, "No DIO0 interrupt, polling the radio every %dms",
+                              REACTOR_RADIO_POLL_MS);
+        radioTimer = createTimer(REACTOR_RADIO_POLL_MS);
+    }
+    ookTimer = createTimer(0);
+    statisticsTimer = createTimer(STATISTICS_INTERVAL * 1000L);
+    aggregateTimer = createTimer(AGGREGATE_SWEEP_SECONDS * 1000L);
+    batchTimer = createTimer(0);
+    ledTimer = createTimer(LED_TICK_MS);
+    expiryTimer = createTimer(COMMAND_EXPIRY_CHECK_SECONDS * 1000L);
+    if (signals != NULL) {
+        signals_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
     }
 
-    log4c_category_log(stacklog, priority, "%s", str);
+    if (!watch(epoll, radioTimer, EPOLLIN, SOURCE_RADIO_TIMER) 
+        || !watch(epoll, ookTimer, EPOLLIN, SOURCE_OOK_TIMER)
+        || !watch(epoll, statisticsTimer, EPOLLIN, SOURCE_STATISTICS_TIMER)
+        || !watch(epoll, aggregateTimer, EPOLLIN, SOURCE_AGGREGATE_TIMER)
+        || !watch(epoll, batchTimer, EPOLLIN, SOURCE_BATCH_TIMER)
+        || !watch(epoll, ledTimer, EPOLLIN, SOURCE_LED_TIMER)
+        || !watch(epoll, expiryTimer, EPOLLIN, SOURCE_EXPIRY_TIMER)
+        || (signals != NULL && !watch(epoll, signals_fd, EPOLLIN, SOURCE_SIGNAL))) {
+        log4c_category_crit(clientlog, "Unable to set up reactor: %s", strerror(errno));
+        return ERROR_REACTOR_START;
+    }
+
+    log4c_category_notice(clientlog, "Running in reactor mode");
+
+    while (1) {
+        int socket = mosquitto_socket(mosq);
+        uint32_t wanted = EPOLLIN | (mosquitto_want_write(mosq) ? EPOLLOUT : 0);
+
+        // The broker socket changes on reconnection, and only wants writing when there's output
+        if (socket != brokerFd) {
+            if (brokerFd >= 0) {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, brokerFd, NULL);
+            }
+            brokerFd = socket;
+            brokerEvents = wanted;
+            watch(epoll, brokerFd, brokerEvents, SOURCE_BROKER);
+        } else if (socket >= 0 && wanted != brokerEvents) {
+            struct epoll_event event = { .events = wanted, .data.u32 = SOURCE_BROKER };
+
+            brokerEvents = wanted;
+            epoll_ctl(epoll, EPOLL_CTL_MOD, brokerFd, &event);
+        }
+
+        if ((ookSending != NULL || ookQueued()) != ookTimerRunning) {
+            ookTimerRunning = !ookTimerRunning;
+            setTimer(ookTimer, ookTimerRunning, REACTOR_OOK_POLL_MS);
+        }
+        if ((batch.count > 0) != batchTimerRunning) {
+            batchTimerRunning = !batchTimerRunning;
+            setTimer(batchTimer, batchTimerRunning, BATCH_POLL_MS);
+        }
+
+        count = epoll_wait(epoll, events, REACTOR_MAX_EVENTS, 1000);
+
+        for (i = 0; i < count; ++i) {
+            switch (events[i].data.u32) {
+                case SOURCE_BROKER:
+                    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                        mosquitto_loop_read(mosq, 1);
+                    }
+                    if (events[i].events & EPOLLOUT) {
+                        mosquitto_loop_write(mosq, 1);
+                    }
+                    break;
+
+                case SOURCE_RADIO_IRQ:
+                    HRF_ack_irq(irq);
+                    // Falls through to read the frame
+                case SOURCE_RADIO_TIMER:
+                    clearTimer(radioTimer);
+                    if (ookSending != NULL && ookSender == &fskRadio) {
+                        break;              // Nothing to read until the burst is sent
+                    }
+                    while (readFrame(&fskRadio)) {
+                        if (frameRing.head != frameRing.tail) {
+                            decodeFrame(&fskRadio);
+                        }
+                    }
+                    while (takeReport(&report, 0)) {
+                        publishReport(mosq, &report);
+                    }
+                    break;
+
+                case SOURCE_OOK_TIMER:
+                    clearTimer(ookTimer);
+                    if (ookSending == NULL) {
+                        ookSending = takeQueuedOOK(ookSender);
+                        if (ookSending != NULL 
+                            && !HRF_start_OOK_msg(ookSender, &ookBurst, ookSending->address,
+                                                  ookSending->socketNum, ookSending->onOff,
+                                                  configGet()->repeatSend)) {
+                            finishOOK(ookSending);
+                            ookSending = NULL;
+                        }
+                    } else if (HRF_continue_OOK_msg(ookSender, &ookBurst)) {
+                        finishOOK(ookSending);
+                        ookSending = NULL;
+                    }
+                    break;
+
+                case SOURCE_STATISTICS_TIMER:
+                    clearTimer(statisticsTimer);
+                    logStatistics();
+                    break;
+
+                case SOURCE_EXPIRY_TIMER:
+                    clearTimer(expiryTimer);
+                    expireCommands();
+                    while (takeReport(&report, 0)) {
+                        publishReport(mosq, &report);
+                    }
+                    break;
+
+                case SOURCE_LED_TIMER:
+                    clearTimer(ledTimer);
+                    ledTick();
+                    break;
+
+                case SOURCE_BATCH_TIMER:
+                    clearTimer(batchTimer);
+                    flushBatch(mosq, false);
+                    break;
+
+                case SOURCE_AGGREGATE_TIMER:
+                    clearTimer(aggregateTimer);
+                    sweepAggregates();
+                    while (takeReport(&report, 0)) {
+                        publishReport(mosq, &report);
+                    }
+                    break;
+
+                case SOURCE_SIGNAL: {
+                    struct signalfd_siginfo info;
+
+                    while (read(signals_fd, &info, sizeof(info)) == sizeof(info)) {
+                        reloadConfig();
+                    }
+                    break;
+                }
+            }
+        }
+
+        applyConfigChanges();
+
+        if (mosquitto_loop_misc(mosq) == MOSQ_ERR_NO_CONN 
+            && time(NULL) - lastReconnect >= REACTOR_RECONNECT_SECONDS) {
+            lastReconnect = time(NULL);
+            log4c_category_info(clientlog, "Reconnecting to broker");
+            mosquitto_reconnect_async(mosq);
+        }
+    }
+    return 0;
 }
 
 // receive in variable length packet mode, display and resend. Data with swapped first 2 bytes
 int main(int argc, char **argv){
     		
     struct mosquitto *mosq = NULL;
-    struct ReceivedMsgData msgData;
     int c;
+    time_t nextStatisticsTime;
+    time_t nextAggregateTime;
+    time_t nextExpiryTime;
+    pthread_t publisher;
+    pthread_t reloader;
+    pthread_t ookThread;
+    pthread_t decoder;
+    static sigset_t reloadSignals;
+    const struct config *config;
+    char clientId[CONFIG_STRING_LENGTH + 32];
+    struct timespec radioReadyTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
 	
     if (log4c_init()) {
         fprintf(stderr, "log4c_init() failed");
@@ -691,93 +4405,142 @@ int main(int argc, char **argv){
     clientlog = log4c_category_get("MQTTClient");
     stacklog = log4c_category_get("MQTTStack");
     hrflog = log4c_category_get("hrf");
+    journallog = log4c_category_get("journal");
+    capturelog = log4c_category_get("capture");
+
+    configlog = log4c_category_get("config");
 
-    while ((c = getopt (argc, argv, "r:h:p:u:P:")) != -1) {
+    while ((c = getopt (argc, argv, "Sec:r:R:d:m:j:w:g:h:p:u:P:")) != -1) {
         switch (c) {
-            case 'r':
-                repeat_send = atoi(optarg);
-                if (repeat_send == 0) {
-                    log4c_category_crit(clientlog, "repeat_send must be an integer");
-                    return ERROR_INVALID_PARAM;
-                }
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
+            case 'S':
+                simulate_radio = true;
                 break;
-	    // hack basic support for overriding host and port
-	    case 'h':
-		mqttBrokerHost = optarg;
-		break;
-            case 'p':
-		mqttBrokerPort = atoi(optarg);
-	        break;
-            case 'u':
-                mqttBrokerUser = optarg;
+            case 'e':
+                reactor_mode = true;
                 break;
-            case 'P':
-                mqttBrokerPass = optarg;
+            case 'w':
+                capture_path = optarg;
                 break;
             default:
-                log4c_category_crit(clientlog, "Invalid parameter");
-                return ERROR_INVALID_PARAM;
+                if (optionCount == MAX_OPTIONS) {
+                    log4c_category_crit(clientlog, "Too many parameters");
+                    return ERROR_INVALID_PARAM;
+                }
+                options[optionCount].opt = c;
+                options[optionCount].arg = optarg;
+                optionCount++;
+                break;
+        }
+    }
+
+    {
+        struct config startupConfig;
+
+        if (!buildConfig(&startupConfig)) {
+            return ERROR_INVALID_PARAM;
+        }
+        configPublish(&startupConfig);
+        airtimeSetDutyCycle(startupConfig.dutyCycle);
+    }
+
+    if (config_path != NULL) {
+        // Blocked before any other thread starts, so they all leave it to configThread
+        sigemptyset(&reloadSignals);
+        sigaddset(&reloadSignals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &reloadSignals, NULL);
+    }
+
+    if (config_path != NULL && !reactor_mode) {
+        if ((err = pthread_create(&reloader, NULL, configThread, &reloadSignals)) != 0) {
+            log4c_category_crit(clientlog, "Config thread start failed: %d", err);
+            return ERROR_CONFIG_START;
         }
     }
-                
 
     TAILQ_INIT(&sensorListHead);
+    TAILQ_INIT(&sensorTableHead);
+    TAILQ_INIT(&ookListHead);
+    wheelInit(&commandWheel, startTime.tv_sec);
 
-	if (!bcm2835_init()) {
-        log4c_category_crit(clientlog, "bcm2835_init() failed");
-		return ERROR_ENER_INIT_FAIL;
+    if (journal_path != NULL && !journalOpen(journal_path, recoverCommand)) {
+        log4c_category_crit(clientlog, "Unable to use journal %s", journal_path);
+        return ERROR_JOURNAL_OPEN;
     }
-	
-	// LED INIT
-	bcm2835_gpio_fsel(greenLED, BCM2835_GPIO_FSEL_OUTP);			// LED green
-	bcm2835_gpio_fsel(redLED, BCM2835_GPIO_FSEL_OUTP);			// LED red
-    ledControl(greenLED, ledOff);
-    ledControl(redLED, ledOn);
-
-	// RESET
-	bcm2835_gpio_fsel(RESET_PIN, BCM2835_GPIO_FSEL_OUTP);
-	bcm2835_gpio_write(RESET_PIN, HIGH);
-	usleep(10000);
-	bcm2835_gpio_write(RESET_PIN, LOW);
-	usleep(10000);
-
-	// SPI INIT
-	bcm2835_spi_begin();	
-	bcm2835_spi_setClockDivider(SPI_CLOCK_DIVIDER_9p6MHZ); 		
-	bcm2835_spi_setDataMode(BCM2835_SPI_MODE0); 				// CPOL = 0, CPHA = 0
-	bcm2835_spi_chipSelect(BCM2835_SPI_CS1);					// chip select 1
-
-	HRF_config_FSK();
-	HRF_wait_for(ADDR_IRQFLAGS1, MASK_MODEREADY, TRUE);			// wait until ready after mode switching
-	HRF_clr_fifo();
 
+    fskRadio.dio0Pin = configGet()->dio0Pin;
+    /* Copied, as a reload frees the configuration it came from */
+    fskRadio.gpioChip = strdup(configGet()->gpioChip);
+    if (capture_path != NULL && !captureOpen(capture_path)) {
+        log4c_category_crit(clientlog, "Unable to capture to %s", capture_path);
+        return ERROR_CAPTURE_OPEN;
+    }
+
+    if (configGet()->ookRadio) {
+        ookRadio.chipSelect = configGet()->ookChipSelect;
+        ookRadio.resetPin = configGet()->ookResetPin;
+        ookSender = &ookRadio;
+    }
+
+    if (simulate_radio) {
+        log4c_category_warn(clientlog, "Using simulated radios");
+        hrfSimAttach(&fskRadio);
+        hrfSimAttach(&ookRadio);
+    } else {
+        if (!bcm2835_init()) {
+            log4c_category_crit(clientlog, "bcm2835_init() failed");
+            return ERROR_ENER_INIT_FAIL;
+        }
+
+        // LED INIT
+        bcm2835_gpio_fsel(greenLED, BCM2835_GPIO_FSEL_OUTP);			// LED green
+        bcm2835_gpio_fsel(redLED, BCM2835_GPIO_FSEL_OUTP);			// LED red
+    }
+    HRF_led(&fskRadio, greenLED, ledOff);
+    HRF_led(&fskRadio, redLED, ledOn);
+
+    // Gateways sharing a broker each need their own client id
+    snprintf(clientId, sizeof(clientId), "Energenie Controller%s%s", 
+             configGet()->gatewayId[0] != '\0' ? " " : "", configGet()->gatewayId);
     mosquitto_lib_init();
-    mosq = mosquitto_new("Energenie Controller", clean_session, NULL);
+    mosq = mosquitto_new(clientId, clean_session, NULL);
     if(!mosq){
         log4c_category_log(clientlog, LOG4C_PRIORITY_CRIT, "Out of memory");
         return ERROR_MOSQ_NEW;
     }
 
-    if ((mqttBrokerUser[0] != '\0')
-        && (mqttBrokerPass[0] != '\0')) {
-        mosquitto_username_pw_set(mosq, mqttBrokerUser, mqttBrokerPass);
+    config = configGet();
+    if ((config->brokerUser[0] != '\0')
+        && (config->brokerPass[0] != '\0')) {
+        mosquitto_username_pw_set(mosq, config->brokerUser, config->brokerPass);
     }
 
     mosquitto_log_callback_set(mosq, my_log_callback);
-    mosquitto_connect_callback_set(mosq, my_connect_callback);
+    if (config->mqtt5) {
+        mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+        mosquitto_connect_v5_callback_set(mosq, my_connect_v5_callback);
+    } else {
+        mosquitto_connect_callback_set(mosq, my_connect_callback);
+    }
+    mosquitto_disconnect_callback_set(mosq, my_disconnect_callback);
     mosquitto_message_callback_set(mosq, my_message_callback);
     mosquitto_subscribe_callback_set(mosq, my_subscribe_callback);
 
-    if((err = mosquitto_connect_async(mosq, mqttBrokerHost, mqttBrokerPort, keepalive)) 
+    if((err = mosquitto_connect_async(mosq, config->brokerHost, config->brokerPort, 
+                                      config->keepalive)) 
        != MOSQ_ERR_SUCCESS){
         log4c_category_log(clientlog, LOG4C_PRIORITY_CRIT, 
                            "Unable to connect: %d", err);
         return ERROR_MOSQ_CONNECT;
     }
-
-
-
-    if ((err = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS) {
+    if (reactor_mode) {
+        // Driven from runReactor instead of the mosquitto thread
+    } else if ((err = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS) {
         log4c_category_log(clientlog, LOG4C_PRIORITY_CRIT,
                            "Loop start failed: %d", err);
         mosquitto_disconnect(mosq);
@@ -786,223 +4549,95 @@ int main(int argc, char **argv){
         return ERROR_MOSQ_LOOP_START;
     }
 
-    ledControl(redLED, ledOff);
-    ledControl(greenLED, ledOn);
+    if (!reactor_mode 
+        && (err = pthread_create(&publisher, NULL, publisherThread, mosq)) != 0) {
+        log4c_category_log(clientlog, LOG4C_PRIORITY_CRIT,
+                           "Publisher thread start failed: %d", err);
+        mosquitto_disconnect(mosq);
+        mosquitto_loop_stop(mosq, true);
+        mosquitto_destroy(mosq);
+        mosquitto_lib_cleanup();
+        return ERROR_PUBLISHER_START;
+    }
 
-    // clear all the flags from the message data
-    memset(&msgData, 0, sizeof(msgData));
-    while (1){
+    /* The broker connection is made by the mosquitto thread, or in reactor 
+     * mode by the connect, while the radio is brought up.  If the radio still holds the FSK configuration
+     * from a previous run, it is not reset and reconfigured.
+     */
+    if (!simulate_radio) {
+        // SPI INIT
+        bcm2835_spi_begin();	
+        bcm2835_spi_setClockDivider(SPI_CLOCK_DIVIDER_9p6MHZ); 		
+        bcm2835_spi_setDataMode(BCM2835_SPI_MODE0); 				// CPOL = 0, CPHA = 0
+    }
 
-        HRF_receive_FSK_msg(encryptId, eTRVProductId, engManufacturerId, &msgData );
-
-        if (msgData.msgAvailable) {
-            if (msgData.joinCommand) {
-                if ( msgData.manufId == engManufacturerId &&
-                     msgData.prodId == eTRVProductId) {
-
-                    /* We got a join request for an eTRV */
-                    log4c_category_debug(clientlog, "send Join response for sensorId %d", msgData.sensorId);
-
-                    HRF_send_FSK_msg(
-                                     HRF_make_FSK_msg(msgData.manufId, encryptId, 
-                                                      msgData.prodId, msgData.sensorId,
-                                                      2, OT_JOIN_RESP, 0), 
-                                     encryptId);
-                } else {
-                    log4c_category_notice(clientlog, 
-                                          "Received Join message for ManufacturerId:%d ProductId:%d SensorId:%d", 
-                                          msgData.manufId, msgData.prodId, msgData.sensorId);
-                }
-            }
+    warmStart = HRF_init(&fskRadio);
+    if (ookSender == &ookRadio) {
+        HRF_init(&ookRadio);
+        if (!reactor_mode && (err = pthread_create(&ookThread, NULL, ookRadioThread, &ookRadio)) != 0) {
+            log4c_category_crit(clientlog, "OOK radio thread start failed: %d", err);
+            return ERROR_RADIO_THREAD_START;
+        }
+    }
 
-            if (msgData.receivedTempReport) {
-                struct entry *commandToSend = findCommandToSend(msgData.sensorId);
-
-                if (commandToSend) {
-                    switch (commandToSend->command) {
-                        case OT_IDENTIFY:
-                            log4c_category_debug(clientlog, "Sending Identify to device %d", 
-                                                 msgData.sensorId);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId, 
-                                                              2, OT_IDENTIFY, 0),
-                                             encryptId);
-                            break;
-
-                        case OT_TEMP_SET:
-                            log4c_category_debug(clientlog, "Sending Set Temperature %d to device %d",
-                                                 commandToSend->data, msgData.sensorId);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId,
-                                                              4, OT_TEMP_SET, 0x92, 
-                                                              (commandToSend->data & 0xff), 
-                                                              0x00), 
-                                             encryptId);
-
-                            {
-                                // Report temperature set to MQTT broker
-                                char mqttTempSetTopic[strlen(MQTT_TOPIC_SENT_TARGET_TEMP) 
-                                    + MQTT_TOPIC_MAX_SENSOR_LENGTH 
-                                    + 5 + 1];
-
-                                snprintf(mqttTempSetTopic, sizeof(mqttTempSetTopic), "%s/%d", 
-                                         MQTT_TOPIC_SENT_TARGET_TEMP, msgData.sensorId);
-
-                                // Should only be 1 or 2 digits for temperature
-                                char temperature[5];
-                                snprintf(temperature, 4, "%d", commandToSend->data);
-
-                                mosquitto_publish(mosq, NULL, mqttTempSetTopic, 
-                                                  strlen(temperature), temperature,
-                                                  0, false);
-                            }
-                            break;
-
-                        case OT_EXERCISE_VALVE:
-                            log4c_category_notice(clientlog, "Excercise Valve for sensorId %d", msgData.sensorId);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId,
-                                                              2, OT_EXERCISE_VALVE, 0x00 
-                                                             ), 
-                                             encryptId);
-                            break;
-
-                        case OT_REQUEST_VOLTAGE:
-                            log4c_category_notice(clientlog, "Request Voltage for sensorId %d", msgData.sensorId);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId,
-                                                              2, OT_REQUEST_VOLTAGE, 0x00 
-                                                             ), 
-                                             encryptId);
-                            break;
-
-                        case OT_REQUEST_DIAGNOTICS:
-                            log4c_category_notice(clientlog, "Request Diagnostics from device %d",
-                                                  msgData.sensorId);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId,
-                                                              2, OT_REQUEST_DIAGNOTICS, 0x00 
-                                                             ), 
-                                             encryptId);
-                            break;
-
-                        case OT_SET_VALVE_STATE:
-                            log4c_category_notice(clientlog, "Set Valve State %d to sensorId %d",
-                                                  commandToSend->data, msgData.sensorId);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId,
-                                                              3, OT_SET_VALVE_STATE, 0x01, 
-                                                              (commandToSend->data & 0xff)
-                                                             ), 
-                                             encryptId);
-                            break;
-
-                        case OT_SET_LOW_POWER_MODE:
-                            log4c_category_notice(clientlog, "Set Low Power Mode %d to sensorId %d",
-                                                  commandToSend->data, msgData.sensorId);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId,
-                                                              3, OT_SET_LOW_POWER_MODE, 0x01, 
-                                                              (commandToSend->data & 0xff)
-                                                             ), 
-                                             encryptId);
-                            break;
-
-                        case OT_SET_REPORTING_INTERVAL:
-                            log4c_category_notice(clientlog, "Set Reporting Interval %d to sensorId %d",
-                                                  commandToSend->data, msgData.sensorId);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId,
-                                                              3, OT_SET_REPORTING_INTERVAL, 0x02, 
-                                                              (commandToSend->data & 0xff),
-                                                              ((commandToSend->data >> 8) & 0xff)
-                                                             ), 
-                                             encryptId);
-                            break;
-
-
-                        default:
-                            log4c_category_warn(clientlog, "Don't understand command to send %x", 
-                                                commandToSend->command);
-                            HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                              eTRVProductId, msgData.sensorId, 0), 
-                                             encryptId);
-                            break;
-                    }
-                    free(commandToSend);
-                } else {
+    clock_gettime(CLOCK_MONOTONIC, &radioReadyTime);
+    log4c_category_notice(clientlog, "%s start, radio ready after %lldms",
+                          warmStart ? "Warm" : "Cold",
+                          (long long)elapsedMicroseconds(&startTime, &radioReadyTime) / 1000);
 
-                    log4c_category_debug(clientlog, "send NIL command for sensorId %d", msgData.sensorId);
-                    HRF_send_FSK_msg(HRF_make_FSK_msg(engManufacturerId, encryptId, 
-                                                      eTRVProductId, msgData.sensorId, 0), 
-                                     encryptId);
-                }
+    // From here the LEDs only change on the LED timer
+    ledInit(&fskRadio);
 
+    applyConfigChanges();
 
-                log4c_category_info(clientlog, "SensorId=%d Temperature=%s", 
-                                    msgData.sensorId, msgData.receivedTemperature);
-
-                char mqttTopic[strlen(MQTT_TOPIC_SENT_TEMP_REPORT) 
-                    + MQTT_TOPIC_MAX_SENSOR_LENGTH 
-                    + 5 + 1];
-
-                snprintf(mqttTopic, sizeof(mqttTopic), "%s/%d", 
-                         MQTT_TOPIC_SENT_TEMP_REPORT, msgData.sensorId);
-                mosquitto_publish(mosq, NULL, mqttTopic, 
-                                  strlen(msgData.receivedTemperature), msgData.receivedTemperature, 
-                                  1, false);
-            }
-
-            if (msgData.receivedDiagnostics) {
-                char mqttTopic[strlen(MQTT_TOPIC_SENT_DIAGNOSTICS_REPORT) 
-                    + MQTT_TOPIC_MAX_SENSOR_LENGTH 
-                    + 5 + 1];
-                cJSON *root;
-                char *jsonString;
-
-                log4c_category_notice(clientlog, "SensorId=%d Diagnostics 0:%x 1:%x", 
-                                      msgData.sensorId, 
-                                      msgData.diagnosticData[0], 
-                                      msgData.diagnosticData[1]);
-
-                root = createDiagnosticDataJson(msgData.diagnosticData);
-                if (root == NULL) {
-                    log4c_category_error(clientlog, "Unable to create Diagnostic Data JSON object");
-                } else {
-                    snprintf(mqttTopic, sizeof(mqttTopic), "%s/%d", 
-                             MQTT_TOPIC_SENT_DIAGNOSTICS_REPORT, msgData.sensorId);
-                    jsonString = cJSON_Print(root);
-                    log4c_category_debug(clientlog, "Diagnostics %s", jsonString);
-                    mosquitto_publish(mosq, NULL, mqttTopic, strlen(jsonString), jsonString,
-                                      1, false);
-                    free(jsonString);
-                    cJSON_Delete(root);
-                }
-            }
+    if (reactor_mode) {
+        return runReactor(mosq, config_path != NULL ? &reloadSignals : NULL);
+    }
+
+    nextStatisticsTime = time(NULL) + STATISTICS_INTERVAL;
+    nextAggregateTime = time(NULL) + AGGREGATE_SWEEP_SECONDS;
+    nextExpiryTime = time(NULL) + COMMAND_EXPIRY_CHECK_SECONDS;
+
+    if (!ledStartThread()) {
+        log4c_category_error(clientlog, "LED thread start failed, LEDs will not change");
+    }
 
-            if (msgData.receivedVoltage) {
-                char mqttTopic[strlen(MQTT_TOPIC_SENT_VOLTAGE_REPORT) 
-                    + MQTT_TOPIC_MAX_SENSOR_LENGTH 
-                    + 5 + 1];
+    sem_init(&frameRing.ready, 0, 0);
+    if ((err = pthread_create(&decoder, NULL, decoderThread, &fskRadio)) != 0) {
+        log4c_category_crit(clientlog, "Decoder thread start failed: %d", err);
+        return ERROR_RADIO_THREAD_START;
+    }
 
-                log4c_category_notice(clientlog, "SensorId=%d Battery Voltage %s", 
-                                      msgData.sensorId, 
-                                      msgData.voltageData);
+    while (1){
 
-                snprintf(mqttTopic, sizeof(mqttTopic), "%s/%d", 
-                         MQTT_TOPIC_SENT_VOLTAGE_REPORT, msgData.sensorId);
+        applyConfigChanges();
 
-                mosquitto_publish(mosq, NULL, mqttTopic, strlen(msgData.voltageData), 
-                                  msgData.voltageData, 1, false);
-            }
+        readFrame(&fskRadio);
 
-            // clear all the flags from the message data
-            memset(&msgData, 0, sizeof(msgData));
+        if (ookSender == &fskRadio) {
+            sendQueuedOOK(&fskRadio);
         }
-			
+
+        if (time(NULL) >= nextStatisticsTime) {
+            logStatistics();
+            nextStatisticsTime += STATISTICS_INTERVAL;
+        }
+
+        if (time(NULL) >= nextAggregateTime) {
+            sweepAggregates();
+            nextAggregateTime += AGGREGATE_SWEEP_SECONDS;
+        }
+
+        if (time(NULL) >= nextExpiryTime) {
+            expireCommands();
+            nextExpiryTime += COMMAND_EXPIRY_CHECK_SECONDS;
+        }
+
         usleep(5000);
 	}
-	bcm2835_spi_end();
+    if (!simulate_radio) {
+        bcm2835_spi_end();
+    }
 	return 0;
 }
 
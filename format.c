@@ -0,0 +1,208 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Formats the parts of a decoded report that are published, see format.h */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <bcm2835.h>
+#include "format.h"
+
+/* Formats the topic /<topicBase>/<path>/<name>/<sensorId> into topic,
+ * which is MQTT_TOPIC_MAX_LENGTH long.
+ */
+void sensorTopicName(char *topic, const struct config *config, 
+                     const char *path, const char *name, int sensorId) {
+
+    snprintf(topic, MQTT_TOPIC_MAX_LENGTH, "/%s/%s/%s/%d", 
+             config->topicBase, path, name, sensorId);
+}
+
+/* Writes an OpenThings record value with its native type: whole numbers
+ * as integers, fixed point values as floats, characters as text and a 
+ * record without a value as null.  Only 4 bytes of a value are kept by
+ * the decoder.
+ */
+static void cborRecordValue(struct cborWriter *writer, const struct otRecord *record) {
+
+    int length = record->length > 4 ? 4 : record->length;
+    char text[4];
+    double value;
+    int i;
+
+    if (record->type == 7 && length > 0) {
+        for (i = 0; i < length; ++i) {
+            text[i] = record->value >> (8 * (length - 1 - i));
+        }
+        cborText(writer, text, length);
+    } else if (!otRecordValue(record, &value)) {
+        cborNull(writer);
+    } else if (record->type == 0) {
+        cborUint(writer, record->value);
+    } else if (record->type == 8) {
+        cborInt(writer, (int64_t)value);
+    } else {
+        cborFloat(writer, value);
+    }
+}
+
+/* Encodes frame as a CBOR map:
+ *   id    sensorId
+ *   mfr   manufacturerId
+ *   prod  productId
+ *   time  received, epoch seconds (tag 1)
+ *   rssi  dBm
+ *   fei   Hz
+ *   gw    gateway id, if there is one
+ *   recs  array of [paramId, value]
+ */
+void writeFrame(struct cborWriter *writer, const struct reportFrame *frame, 
+                const struct config *config) {
+
+    bool gateway = (config->gatewayId[0] != '\0');
+    int i;
+
+    cborMap(writer, gateway ? 8 : 7);
+    cborString(writer, "id");
+    cborUint(writer, frame->sensorId);
+    cborString(writer, "mfr");
+    cborUint(writer, frame->manufId);
+    cborString(writer, "prod");
+    cborUint(writer, frame->prodId);
+    cborString(writer, "time");
+    cborTag(writer, 1);
+    cborUint(writer, frame->time);
+    cborString(writer, "rssi");
+    cborFloat(writer, frame->rssi);
+    cborString(writer, "fei");
+    cborInt(writer, frame->fei);
+    if (gateway) {
+        cborString(writer, "gw");
+        cborString(writer, config->gatewayId);
+    }
+    cborString(writer, "recs");
+    cborArray(writer, frame->recordCount);
+    for (i = 0; i < frame->recordCount; ++i) {
+        cborArray(writer, 2);
+        cborUint(writer, frame->records[i].paramId);
+        cborRecordValue(writer, &frame->records[i]);
+    }
+}
+
+/* Encodes frame into buf with writeFrame.
+ * Returns the length, or 0 if it didn't fit.
+ */
+size_t encodeFrame(const struct reportFrame *frame, const struct config *config,
+                   uint8_t *buf, size_t size) {
+
+    struct cborWriter writer;
+
+    cborInit(&writer, buf, size);
+    writeFrame(&writer, frame, config);
+    return cborLength(&writer);
+}
+
+/* Returns the value of an OpenThings record as JSON, typed as
+ * cborRecordValue does
+ */
+static cJSON *jsonRecordValue(const struct otRecord *record) {
+
+    int length = record->length > 4 ? 4 : record->length;
+    char text[5];
+    double value;
+    int i;
+
+    if (record->type == 7 && length > 0) {
+        for (i = 0; i < length; ++i) {
+            text[i] = record->value >> (8 * (length - 1 - i));
+        }
+        text[length] = '\0';
+        return cJSON_CreateString(text);
+    }
+    if (!otRecordValue(record, &value)) {
+        return cJSON_CreateNull();
+    }
+    return cJSON_CreateNumber(value);
+}
+
+/* Returns frame as a JSON object with the keys of the CBOR map, or NULL
+ * if it can't be created
+ */
+cJSON *frameToJSON(const struct reportFrame *frame, const struct config *config) {
+
+    cJSON *entry = cJSON_CreateObject();
+    cJSON *records = cJSON_CreateArray();
+    int i;
+
+    if (entry == NULL || records == NULL) {
+        cJSON_Delete(entry);
+        cJSON_Delete(records);
+        return NULL;
+    }
+
+    cJSON_AddNumberToObject(entry, "id", frame->sensorId);
+    cJSON_AddNumberToObject(entry, "mfr", frame->manufId);
+    cJSON_AddNumberToObject(entry, "prod", frame->prodId);
+    cJSON_AddNumberToObject(entry, "time", frame->time);
+    cJSON_AddNumberToObject(entry, "rssi", frame->rssi);
+    cJSON_AddNumberToObject(entry, "fei", frame->fei);
+    if (config->gatewayId[0] != '\0') {
+        cJSON_AddStringToObject(entry, "gw", config->gatewayId);
+    }
+    for (i = 0; i < frame->recordCount; ++i) {
+        cJSON *record = cJSON_CreateArray();
+
+        cJSON_AddItemToArray(record, cJSON_CreateNumber(frame->records[i].paramId));
+        cJSON_AddItemToArray(record, jsonRecordValue(&frame->records[i]));
+        cJSON_AddItemToArray(records, record);
+    }
+    cJSON_AddItemToObject(entry, "recs", records);
+    return entry;
+}
+
+/* Returns link as the LinkQuality JSON object, or NULL if it can't be
+ * created
+ */
+cJSON *linkQualityToJSON(const struct linkQuality *link) {
+
+    cJSON *root = cJSON_CreateObject();
+
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddNumberToObject(root, "rssi", link->rssi);
+    cJSON_AddNumberToObject(root, "meanRssi", link->meanRssi);
+    cJSON_AddNumberToObject(root, "minRssi", link->minRssi);
+    cJSON_AddNumberToObject(root, "fei", link->fei);
+    cJSON_AddNumberToObject(root, "frames", link->frames);
+    cJSON_AddNumberToObject(root, "crcFailures", link->crcFailures);
+    cJSON_AddNumberToObject(root, "crcFailureRate", 
+                            (double)link->crcFailures 
+                            / (link->frames + link->crcFailures));
+    cJSON_AddNumberToObject(root, "missedReports", link->missedReports);
+    cJSON_AddNumberToObject(root, "interval", link->interval);
+    return root;
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
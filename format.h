@@ -0,0 +1,53 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "cJSON.h"
+#include "cbor.h"
+#include "config.h"
+#include "dev_HRF.h"
+
+/* Formatting of what is published for a decoded report: the topic names,
+ * the CBOR Frame message and its JSON form in a batch, and the
+ * LinkQuality JSON.  Kept apart from the publisher so that 'make bench'
+ * times the same code.
+ */
+
+/* Topics are under /<topicBase>/, which is set in the configuration file */
+#define MQTT_TOPIC_MAX_LENGTH (CONFIG_STRING_LENGTH + 64)
+
+struct linkQuality {
+    float rssi;                         // dBm, of this frame
+    float meanRssi;
+    float minRssi;
+    int32_t fei;                        // Hz
+    unsigned long frames;
+    unsigned long crcFailures;
+    unsigned long missedReports;
+    double interval;                    // Seconds
+};
+
+/* A frame as received, for the CBOR Frame and Batch messages */
+struct reportFrame {
+    int sensorId;
+    time_t time;                        // Received, wall clock
+    uint8_t manufId;
+    uint8_t prodId;
+    float rssi;                         // dBm
+    int32_t fei;                        // Hz
+    uint8_t recordCount;
+    struct otRecord records[MAX_OT_RECORDS];
+};
+
+void    sensorTopicName(char *topic, const struct config *config, 
+                        const char *path, const char *name, int sensorId);
+void    writeFrame(struct cborWriter *writer, const struct reportFrame *frame, 
+                   const struct config *config);
+size_t  encodeFrame(const struct reportFrame *frame, const struct config *config,
+                    uint8_t *buf, size_t size);
+cJSON   *frameToJSON(const struct reportFrame *frame, const struct config *config);
+cJSON   *linkQualityToJSON(const struct linkQuality *link);
+
+#endif /* FORMAT_H */
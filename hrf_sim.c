@@ -0,0 +1,227 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Simulated RFM69 SPI backend.
+ *
+ * Registers read back what was written.  The operating mode is ready as
+ * soon as it is set, and anything written to the FIFO in TX mode is sent
+ * straight away.  Frames given to hrfSimInject, starting with the length
+ * byte, are received one at a time in RX mode.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <bcm2835.h>
+#include <log4c.h>
+#include "hrf_sim.h"
+
+#define SIM_REGISTERS 0x80
+#define SIM_RX_FRAMES 8
+
+extern log4c_category_t* hrflog;
+
+struct simFrame {
+    uint8_t len;
+    uint8_t rssi;                       // RssiValue register, -2 * dBm
+    uint8_t data[MAX_FIFO_SIZE];
+};
+
+struct simState {
+    pthread_mutex_t mutex;              // Frames are injected from other threads
+    uint8_t regs[SIM_REGISTERS];
+    struct simFrame rx[SIM_RX_FRAMES];
+    int rxHead;
+    int rxCount;
+    uint8_t rxPos;                      // Bytes of rx[rxHead] read from the FIFO
+    unsigned txBytes;                   // Written to the FIFO since entering TX
+    unsigned long transmitted;
+};
+
+static uint8_t readReg(struct simState *sim, uint8_t addr) {
+
+    uint8_t mode = sim->regs[ADDR_OPMODE] & 0x1c;
+    uint8_t flags = 0;
+
+    switch (addr) {
+        case ADDR_FIFO:
+            if (mode == MODE_RECEIVER && sim->rxCount > 0) {
+                struct simFrame *frame = &sim->rx[sim->rxHead];
+                uint8_t val = frame->data[sim->rxPos++];
+
+                if (sim->rxPos == frame->len) {
+                    sim->rxHead = (sim->rxHead + 1) % SIM_RX_FRAMES;
+                    sim->rxCount--;
+                    sim->rxPos = 0;
+                }
+                return val;
+            }
+            return 0;
+
+        case ADDR_IRQFLAGS1:
+            flags = MASK_MODEREADY;
+            if (mode == MODE_TRANSMITER) {
+                flags |= MASK_TXREADY;
+            }
+            return flags;
+
+        case ADDR_IRQFLAGS2:
+            if (mode == MODE_RECEIVER && sim->rxCount > 0) {
+                // Only the frame being read is in the FIFO
+                flags |= MASK_PAYLOADRDY;
+                if (sim->rxPos > 0) {
+                    flags |= MASK_FIFONOTEMPTY;
+                }
+            }
+            if (mode == MODE_TRANSMITER && sim->txBytes > 0) {
+                flags |= MASK_PACKETSENT;
+            }
+            return flags;
+
+        case ADDR_RSSIVALUE:
+            if (mode == MODE_RECEIVER && sim->rxCount > 0) {
+                return sim->rx[sim->rxHead].rssi;
+            }
+            return sim->regs[ADDR_RSSIVALUE];
+
+        default:
+            return sim->regs[addr & (SIM_REGISTERS - 1)];
+    }
+}
+
+static void writeReg(struct simState *sim, uint8_t addr, uint8_t val) {
+
+    if (addr == ADDR_FIFO) {
+        sim->txBytes++;
+        return;
+    }
+
+    if (addr == ADDR_OPMODE) {
+        if ((sim->regs[ADDR_OPMODE] & 0x1c) == MODE_TRANSMITER && sim->txBytes > 0) {
+            log4c_category_debug(hrflog, "Simulated radio sent %u bytes", sim->txBytes);
+            sim->transmitted++;
+        }
+        sim->txBytes = 0;
+    }
+    sim->regs[addr & (SIM_REGISTERS - 1)] = val;
+}
+
+static void simTransfer(struct hrfRadio *radio, uint8_t *buf, uint32_t len) {
+
+    struct simState *sim = radio->backend;
+    uint8_t addr = buf[0] & ~MASK_WRITE_DATA;
+    uint32_t i;
+
+    pthread_mutex_lock(&sim->mutex);
+    for (i = 1; i < len; ++i) {
+        // Burst accesses move on a register, except for the FIFO
+        buf[i] = readReg(sim, addr ? addr + i - 1 : ADDR_FIFO);
+    }
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+static void simWrite(struct hrfRadio *radio, const uint8_t *buf, uint32_t len) {
+
+    struct simState *sim = radio->backend;
+    uint8_t addr = buf[0] & ~MASK_WRITE_DATA;
+    uint32_t i;
+
+    pthread_mutex_lock(&sim->mutex);
+    for (i = 1; i < len; ++i) {
+        writeReg(sim, addr ? addr + i - 1 : ADDR_FIFO, buf[i]);
+    }
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+static void simReset(struct hrfRadio *radio) {
+
+    struct simState *sim = radio->backend;
+
+    pthread_mutex_lock(&sim->mutex);
+    memset(sim->regs, 0, sizeof(sim->regs));
+    sim->regs[ADDR_OPMODE] = MODE_STANDBY;
+    sim->txBytes = 0;
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+static void simLed(struct hrfRadio *radio, enum ledColor led, enum ledOnOff OnOff) {
+}
+
+static const struct hrfSpiOps hrfSimOps = {
+    simTransfer,
+    simWrite,
+    simReset,
+    simLed
+};
+
+/* Connects the radio to a new simulated board */
+void hrfSimAttach(struct hrfRadio *radio) {
+
+    struct simState *sim = calloc(1, sizeof(struct simState));
+
+    pthread_mutex_init(&sim->mutex, NULL);
+    sim->regs[ADDR_OPMODE] = MODE_STANDBY;
+    radio->backend = sim;
+    radio->spi = &hrfSimOps;
+}
+
+/* Queues a frame, length byte first, to be received with a signal 
+ * strength of rssi dBm.  Returns false if SIM_RX_FRAMES are already waiting.
+ */
+bool hrfSimInject(struct hrfRadio *radio, const uint8_t *frame, uint8_t len, float rssi) {
+
+    struct simState *sim = radio->backend;
+    bool queued = false;
+
+    if (len == 0 || len > MAX_FIFO_SIZE) {
+        return false;
+    }
+
+    pthread_mutex_lock(&sim->mutex);
+    if (sim->rxCount < SIM_RX_FRAMES) {
+        struct simFrame *slot = &sim->rx[(sim->rxHead + sim->rxCount) % SIM_RX_FRAMES];
+
+        memcpy(slot->data, frame, len);
+        slot->len = len;
+        slot->rssi = rssi > 0 ? 0 : rssi < -127 ? 0xff : (uint8_t)(-2 * rssi);
+        sim->rxCount++;
+        queued = true;
+    }
+    pthread_mutex_unlock(&sim->mutex);
+    return queued;
+}
+
+/* Returns the number of transmissions the radio has made */
+unsigned long hrfSimTransmitted(struct hrfRadio *radio) {
+
+    struct simState *sim = radio->backend;
+    unsigned long transmitted;
+
+    pthread_mutex_lock(&sim->mutex);
+    transmitted = sim->transmitted;
+    pthread_mutex_unlock(&sim->mutex);
+    return transmitted;
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
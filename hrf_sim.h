@@ -0,0 +1,13 @@
+#ifndef HRF_SIM_H
+#define HRF_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "dev_HRF.h"
+
+/* Simulated RFM69, for running without a radio board */
+void    hrfSimAttach(struct hrfRadio *radio);
+bool    hrfSimInject(struct hrfRadio *radio, const uint8_t *frame, uint8_t len, float rssi);
+unsigned long hrfSimTransmitted(struct hrfRadio *radio);
+
+#endif /* HRF_SIM_H */
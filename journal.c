@@ -0,0 +1,496 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Append only journal of command queue changes.
+ *
+ * The journal file is memory mapped, so writing a record is a copy into
+ * the mapping under a mutex.  A journal thread flushes the mapping to
+ * disk every JOURNAL_COMMIT_MS if anything was written, so one flush
+ * covers every change made in that time.  Each record carries a sequence
+ * number and checksum, and replay stops at the first record that doesn't
+ * check out, which is where a crash left it.
+ *
+ * When the file is 3/4 full the journal thread compacts it by writing the
+ * commands still queued to a new file, which replaces the old one.  The
+ * mutex is only held to take the length of the old file and to swap
+ * files, so writers carry on appending to the old file while the new one
+ * is flushed.  Should the old file fill up before then, writes wait in
+ * memory to be added to the new file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <log4c.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x4a524e4c        // "JRNL"
+
+struct journalRecord {
+    uint32_t magic;
+    uint32_t sequence;
+    uint8_t op;
+    uint8_t command;
+    uint8_t state;
+    uint8_t priority;
+    int32_t sensorId;
+    uint32_t data;
+    int32_t retries;
+    int64_t queuedTime;
+    uint32_t checksum;                  // Of everything before it, and ttl if set
+    uint32_t ttl;                       // 0 in journals written before it was kept
+};
+
+#define JOURNAL_CAPACITY (JOURNAL_SIZE / sizeof(struct journalRecord))
+#define JOURNAL_COMPACT_AT (JOURNAL_CAPACITY * 3 / 4)
+#define JOURNAL_PENDING 1024            // Writes held while the file is full
+
+extern log4c_category_t* journallog;
+
+static char *journalPath = NULL;
+static int journalFd = -1;
+static struct journalRecord *records = NULL;
+static uint32_t used = 0;
+static uint32_t sequence = 0;
+static struct journalRecord pending[JOURNAL_PENDING];
+static uint32_t pendingCount = 0;
+static bool dirty = false;
+static bool running = false;
+static pthread_t journalThread;
+static pthread_mutex_t journalMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journalWake = PTHREAD_COND_INITIALIZER;
+static struct journalStatistics stats;
+
+/* FNV-1a.  ttl is only included when set, so that records from before
+ * it was kept still check.
+ */
+static uint32_t checksum(const struct journalRecord *record) {
+
+    const uint8_t *p = (const uint8_t *)record;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < offsetof(struct journalRecord, checksum); ++i) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    if (record->ttl != 0) {
+        for (i = offsetof(struct journalRecord, ttl); i < sizeof(*record); ++i) {
+            hash = (hash ^ p[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+static void fillRecord(struct journalRecord *record, uint32_t recordSequence,
+                       enum journalOp op, const struct journalEntry *entry) {
+
+    memset(record, 0, sizeof(*record));
+    record->magic = JOURNAL_MAGIC;
+    record->sequence = recordSequence;
+    record->op = op;
+    record->command = entry->command;
+    record->state = entry->state;
+    record->priority = entry->priority;
+    record->sensorId = entry->sensorId;
+    record->data = entry->data;
+    record->retries = entry->retries;
+    record->queuedTime = entry->queuedTime;
+    record->ttl = entry->ttl;
+    record->checksum = checksum(record);
+}
+
+static void toEntry(const struct journalRecord *record, struct journalEntry *entry) {
+
+    entry->sensorId = record->sensorId;
+    entry->command = record->command;
+    entry->state = record->state;
+    entry->priority = record->priority;
+    entry->retries = record->retries;
+    entry->data = record->data;
+    entry->queuedTime = record->queuedTime;
+    entry->ttl = record->ttl;
+}
+
+/* Maps a journal file of JOURNAL_SIZE, creating it if needed */
+static struct journalRecord *mapFile(const char *path, int *fd) {
+
+    void *map;
+
+    *fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (*fd < 0) {
+        log4c_category_error(journallog, "Unable to open journal %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(*fd, JOURNAL_SIZE) != 0) {
+        log4c_category_error(journallog, "Unable to size journal %s: %s", path, strerror(errno));
+        close(*fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, JOURNAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (map == MAP_FAILED) {
+        log4c_category_error(journallog, "Unable to map journal %s: %s", path, strerror(errno));
+        close(*fd);
+        return NULL;
+    }
+    return map;
+}
+
+/* Replays the valid records among the first limit in from, returning
+ * the commands still queued in the order they were first added.  *valid
+ * is set to the number of valid records and *count to the number of
+ * commands returned, which the caller must free.
+ */
+static struct journalEntry *liveCommands(const struct journalRecord *from, uint32_t limit,
+                                         uint32_t *valid, uint32_t *count) {
+
+    struct journalEntry *live = NULL;
+    uint32_t liveCount = 0;
+    uint32_t liveSize = 0;
+    uint32_t n;
+    uint32_t i;
+    uint32_t j;
+
+    for (n = 0; n < limit; ++n) {
+        const struct journalRecord *record = &from[n];
+
+        if (record->magic != JOURNAL_MAGIC 
+            || record->checksum != checksum(record)
+            || (n > 0 && record->sequence != from[n - 1].sequence + 1)) {
+            break;
+        }
+
+        for (i = 0; i < liveCount; ++i) {
+            if (live[i].sensorId == record->sensorId && live[i].command == record->command) {
+                break;
+            }
+        }
+
+        switch (record->op) {
+            case JOURNAL_ADD:
+            case JOURNAL_REPLACE:
+            case JOURNAL_SEND:
+                if (i == liveCount) {
+                    if (liveCount == liveSize) {
+                        liveSize = liveSize ? liveSize * 2 : 64;
+                        live = realloc(live, liveSize * sizeof(struct journalEntry));
+                    }
+                    liveCount++;
+                }
+                toEntry(record, &live[i]);
+                break;
+
+            case JOURNAL_REMOVE:
+                if (i < liveCount) {
+                    for (j = i + 1; j < liveCount; ++j) {
+                        live[j - 1] = live[j];
+                    }
+                    liveCount--;
+                }
+                break;
+
+            default:
+                log4c_category_warn(journallog, "Unknown journal operation %d", record->op);
+                break;
+        }
+    }
+
+    *valid = n;
+    *count = liveCount;
+    return live;
+}
+
+/* Replays the journal file, discarding anything after a torn record */
+static struct journalEntry *replay(uint32_t *count) {
+
+    struct journalEntry *live = liveCommands(records, JOURNAL_CAPACITY, &used, count);
+
+    sequence = (used > 0) ? records[used - 1].sequence : 0;
+    memset(&records[used], 0, (JOURNAL_CAPACITY - used) * sizeof(struct journalRecord));
+    return live;
+}
+
+/* Copies a record to the end of a new journal, renumbering it */
+static bool moveRecord(struct journalRecord *to, uint32_t *toCount,
+                       const struct journalRecord *record) {
+
+    struct journalEntry entry;
+
+    if (*toCount == JOURNAL_CAPACITY) {
+        return false;
+    }
+    toEntry(record, &entry);
+    fillRecord(&to[*toCount], *toCount + 1, record->op, &entry);
+    (*toCount)++;
+    return true;
+}
+
+/* Rewrites the journal with only the commands still queued.  Called by
+ * the journal thread without journalMutex, which is taken only to read
+ * how much of the file to compact and to swap in the new file.  Only
+ * the journal thread replaces records, so it can read them unlocked.
+ */
+static void compact(void) {
+
+    struct journalEntry *live;
+    struct journalRecord *newRecords;
+    struct journalRecord *oldRecords;
+    uint32_t compacted;
+    uint32_t valid;
+    uint32_t liveCount;
+    uint32_t newUsed;
+    uint32_t lost = 0;
+    uint32_t i;
+    int newFd;
+    int oldFd;
+    size_t pathLength = strlen(journalPath);
+    char newPath[pathLength + 5];
+
+    snprintf(newPath, sizeof(newPath), "%s.new", journalPath);
+    unlink(newPath);
+
+    newRecords = mapFile(newPath, &newFd);
+    if (newRecords == NULL) {
+        return;
+    }
+
+    // Records past compacted are still being appended to
+    pthread_mutex_lock(&journalMutex);
+    compacted = used;
+    pthread_mutex_unlock(&journalMutex);
+
+    live = liveCommands(records, compacted, &valid, &liveCount);
+    for (i = 0; i < liveCount; ++i) {
+        fillRecord(&newRecords[i], i + 1, JOURNAL_ADD, &live[i]);
+    }
+    free(live);
+
+    if (msync(newRecords, JOURNAL_SIZE, MS_SYNC) != 0) {
+        log4c_category_error(journallog, "Unable to flush new journal: %s", strerror(errno));
+        munmap(newRecords, JOURNAL_SIZE);
+        close(newFd);
+        unlink(newPath);
+        return;
+    }
+
+    pthread_mutex_lock(&journalMutex);
+    newUsed = liveCount;
+    for (i = compacted; i < used; ++i) {
+        lost += !moveRecord(newRecords, &newUsed, &records[i]);
+    }
+    for (i = 0; i < pendingCount; ++i) {
+        lost += !moveRecord(newRecords, &newUsed, &pending[i]);
+    }
+
+    if (rename(newPath, journalPath) != 0) {
+        log4c_category_error(journallog, "Unable to replace journal: %s", strerror(errno));
+        pthread_mutex_unlock(&journalMutex);
+        munmap(newRecords, JOURNAL_SIZE);
+        close(newFd);
+        unlink(newPath);
+        // Carry on with the old journal, keeping any pending writes
+        return;
+    }
+
+    oldRecords = records;
+    oldFd = journalFd;
+    records = newRecords;
+    journalFd = newFd;
+    used = newUsed;
+    sequence = newUsed;
+    pendingCount = 0;
+    dirty = (newUsed > liveCount);      // Moved records haven't been flushed
+    stats.compactions++;
+    pthread_mutex_unlock(&journalMutex);
+
+    munmap(oldRecords, JOURNAL_SIZE);
+    close(oldFd);
+    if (lost > 0) {
+        log4c_category_error(journallog, "Journal full, %u command changes not recorded", lost);
+    }
+    log4c_category_info(journallog, "Journal compacted to %u commands", liveCount);
+}
+
+/* Flushes the journal to disk if it has been written to, so that
+ * everything written in one interval shares a single flush, and compacts
+ * it when it fills up.
+ */
+static void *journalThreadMain(void *arg) {
+
+    struct timespec wakeTime;
+
+    pthread_mutex_lock(&journalMutex);
+    while (running) {
+        clock_gettime(CLOCK_REALTIME, &wakeTime);
+        wakeTime.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+        wakeTime.tv_sec += wakeTime.tv_nsec / 1000000000L;
+        wakeTime.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&journalWake, &journalMutex, &wakeTime);
+
+        if (dirty) {
+            dirty = false;
+            pthread_mutex_unlock(&journalMutex);
+
+            // Records written during the flush are picked up next time
+            if (msync(records, JOURNAL_SIZE, MS_SYNC) != 0) {
+                log4c_category_error(journallog, "Journal flush failed: %s", strerror(errno));
+            }
+
+            pthread_mutex_lock(&journalMutex);
+            stats.commits++;
+        }
+
+        if (running && (used >= JOURNAL_COMPACT_AT || pendingCount > 0)) {
+            pthread_mutex_unlock(&journalMutex);
+            compact();
+            pthread_mutex_lock(&journalMutex);
+        }
+    }
+    pthread_mutex_unlock(&journalMutex);
+    return NULL;
+}
+
+/* Opens the journal at path, calling recover for each command that was 
+ * still queued, then starts writing to it.  Returns false if the journal
+ * can't be used.
+ */
+bool journalOpen(const char *path, journalRecoverCallback recover) {
+
+    struct journalEntry *live;
+    uint32_t liveCount;
+    uint32_t replayed;
+    uint32_t i;
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    journalPath = strdup(path);
+    records = mapFile(path, &journalFd);
+    if (records == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&journalMutex);
+    live = replay(&liveCount);
+    replayed = used;
+    running = true;
+    pthread_mutex_unlock(&journalMutex);
+
+    // Recovering a command can change it, which journals the change
+    for (i = 0; i < liveCount; ++i) {
+        recover(&live[i]);
+    }
+    free(live);
+
+    pthread_mutex_lock(&journalMutex);
+    stats.recovered = liveCount;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats.recoveryUs = (end.tv_sec - start.tv_sec) * 1000000L 
+        + (end.tv_nsec - start.tv_nsec) / 1000;
+    log4c_category_notice(journallog, "Recovered %u commands from %u journal records in %ldus",
+                          liveCount, replayed, stats.recoveryUs);
+
+    if (pthread_create(&journalThread, NULL, journalThreadMain, NULL) != 0) {
+        log4c_category_error(journallog, "Unable to start journal thread");
+        running = false;
+        pthread_mutex_unlock(&journalMutex);
+        return false;
+    }
+    pthread_mutex_unlock(&journalMutex);
+    return true;
+}
+
+/* Appends a change to the journal.  Only copies it into the mapping, 
+ * or holds it in memory if the mapping is full, and wakes the journal 
+ * thread to compact it once it is 3/4 full.  The journal thread writes
+ * it to disk.
+ */
+void journalWrite(enum journalOp op, const struct journalEntry *entry) {
+
+    pthread_mutex_lock(&journalMutex);
+    if (!running) {
+        pthread_mutex_unlock(&journalMutex);
+        return;
+    }
+
+    if (used < JOURNAL_CAPACITY) {
+        fillRecord(&records[used++], ++sequence, op, entry);
+        dirty = true;
+    } else if (pendingCount < JOURNAL_PENDING) {
+        fillRecord(&pending[pendingCount++], 0, op, entry);
+    } else {
+        log4c_category_error(journallog, "Journal full, command change not recorded");
+        pthread_mutex_unlock(&journalMutex);
+        return;
+    }
+    stats.records++;
+
+    if (used >= JOURNAL_COMPACT_AT) {
+        pthread_cond_signal(&journalWake);
+    }
+    pthread_mutex_unlock(&journalMutex);
+}
+
+/* Flushes and closes the journal */
+void journalClose(void) {
+
+    pthread_mutex_lock(&journalMutex);
+    if (!running) {
+        pthread_mutex_unlock(&journalMutex);
+        return;
+    }
+    running = false;
+    pthread_cond_signal(&journalWake);
+    pthread_mutex_unlock(&journalMutex);
+
+    pthread_join(journalThread, NULL);
+    if (pendingCount > 0) {
+        compact();
+    }
+    msync(records, JOURNAL_SIZE, MS_SYNC);
+    munmap(records, JOURNAL_SIZE);
+    close(journalFd);
+    records = NULL;
+}
+
+void journalGetStatistics(struct journalStatistics *journalStats) {
+
+    pthread_mutex_lock(&journalMutex);
+    *journalStats = stats;
+    journalStats->used = used;
+    journalStats->capacity = JOURNAL_CAPACITY;
+    pthread_mutex_unlock(&journalMutex);
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
@@ -0,0 +1,53 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Changes made to the eTRV command queue, so that it can be rebuilt
+ * after a restart.  A command is identified by its sensorId and
+ * command, as the queue only holds one of each.
+ */
+enum journalOp {
+    JOURNAL_ADD = 1,
+    JOURNAL_REPLACE,
+    JOURNAL_SEND,                   // Now in flight, or retried
+    JOURNAL_REMOVE                  // Confirmed, failed or finished with
+};
+
+struct journalEntry {
+    int32_t sensorId;
+    uint8_t command;
+    uint8_t state;
+    uint8_t priority;
+    int32_t retries;
+    uint32_t data;
+    int64_t queuedTime;             // Wall clock seconds
+    uint32_t ttl;                   // Seconds from queuedTime it expires, 0 if not kept
+};
+
+/* Size of the journal file, which is compacted when 3/4 full */
+#define JOURNAL_SIZE            (1024 * 1024)
+
+/* Interval between journal writes being flushed to disk together */
+#define JOURNAL_COMMIT_MS       200
+
+typedef void (*journalRecoverCallback)(const struct journalEntry *entry);
+
+bool    journalOpen(const char *path, journalRecoverCallback recover);
+void    journalWrite(enum journalOp op, const struct journalEntry *entry);
+void    journalClose(void);
+
+struct journalStatistics {
+    unsigned long records;          // Written since startup
+    unsigned long commits;          // Flushes to disk
+    unsigned long compactions;
+    unsigned long recovered;        // Commands rebuilt at startup
+    long recoveryUs;
+    uint32_t used;                  // Records in the file
+    uint32_t capacity;
+};
+
+void    journalGetStatistics(struct journalStatistics *stats);
+
+#endif /* JOURNAL_H */
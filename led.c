@@ -0,0 +1,166 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* LED patterns.
+ *
+ * ledEvent only counts the event.  ledTick, from the LED thread or the
+ * reactor's timer, compares the counts with those it has shown, and
+ * writes an LED only when its state changes.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <bcm2835.h>
+#include "dev_HRF.h"
+#include "led.h"
+
+/* Bit n is the LED's state for tick n of the pattern */
+struct ledPattern {
+    uint16_t bits;
+    uint8_t ticks;
+};
+
+static const struct ledPattern eventPatterns[LED_EVENTS] = {
+    [LED_FRAME_RECEIVED] = { 0x01, 2 },         // 100ms
+    [LED_TRANSMIT] = { 0x03, 3 },               // 200ms
+    [LED_ERROR] = { 0x15, 6 }                   // 3 x 100ms
+};
+
+#define LED_DISCONNECTED_TICKS 10               // Green blink period
+
+static struct hrfRadio *ledRadio = NULL;
+static unsigned long eventCounts[LED_EVENTS];   // Written by ledEvent
+static bool brokerConnected = false;
+
+// Only used by ledTick
+static unsigned long shownCounts[LED_EVENTS];
+static const struct ledPattern *redPattern = NULL;
+static unsigned redTick;
+static unsigned greenTick;
+static enum ledOnOff redState;
+static enum ledOnOff greenState;
+
+/* Records that event has happened, for the LEDs to show */
+void ledEvent(enum ledEvent event) {
+
+    __atomic_fetch_add(&eventCounts[event], 1, __ATOMIC_RELAXED);
+}
+
+void ledBrokerConnected(bool connected) {
+
+    __atomic_store_n(&brokerConnected, connected, __ATOMIC_RELAXED);
+}
+
+static void setLed(enum ledColor led, enum ledOnOff *state, enum ledOnOff wanted) {
+
+    if (*state != wanted) {
+        HRF_led(ledRadio, led, wanted);
+        *state = wanted;
+    }
+}
+
+/* Moves the LEDs on by one tick */
+void ledTick(void) {
+
+    int event;
+
+    if (ledRadio == NULL) {
+        return;
+    }
+
+    if (redPattern == NULL) {
+        for (event = LED_EVENTS - 1; event >= 0; --event) {
+            unsigned long count = __atomic_load_n(&eventCounts[event], __ATOMIC_RELAXED);
+
+            if (count != shownCounts[event]) {
+                shownCounts[event] = count;
+                redPattern = &eventPatterns[event];
+                redTick = 0;
+                break;
+            }
+        }
+    }
+
+    if (redPattern != NULL) {
+        setLed(redLED, &redState, (redPattern->bits >> redTick) & 1 ? ledOn : ledOff);
+        if (++redTick == redPattern->ticks) {
+            redPattern = NULL;
+        }
+    } else {
+        setLed(redLED, &redState, ledOff);
+    }
+
+    greenTick = (greenTick + 1) % LED_DISCONNECTED_TICKS;
+    if (__atomic_load_n(&brokerConnected, __ATOMIC_RELAXED) 
+        || greenTick < LED_DISCONNECTED_TICKS / 2) {
+        setLed(greenLED, &greenState, ledOn);
+    } else {
+        setLed(greenLED, &greenState, ledOff);
+    }
+}
+
+/* Takes over the LEDs of radio's board, turning them both off */
+void ledInit(struct hrfRadio *radio) {
+
+    ledRadio = radio;
+    redState = ledOff;
+    greenState = ledOff;
+    HRF_led(ledRadio, redLED, ledOff);
+    HRF_led(ledRadio, greenLED, ledOff);
+}
+
+static void *ledLoop(void *arg) {
+
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        next.tv_nsec += LED_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        ledTick();
+    }
+    return NULL;
+}
+
+/* Runs ledTick from its own thread.  Returns false if it couldn't be
+ * started.
+ */
+bool ledStartThread(void) {
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, ledLoop, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
@@ -0,0 +1,33 @@
+#ifndef LED_H
+#define LED_H
+
+#include <stdbool.h>
+
+/* The board's LEDs are driven from a timer every LED_TICK_MS, so
+ * recording an event costs an atomic increment and no GPIO writes.
+ *
+ * Green: on while connected to the broker, blinking once a second
+ *        while not
+ * Red:   one short blink for frames received, a longer one for frames
+ *        sent and three quick blinks for errors.  Events while a blink
+ *        is showing are shown by one more blink, errors first.
+ */
+#define LED_TICK_MS 100
+
+enum ledEvent {
+    LED_FRAME_RECEIVED,
+    LED_TRANSMIT,
+    LED_ERROR,                      // Highest priority last
+    LED_EVENTS
+};
+
+void    ledEvent(enum ledEvent event);
+void    ledBrokerConnected(bool connected);
+
+struct hrfRadio;
+
+void    ledInit(struct hrfRadio *radio);
+bool    ledStartThread(void);
+void    ledTick(void);
+
+#endif /* LED_H */
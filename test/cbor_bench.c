@@ -0,0 +1,170 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Compares the cost of publishing an eTRV temperature report on the
+ * text topics with the single CBOR Frame message, using the publisher's
+ * own formatting.  The text topics are timed for Temperature alone, as
+ * published by default, and with LinkQuality, which has to be turned on.
+ * Prints the topic and payload bytes and the CPU time to format each,
+ * per report.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <bcm2835.h>
+#include <log4c.h>
+#include "OpenThings.h"
+#include "format.h"
+
+#define REPORTS 200000
+#define SAMPLES 64
+
+log4c_category_t* hrflog;
+
+/* A decoded report, as the publisher is given it */
+struct sample {
+    struct reportFrame frame;
+    struct linkQuality link;
+    char temperature[20];
+};
+
+static struct config config = { .topicBase = "energenie" };
+static struct sample samples[SAMPLES];
+
+static long long threadCpuNs(void) {
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void makeSamples(void) {
+
+    int i;
+
+    for (i = 0; i < SAMPLES; ++i) {
+        struct sample *sample = &samples[i];
+        struct otRecord *record = &sample->frame.records[0];
+
+        sample->frame.sensorId = 300 + i;
+        sample->frame.time = 1760000000 + i;
+        sample->frame.manufId = 4;
+        sample->frame.prodId = 3;
+        sample->frame.rssi = -60.5f - i % 20;
+        sample->frame.fei = 250 * (i % 8);
+        sample->frame.recordCount = 1;
+        record->paramId = OT_TEMP_REPORT;
+        record->type = 9;
+        record->length = 2;
+        record->value = (uint32_t)((18 + (i % 40) / 8.0) * 256);
+        strcpy(sample->temperature, getValString(record->value, record->type, record->length));
+
+        sample->link.rssi = sample->frame.rssi;
+        sample->link.meanRssi = sample->frame.rssi;
+        sample->link.minRssi = sample->frame.rssi - 3;
+        sample->link.fei = sample->frame.fei;
+        sample->link.frames = 1000;
+        sample->link.crcFailures = 3;
+        sample->link.missedReports = 2;
+        sample->link.interval = 300;
+    }
+}
+
+/* The Temperature topic, returning the topic and payload bytes */
+static size_t formatTemperature(const struct sample *sample) {
+
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+
+    sensorTopicName(topic, &config, "eTRV/Report", "Temperature", sample->frame.sensorId);
+    return strlen(topic) + strlen(sample->temperature);
+}
+
+/* The LinkQuality topic */
+static size_t formatLinkQuality(const struct sample *sample) {
+
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+    cJSON *root = linkQualityToJSON(&sample->link);
+    char *json = cJSON_PrintUnformatted(root);
+    size_t bytes;
+
+    sensorTopicName(topic, &config, "eTRV/Report", "LinkQuality", sample->frame.sensorId);
+    bytes = strlen(topic) + strlen(json);
+    free(json);
+    cJSON_Delete(root);
+    return bytes;
+}
+
+/* The Frame message */
+static size_t formatFrame(const struct sample *sample) {
+
+    char topic[MQTT_TOPIC_MAX_LENGTH];
+    uint8_t payload[128];
+
+    sensorTopicName(topic, &config, "eTRV", "Frame", sample->frame.sensorId);
+    return strlen(topic) + encodeFrame(&sample->frame, &config, payload, sizeof(payload));
+}
+
+static void printResult(const char *name, size_t bytes, long long ns) {
+
+    printf("  %-26s %6.1f bytes  %7.1f ns per report\n", 
+           name, (double)bytes / REPORTS, (double)ns / REPORTS);
+}
+
+int main(int argc, char **argv) {
+
+    size_t bytes;
+    long long startNs;
+    int i;
+
+    makeSamples();
+    printf("cbor_bench: %d reports\n", REPORTS);
+
+    bytes = 0;
+    startNs = threadCpuNs();
+    for (i = 0; i < REPORTS; ++i) {
+        bytes += formatTemperature(&samples[i % SAMPLES]);
+    }
+    printResult("Temperature", bytes, threadCpuNs() - startNs);
+
+    bytes = 0;
+    startNs = threadCpuNs();
+    for (i = 0; i < REPORTS; ++i) {
+        bytes += formatTemperature(&samples[i % SAMPLES]);
+        bytes += formatLinkQuality(&samples[i % SAMPLES]);
+    }
+    printResult("Temperature, LinkQuality", bytes, threadCpuNs() - startNs);
+
+    bytes = 0;
+    startNs = threadCpuNs();
+    for (i = 0; i < REPORTS; ++i) {
+        bytes += formatFrame(&samples[i % SAMPLES]);
+    }
+    printResult("CBOR frame", bytes, threadCpuNs() - startNs);
+    return 0;
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
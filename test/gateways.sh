@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Runs two gateways with simulated radios against a private broker and
+# checks that a command one of them fails is dropped by the other, so
+# that it isn't sent again when the other takes the eTRV over.
+#
+# Needs mosquitto, mosquitto_pub and mosquitto_sub.  Run from the top
+# directory once engMQTTClient is built, or with make test.
+
+PORT=${PORT:-18830}
+BASE=energenie
+SENSOR=329
+DIR=$(mktemp -d)
+
+pub() {
+    mosquitto_pub -p $PORT -t "$1" -m "$2"
+}
+
+cleanup() {
+    kill $HALL $LANDING $SUB $BROKER 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+for tool in mosquitto mosquitto_pub mosquitto_sub; do
+    if ! command -v $tool >/dev/null; then
+        echo "gateways: $tool not found, skipped"
+        exit 0
+    fi
+done
+
+mosquitto -p $PORT >"$DIR/broker.log" 2>&1 &
+BROKER=$!
+sleep 1
+
+mosquitto_sub -p $PORT -v -t "/$BASE/#" >"$DIR/messages" &
+SUB=$!
+
+# No retries, so a command not confirmed by the next report fails
+LOG4C_RCPATH=./log4crc ./engMQTTClient -S -R 0 -g hall -p $PORT >"$DIR/hall.log" 2>&1 &
+HALL=$!
+LOG4C_RCPATH=./log4crc ./engMQTTClient -S -R 0 -g landing -p $PORT >"$DIR/landing.log" 2>&1 &
+LANDING=$!
+sleep 2
+
+pub /$BASE/eTRV/Command/Temperature/$SENSOR 21
+sleep 1
+
+# Only hall hears the eTRV, so owns it and sends the command, which the
+# next report doesn't confirm
+pub /$BASE/Simulate/eTRV/$SENSOR '{"temperature": 19.5, "rssi": -70, "gateway": "hall"}'
+sleep 1
+pub /$BASE/Simulate/eTRV/$SENSOR '{"temperature": 19.5, "rssi": -70, "gateway": "hall"}'
+sleep 1
+
+# landing hears it much better and takes over.  Had it kept the command
+# it would send it, and fail it, again.
+for i in 1 2 3; do
+    pub /$BASE/Simulate/eTRV/$SENSOR '{"temperature": 19.5, "rssi": -40, "gateway": "landing"}'
+    sleep 1
+done
+
+failures=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "gateways: $1 was $2, expected $3"
+        failures=$((failures + 1))
+    fi
+}
+
+check "Results published" \
+    "$(grep -c "^/$BASE/eTRV/Result/Temperature/$SENSOR " "$DIR/messages")" 1
+check "Failed Results" \
+    "$(grep -c "^/$BASE/eTRV/Result/Temperature/$SENSOR Failed" "$DIR/messages")" 1
+check "hall gateway Results" \
+    "$(grep -c "^/$BASE/Gateway/Result/$SENSOR .*\"gateway\":\"hall\"" "$DIR/messages")" 1
+check "landing owned Heard" \
+    "$(grep -c "^/$BASE/Gateway/Heard/$SENSOR .*\"gateway\":\"landing\".*\"owner\":true" "$DIR/messages")" 3
+
+if [ $failures -ne 0 ]; then
+    cat "$DIR/messages"
+    exit 1
+fi
+echo "gateways: passed"
@@ -0,0 +1,177 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Runs the radio code against the simulated radio: reading and decoding
+ * an eTRV report, sending the reply, and sending ENER002 bursts from
+ * another thread while frames are being read, as the OOK radio loop does.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <bcm2835.h>
+#include <log4c.h>
+#include "dev_HRF.h"
+#include "OpenThings.h"
+#include "hrf_sim.h"
+
+#define SENSOR_ID 329
+#define BURSTS 4
+#define REPORTS 6
+
+log4c_category_t* hrflog;
+
+static const struct otProduct eTRV = { 4, 3, 242 };     // The defaults in config.c
+static int failures;
+
+static void check(bool ok, const char *what) {
+
+    if (!ok) {
+        printf("hrf_sim: %s failed\n", what);
+        failures++;
+    }
+}
+
+/* Queues a temperature report from sensorId on the simulated radio */
+static bool injectReport(struct hrfRadio *radio, int sensorId, double temperature) {
+
+    int32_t value = (int32_t)(temperature * 256);
+    uint8_t records[4] = { OT_TEMP_REPORT, 0x92, (value >> 8) & 0xff, value & 0xff };
+    uint8_t frame[MAX_FIFO_SIZE];
+
+    HRF_build_FSK_records_msg(frame, eTRV.manufacturerId, eTRV.encryptId, eTRV.productId,
+                              sensorId, records, sizeof(records));
+    return hrfSimInject(radio, frame + 1, frame[MSG_REMAINING_LEN+1] + 1, -70);
+}
+
+/* Reads and decodes the next frame, returning false if there was none */
+static bool receiveReport(struct hrfRadio *radio, struct ReceivedMsgData *msgData) {
+
+    struct hrfFrame frame;
+
+    if (!HRF_read_FSK_frame(radio, &frame)) {
+        return false;
+    }
+    memset(msgData, 0, sizeof(*msgData));
+    HRF_decode_FSK_frame(radio, &frame, &eTRV, 1, msgData);
+    return true;
+}
+
+static void testReadFrame(struct hrfRadio *radio) {
+
+    struct ReceivedMsgData msgData;
+    double value = 0;
+
+    check(injectReport(radio, SENSOR_ID, 19.5), "inject report");
+    check(receiveReport(radio, &msgData), "read frame");
+    check(msgData.msgAvailable && msgData.sensorId == SENSOR_ID, "decode sensorId");
+    check(msgData.manufId == eTRV.manufacturerId && msgData.prodId == eTRV.productId,
+          "decode product");
+    check(msgData.receivedTempReport && msgData.recordCount == 1
+          && msgData.records[0].paramId == OT_TEMP_REPORT
+          && otRecordValue(&msgData.records[0], &value) && value == 19.5,
+          "decode temperature");
+    check(msgData.rssi == -70, "rssi");
+    check(!receiveReport(radio, &msgData), "nothing more to read");
+}
+
+static void testSendReply(struct hrfRadio *radio) {
+
+    uint8_t reply[MAX_FIFO_SIZE];
+    unsigned long before = hrfSimTransmitted(radio);
+
+    HRF_build_FSK_records_msg(reply, eTRV.manufacturerId, eTRV.encryptId, eTRV.productId,
+                              SENSOR_ID, NULL, 0);
+    HRF_send_FSK_frame(radio, reply, NULL);
+    check(hrfSimTransmitted(radio) == before + 1, "reply transmitted");
+    check(radio->mode == MODE_RECEIVER, "receiving after reply");
+}
+
+static void *ookSender(void *arg) {
+
+    struct hrfRadio *radio = arg;
+    uint8_t address[OOK_MSG_ADDRESS_LENGTH] = { 0x8e, 0xe8, 0x8e, 0xe8, 0x8e,
+                                                0xe8, 0x8e, 0xe8, 0x8e, 0xe8 };
+    int i;
+
+    for (i = 0; i < BURSTS; ++i) {
+        HRF_send_OOK_msg(radio, address, 1 + i % 4, i % 2, 2);
+    }
+    return NULL;
+}
+
+static void testOOKHandoff(struct hrfRadio *radio) {
+
+    struct ReceivedMsgData msgData;
+    pthread_t thread;
+    unsigned long before = hrfSimTransmitted(radio);
+    int received = 0;
+    int injected = 0;
+
+    pthread_create(&thread, NULL, ookSender, radio);
+    while (received < REPORTS) {
+        if (injected < REPORTS && injectReport(radio, SENSOR_ID + injected, 18 + injected)) {
+            injected++;
+        }
+        if (receiveReport(radio, &msgData) && msgData.msgAvailable) {
+            received++;
+        }
+    }
+    pthread_join(thread, NULL);
+
+    check(hrfSimTransmitted(radio) == before + BURSTS, "bursts transmitted");
+    check(radio->mode == MODE_RECEIVER && radio->modulation == HRF_MODULATION_FSK,
+          "receiving FSK after bursts");
+    check(!receiveReport(radio, &msgData), "nothing left to read");
+}
+
+int main(int argc, char **argv) {
+
+    struct hrfRadio radio = {
+        .name = "Sim",
+        .receiveFSK = true
+    };
+
+    if (log4c_init()) {
+        fprintf(stderr, "log4c_init() failed");
+        return 1;
+    }
+    hrflog = log4c_category_get("hrf");
+
+    hrfSimAttach(&radio);
+    HRF_init(&radio);
+
+    testReadFrame(&radio);
+    testSendReply(&radio);
+    testOOKHandoff(&radio);
+
+    log4c_fini();
+    if (failures != 0) {
+        return 1;
+    }
+    printf("hrf_sim: passed\n");
+    return 0;
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
@@ -0,0 +1,138 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 gpbenton
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Hierarchical timer wheel.
+ *
+ * Level n holds the timers due within WHEEL_SLOTS^(n+1) ticks, in the
+ * slot given by bits n*WHEEL_BITS up of their expiry.  When the lower
+ * levels wrap, the next slot up is emptied into them, so each timer is
+ * moved at most WHEEL_LEVELS - 1 times before it fires.
+ */
+
+#include <stddef.h>
+#include "timerwheel.h"
+
+void wheelInit(struct timerWheel *wheel, uint64_t now) {
+
+    int level;
+    int slot;
+
+    wheel->now = now;
+    for (level = 0; level < WHEEL_LEVELS; ++level) {
+        for (slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            TAILQ_INIT(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+/* Puts timer in the slot for its expiry, which must not be before now */
+static void place(struct timerWheel *wheel, struct wheelTimer *timer) {
+
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    timer->slot = &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) 
+                                       & (WHEEL_SLOTS - 1)];
+    TAILQ_INSERT_TAIL(timer->slot, timer, timers);
+}
+
+/* Starts timer, to fire when the wheel is advanced to expires.  A timer
+ * already added is moved.  One due now or before fires on the next tick.
+ */
+void wheelAdd(struct timerWheel *wheel, struct wheelTimer *timer, uint64_t expires) {
+
+    wheelCancel(timer);
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    } else if (expires - wheel->now > WHEEL_RANGE) {
+        expires = wheel->now + WHEEL_RANGE;
+    }
+    timer->expires = expires;
+    place(wheel, timer);
+}
+
+/* Stops timer, if it was added */
+void wheelCancel(struct wheelTimer *timer) {
+
+    if (timer->slot != NULL) {
+        TAILQ_REMOVE(timer->slot, timer, timers);
+        timer->slot = NULL;
+    }
+}
+
+bool wheelPending(const struct wheelTimer *timer) {
+
+    return timer->slot != NULL;
+}
+
+/* Moves the timers in a slot of an upper level down to the levels below */
+static void cascade(struct timerWheel *wheel, int level) {
+
+    struct wheelSlot *slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) 
+                                                  & (WHEEL_SLOTS - 1)];
+    struct wheelSlot moving;
+    struct wheelTimer *timer;
+
+    TAILQ_INIT(&moving);
+    TAILQ_CONCAT(&moving, slot, timers);
+    while ((timer = TAILQ_FIRST(&moving)) != NULL) {
+        TAILQ_REMOVE(&moving, timer, timers);
+        place(wheel, timer);
+    }
+}
+
+/* Advances the wheel a tick at a time up to now, calling expired for
+ * each timer as it fires.  The timer is no longer added when expired is
+ * called, so expired may add it again or free it.
+ */
+void wheelAdvance(struct timerWheel *wheel, uint64_t now, 
+                  wheelExpiredCallback expired, void *arg) {
+
+    struct wheelSlot *slot;
+    struct wheelTimer *timer;
+    int level;
+
+    while (wheel->now < now) {
+        wheel->now++;
+
+        for (level = 1; level < WHEEL_LEVELS; ++level) {
+            if ((wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        slot = &wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+        while ((timer = TAILQ_FIRST(slot)) != NULL) {
+            TAILQ_REMOVE(slot, timer, timers);
+            timer->slot = NULL;
+            expired(timer, arg);
+        }
+    }
+}
+
+/* vim: set cindent sw=4 ts=4 expandtab path+=/usr/local/include : */
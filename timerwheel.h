@@ -0,0 +1,43 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* A hierarchical timer wheel.  Adding and cancelling a timer take
+ * constant time, and advancing a tick only looks at the timers due then,
+ * plus every WHEEL_SLOTS ticks those moved down a level.  Timers are
+ * embedded in what they time, so nothing is allocated.
+ *
+ * Ticks are whatever the caller counts in.  A timer further ahead than
+ * WHEEL_RANGE ticks fires at WHEEL_RANGE.
+ */
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    4
+#define WHEEL_RANGE     ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct wheelTimer {
+    TAILQ_ENTRY(wheelTimer) timers;
+    uint64_t expires;               // Tick
+    struct wheelSlot *slot;         // NULL while not added
+};
+
+TAILQ_HEAD(wheelSlot, wheelTimer);
+
+struct timerWheel {
+    uint64_t now;                   // Last tick advanced to
+    struct wheelSlot slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+typedef void (*wheelExpiredCallback)(struct wheelTimer *timer, void *arg);
+
+void    wheelInit(struct timerWheel *wheel, uint64_t now);
+void    wheelAdd(struct timerWheel *wheel, struct wheelTimer *timer, uint64_t expires);
+void    wheelCancel(struct wheelTimer *timer);
+bool    wheelPending(const struct wheelTimer *timer);
+void    wheelAdvance(struct timerWheel *wheel, uint64_t now, 
+                     wheelExpiredCallback expired, void *arg);
+
+#endif /* TIMERWHEEL_H */
@@ -0,0 +1,134 @@
+-- Wireshark dissector for OpenThings frames captured by engMQTTClient -w
+--
+-- Copy to your Wireshark plugins directory, then open the capture.  The
+-- packets use LINKTYPE_USER0 (DLT 147), so this dissector is registered
+-- for it.
+--
+-- Packet: version, direction, flags, RSSI, encryptId, frame length,
+--         the frame as sent over the air, then the frame decrypted
+
+local openthings = Proto("openthings", "OpenThings")
+
+local directions = { [0] = "Received", [1] = "Sent" }
+
+local params = {
+    [0x6A] = "Join", [0x70] = "Power", [0x71] = "Reactive Power",
+    [0x69] = "Current", [0x73] = "Switch State", [0x66] = "Frequency",
+    [0xAA] = "Test", [0x74] = "Temperature", [0x76] = "Voltage",
+    [0x62] = "Battery Voltage", [0x26] = "Diagnostics",
+    [0x23] = "Exercise Valve", [0x25] = "Valve State",
+    [0x24] = "Low Power Mode", [0x3F] = "Identify",
+    [0x52] = "Reporting Interval"
+}
+
+local types = {
+    [0x0] = "Unsigned 0dp", [0x1] = "Unsigned 4dp", [0x2] = "Unsigned 8dp",
+    [0x3] = "Unsigned 12dp", [0x4] = "Unsigned 16dp", [0x5] = "Unsigned 20dp",
+    [0x6] = "Unsigned 24dp", [0x7] = "Characters", [0x8] = "Signed 0dp",
+    [0x9] = "Signed 8dp", [0xA] = "Signed 16dp", [0xB] = "Signed 24dp",
+    [0xC] = "Enumeration", [0xF] = "Float"
+}
+
+local f = openthings.fields
+f.version    = ProtoField.uint8("openthings.version", "Capture Version")
+f.direction  = ProtoField.uint8("openthings.direction", "Direction", base.DEC, directions)
+f.crc_ok     = ProtoField.bool("openthings.crc_ok", "CRC OK", 8, nil, 0x01)
+f.rssi       = ProtoField.int8("openthings.rssi", "RSSI (dBm)")
+f.encrypt_id = ProtoField.uint8("openthings.encrypt_id", "Encryption Id", base.HEX)
+f.length     = ProtoField.uint8("openthings.length", "Length")
+f.raw        = ProtoField.bytes("openthings.raw", "Frame as sent")
+f.manuf_id   = ProtoField.uint8("openthings.manuf_id", "Manufacturer Id", base.HEX)
+f.prod_id    = ProtoField.uint8("openthings.prod_id", "Product Id", base.HEX)
+f.pip        = ProtoField.uint16("openthings.pip", "Encryption Pip", base.HEX)
+f.sensor_id  = ProtoField.uint24("openthings.sensor_id", "Sensor Id")
+f.param      = ProtoField.uint8("openthings.param", "Parameter", base.HEX, params, 0x7F)
+f.command    = ProtoField.bool("openthings.command", "Command", 8, nil, 0x80)
+f.type       = ProtoField.uint8("openthings.type", "Type", base.HEX, types, 0xF0)
+f.value_len  = ProtoField.uint8("openthings.value_len", "Value Length", base.DEC, nil, 0x0F)
+f.value      = ProtoField.bytes("openthings.value", "Value")
+f.crc        = ProtoField.uint16("openthings.crc", "CRC", base.HEX)
+
+-- Turns a record value into a number, with its binary point placed
+local function recordValue(tvb, typedesc)
+    local kind = bit.rshift(typedesc, 4)
+    local len = tvb:len()
+    if len == 0 or kind == 0x7 or kind == 0xF then
+        return nil
+    end
+    local value = tvb:uint()
+    if kind >= 0x8 and kind <= 0xB and len < 4 then
+        local top = 2 ^ (8 * len)
+        if value >= top / 2 then
+            value = value - top
+        end
+    end
+    local dp = ({ [0x1] = 4, [0x2] = 8, [0x3] = 12, [0x4] = 16, [0x5] = 20, [0x6] = 24,
+                  [0x9] = 8, [0xA] = 16, [0xB] = 24 })[kind] or 0
+    return value / 2 ^ dp
+end
+
+function openthings.dissector(tvb, pinfo, tree)
+    if tvb:len() < 6 then
+        return 0
+    end
+    local len = tvb(5, 1):uint()
+    local crcOk = bit.band(tvb(2, 1):uint(), 0x01) ~= 0
+
+    pinfo.cols.protocol = "OpenThings"
+    local subtree = tree:add(openthings, tvb(), "OpenThings")
+    subtree:add(f.version, tvb(0, 1))
+    subtree:add(f.direction, tvb(1, 1))
+    subtree:add(f.crc_ok, tvb(2, 1))
+    subtree:add(f.rssi, tvb(3, 1))
+    subtree:add(f.encrypt_id, tvb(4, 1))
+    subtree:add(f.length, tvb(5, 1))
+    subtree:add(f.raw, tvb(6, len))
+
+    local plain = tvb(6 + len, len):tvb("Decrypted")
+    if len < 10 then
+        return tvb:len()
+    end
+
+    local frame = subtree:add(plain(), "Decrypted Frame")
+    frame:add(f.manuf_id, plain(1, 1))
+    frame:add(f.prod_id, plain(2, 1))
+    frame:add(f.pip, plain(3, 2))
+    frame:add(f.sensor_id, plain(5, 3))
+
+    local sensorId = plain(5, 3):uint()
+    pinfo.cols.info = string.format("%s sensorId %d%s", 
+                                    directions[tvb(1, 1):uint()] or "?", sensorId,
+                                    crcOk and "" or " [CRC failed]")
+
+    -- Records run to the 0 parameter before the CRC
+    local pos = 8
+    while crcOk and pos < len - 2 do
+        local param = plain(pos, 1):uint()
+        if param == 0 then
+            break
+        end
+        local typedesc = plain(pos + 1, 1):uint()
+        local valueLen = bit.band(typedesc, 0x0F)
+        local name = params[bit.band(param, 0x7F)] or string.format("0x%02x", param)
+        local record = frame:add(plain(pos, 2 + valueLen), "Record: " .. name)
+        record:add(f.param, plain(pos, 1))
+        record:add(f.command, plain(pos, 1))
+        record:add(f.type, plain(pos + 1, 1))
+        record:add(f.value_len, plain(pos + 1, 1))
+        if valueLen > 0 then
+            local value = plain(pos + 2, valueLen)
+            local number = recordValue(value, typedesc)
+            if number then
+                record:add(f.value, value):append_text(" (" .. number .. ")")
+            else
+                record:add(f.value, value)
+            end
+        end
+        pinfo.cols.info:append(" " .. name)
+        pos = pos + 2 + valueLen
+    end
+    frame:add(f.crc, plain(len - 2, 2))
+    return tvb:len()
+end
+
+DissectorTable.get("wtap_encap"):add(wtap.USER0, openthings)